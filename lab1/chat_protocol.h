@@ -0,0 +1,374 @@
+#ifndef CHAT_PROTOCOL_H
+#define CHAT_PROTOCOL_H
+
+// 聊天室客户端与服务器共用的协议定义
+//
+// 登录块: 固定 LOGIN_BLOCK_SIZE 字节, [名字长度][名字][0 填充...][魔数 'C' 'H' 'A'][协议版本]
+//   老客户端末尾全是 0, 服务器据此回退到文本协议 (每次 recv 当作一条消息)
+// 分帧协议: 每条消息前加 4 字节大端长度, 长度不含头部
+// 续传协议: 分帧协议之上, 服务器按顺序给下发的每一帧编号 (从 1 开始, 控制帧不计), 第一帧是携带会话令牌的控制帧.
+//   断线重连时登录块带上令牌和已收到的最后一个序号, 服务器只补发缺失的部分
+// 二进制协议: 每帧为 [varint 长度][1 字节操作码][体], 长度包含操作码. 用户名在每个连接上只出现一次,
+//   之后以服务器分配的用户编号引用; 登录块中协商压缩后, 大消息和批量数据以 OP_BATCH 压缩发送
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+
+const int LOGIN_BLOCK_SIZE = 2048;
+const int MAX_NAME_LEN = 48;
+const int FRAME_HEADER_SIZE = 4;
+const uint32_t MAX_FRAME_SIZE = 1 << 20;    // 单条消息上限 1 MiB
+
+enum ChatProtocol {
+    PROTO_TEXT = 0,     // 原始文本, 消息边界依赖 recv
+    PROTO_FRAMED = 1,   // 4 字节长度前缀
+    PROTO_RESUMABLE = 2,    // 分帧协议 + 会话续传
+    PROTO_BINARY = 3,       // 二进制操作码 + varint 长度
+};
+
+// 二进制协议的操作码, 客户端发往服务器的小于 0x80
+enum BinaryOp : uint8_t {
+    OP_SAY = 0x01,          // [正文] 发到当前房间
+    OP_WHISPER = 0x02,      // [1 字节名字长度][名字][正文]
+    OP_LIST = 0x03,
+    OP_QUIT = 0x04,
+    OP_JOIN = 0x05,         // [房间名]
+    OP_LEAVE = 0x06,
+    OP_ROOMS = 0x07,
+    OP_PONG = 0x08,         // 回应 OP_PING
+    OP_SEARCH = 0x09,       // [查询] 全文检索, 结果以 OP_TEXT 返回
+    OP_TEXT = 0x80,         // [文本] 系统消息、提示、历史记录等
+    OP_USER = 0x81,         // [varint 用户编号][名字] 介绍之后会引用的用户
+    OP_CHAT = 0x82,         // [varint 发送者编号][varint 房间名长度][房间名][正文], 大厅的房间名为空
+    OP_PRIVATE = 0x83,      // [varint 发送者编号][正文]
+    OP_BATCH = 0x84,        // [varint 解压后长度][压缩数据], 解压后是若干完整的帧
+    OP_PING = 0x85,         // 心跳, 客户端回 OP_PONG
+};
+
+const char LOGIN_MAGIC[3] = {'C', 'H', 'A'};
+
+// 续传信息在登录块中的位置: 魔数之前的 16 字节, [8 字节令牌][8 字节最后序号], 均为大端
+const int RESUME_TICKET_OFFSET = LOGIN_BLOCK_SIZE - 4 - 16;
+
+// 以该字节开头的帧是控制帧, 由客户端处理而不显示, 也不计入序号
+const char CONTROL_PREFIX = '\x01';
+const char CONTROL_TOKEN[] = "\x01TOKEN ";      // 后跟 16 位十六进制的会话令牌
+const char CONTROL_PING[] = "\x01" "PING";      // 心跳, 客户端回 CONTROL_PONG; 任何数据都能让服务器知道连接还活着
+const char CONTROL_PONG[] = "\x01" "PONG";
+
+// 附件 (仅分帧/续传协议): 客户端发 "/send 用户 字节数 文件名" 后, 用 CONTROL_DATA 帧上传文件内容;
+// 服务器先给接收方发 CONTROL_FILE, 再按块发 CONTROL_CHUNK 帧 (8 字节大端编号 + 数据), 块与块之间穿插聊天消息
+const char CONTROL_DATA[] = "\x01" "D";         // 后跟文件数据
+const char CONTROL_CANCEL[] = "\x01" "CANCEL";  // 服务器拒收或中止上传, 客户端停止发送
+const char CONTROL_FILE[] = "\x01" "FILE ";     // 后跟 "编号 字节数 发送者 文件名"
+const char CONTROL_CHUNK[] = "\x01" "B";        // 后跟 8 字节编号和数据; 各控制帧的类型互不为前缀
+const char CONTROL_ABORT[] = "\x01" "ABORT ";   // 后跟编号, 该附件不会再有数据, 接收方丢弃已收到的部分
+const size_t ATTACH_CHUNK_SIZE = 64 << 10;
+
+// 二进制协议的选项在登录块中的位置, 紧挨在续传信息之前
+const int LOGIN_FLAGS_OFFSET = RESUME_TICKET_OFFSET - 1;
+const uint8_t LOGIN_FLAG_COMPRESS = 0x01;  // 客户端能解压 OP_BATCH
+
+struct ResumeTicket {
+    uint64_t token = 0;     // 0 表示新登录
+    uint64_t lastSeq = 0;   // 客户端已完整收到的最后一帧的序号
+};
+
+inline void buildLoginBlock(char* block, const std::string& userName, int version) {
+    memset(block, 0, LOGIN_BLOCK_SIZE);
+    block[0] = (char)userName.size();
+    memcpy(block + 1, userName.data(), userName.size());
+    if (version != PROTO_TEXT) {
+        memcpy(block + LOGIN_BLOCK_SIZE - 4, LOGIN_MAGIC, 3);
+        block[LOGIN_BLOCK_SIZE - 1] = (char)version;
+    }
+}
+
+inline void encodeU64(char* out, uint64_t value) {
+    for (int i = 0; i < 8; i++) out[i] = (char)(value >> (56 - 8 * i));
+}
+
+inline uint64_t decodeU64(const char* in) {
+    uint64_t value = 0;
+    for (int i = 0; i < 8; i++) value = (value << 8) | (unsigned char)in[i];
+    return value;
+}
+
+inline void writeResumeTicket(char* block, const ResumeTicket& ticket) {
+    encodeU64(block + RESUME_TICKET_OFFSET, ticket.token);
+    encodeU64(block + RESUME_TICKET_OFFSET + 8, ticket.lastSeq);
+}
+
+inline ResumeTicket readResumeTicket(const char* block) {
+    ResumeTicket ticket;
+    ticket.token = decodeU64(block + RESUME_TICKET_OFFSET);
+    ticket.lastSeq = decodeU64(block + RESUME_TICKET_OFFSET + 8);
+    return ticket;
+}
+
+// LEB128 无符号变长整数, 每字节 7 位, 最高位表示后面还有
+inline void putVarint(std::string& out, uint64_t value) {
+    while (value >= 0x80) {
+        out.push_back((char)(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back((char)value);
+}
+
+// 返回消耗的字节数, 0 表示数据不完整, -1 表示超过 10 字节的非法编码
+inline int getVarint(const char* data, size_t len, uint64_t& value) {
+    value = 0;
+    for (size_t i = 0; i < len && i < 10; i++) {
+        value |= (uint64_t)((unsigned char)data[i] & 0x7F) << (7 * i);
+        if (!((unsigned char)data[i] & 0x80)) return (int)i + 1;
+    }
+    return len >= 10 ? -1 : 0;
+}
+
+inline void appendBinaryFrame(std::string& out, uint8_t op, std::string_view body) {
+    putVarint(out, body.size() + 1);
+    out.push_back((char)op);
+    out.append(body.data(), body.size());
+}
+
+// LZ4 块格式的压缩与解压, 每个序列为 [令牌: 字面量长度 4 位 | 匹配长度-4 4 位][扩展长度...][字面量][2 字节小端偏移][扩展长度...].
+// 单遍哈希查找, 速度优先; 解压对所有长度和偏移做边界检查
+const int LZ4_MIN_MATCH = 4;
+const size_t LZ4_LAST_LITERALS = 5;     // 末尾至少 5 字节字面量
+const size_t LZ4_MATCH_LIMIT = 12;      // 最后一个匹配至少在末尾 12 字节之前开始
+const int LZ4_HASH_BITS = 12;
+
+inline size_t lz4Bound(size_t len) {
+    return len + len / 255 + 16;
+}
+
+inline char* lz4PutLength(char* out, size_t len) {
+    while (len >= 255) {
+        *out++ = (char)255;
+        len -= 255;
+    }
+    *out++ = (char)len;
+    return out;
+}
+
+// dst 至少 lz4Bound(len) 字节, 返回压缩后的长度
+inline size_t lz4Compress(const char* src, size_t len, char* dst) {
+    uint32_t table[1 << LZ4_HASH_BITS] = {0};
+    char* out = dst;
+    size_t anchor = 0;
+    size_t pos = 0;
+    while (len > LZ4_MATCH_LIMIT && pos < len - LZ4_MATCH_LIMIT) {
+        uint32_t sequence;
+        memcpy(&sequence, src + pos, 4);
+        uint32_t hash = (sequence * 2654435761u) >> (32 - LZ4_HASH_BITS);
+        size_t ref = table[hash];
+        table[hash] = (uint32_t)pos;
+        uint32_t candidate;
+        memcpy(&candidate, src + ref, 4);
+        if (ref >= pos || pos - ref > 0xFFFF || candidate != sequence) {
+            pos++;
+            continue;
+        }
+        size_t matchLen = LZ4_MIN_MATCH;
+        while (pos + matchLen < len - LZ4_LAST_LITERALS && src[ref + matchLen] == src[pos + matchLen]) matchLen++;
+
+        size_t literals = pos - anchor;
+        char* token = out++;
+        *token = (char)((literals >= 15 ? 15 : literals) << 4);
+        if (literals >= 15) out = lz4PutLength(out, literals - 15);
+        memcpy(out, src + anchor, literals);
+        out += literals;
+        size_t offset = pos - ref;
+        *out++ = (char)offset;
+        *out++ = (char)(offset >> 8);
+        size_t extra = matchLen - LZ4_MIN_MATCH;
+        *token |= (char)(extra >= 15 ? 15 : extra);
+        if (extra >= 15) out = lz4PutLength(out, extra - 15);
+        pos += matchLen;
+        anchor = pos;
+    }
+    size_t literals = len - anchor;
+    *out++ = (char)((literals >= 15 ? 15 : literals) << 4);
+    if (literals >= 15) out = lz4PutLength(out, literals - 15);
+    memcpy(out, src + anchor, literals);
+    return out + literals - dst;
+}
+
+inline bool lz4GetLength(const unsigned char*& in, const unsigned char* end, size_t& len) {
+    unsigned char byte;
+    do {
+        if (in >= end) return false;
+        byte = *in++;
+        len += byte;
+    } while (byte == 255);
+    return true;
+}
+
+// 解压出的数据必须正好是 rawLen 字节
+inline bool lz4Decompress(const char* src, size_t len, char* dst, size_t rawLen) {
+    const unsigned char* in = (const unsigned char*)src;
+    const unsigned char* end = in + len;
+    size_t written = 0;
+    while (in < end) {
+        unsigned char token = *in++;
+        size_t literals = token >> 4;
+        if (literals == 15 && !lz4GetLength(in, end, literals)) return false;
+        if ((size_t)(end - in) < literals || rawLen - written < literals) return false;
+        memcpy(dst + written, in, literals);
+        in += literals;
+        written += literals;
+        if (in == end) break;
+
+        if (end - in < 2) return false;
+        size_t offset = in[0] | (in[1] << 8);
+        in += 2;
+        size_t matchLen = token & 15;
+        if (matchLen == 15 && !lz4GetLength(in, end, matchLen)) return false;
+        matchLen += LZ4_MIN_MATCH;
+        if (offset == 0 || offset > written || rawLen - written < matchLen) return false;
+        // 偏移可能小于匹配长度, 必须逐字节复制
+        for (size_t i = 0; i < matchLen; i++) dst[written + i] = dst[written - offset + i];
+        written += matchLen;
+    }
+    return written == rawLen;
+}
+
+// 解析登录块, 第一个字节是名字长度
+inline bool parseLoginBlock(const char* block, size_t len, std::string& userName, int& version) {
+    if (len < (size_t)LOGIN_BLOCK_SIZE) return false;
+    size_t nameLen = (unsigned char)block[0];
+    if (nameLen == 0 || nameLen > (size_t)MAX_NAME_LEN) return false;
+    userName.assign(block + 1, nameLen);
+    version = PROTO_TEXT;
+    if (memcmp(block + LOGIN_BLOCK_SIZE - 4, LOGIN_MAGIC, 3) == 0) {
+        version = (unsigned char)block[LOGIN_BLOCK_SIZE - 1];
+    }
+    return true;
+}
+
+inline void encodeFrameHeader(char* header, uint32_t len) {
+    header[0] = (char)(len >> 24);
+    header[1] = (char)(len >> 16);
+    header[2] = (char)(len >> 8);
+    header[3] = (char)len;
+}
+
+inline uint32_t decodeFrameHeader(const char* header) {
+    const unsigned char* p = (const unsigned char*)header;
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+enum FrameStatus { FRAME_OK, FRAME_NEED_MORE, FRAME_TOO_LARGE };
+
+// 增量分帧解析器: recv 直接写进内部缓冲区, 完整的消息以视图形式交出, 不逐条拷贝或清零.
+// 交出的视图在下一次 prepare() 之前有效.
+class FrameParser {
+public:
+    // 返回至少 minSpace 字节的可写空间, 必要时把未消费的数据挪到缓冲区开头或扩容
+    char* prepare(size_t minSpace) {
+        if (buf.size() - end < minSpace) {
+            if (start > 0) {
+                memmove(buf.data(), buf.data() + start, end - start);
+                end -= start;
+                start = 0;
+            }
+            if (buf.size() - end < minSpace) {
+                buf.resize(end + minSpace);
+            }
+        }
+        return buf.data() + end;
+    }
+
+    size_t writable() const { return buf.size() - end; }
+    void commit(size_t n) { end += n; }
+    size_t buffered() const { return end - start; }
+
+    // 取出固定长度的数据块 (登录块)
+    bool take(size_t n, std::string_view& out) {
+        if (end - start < n) return false;
+        out = std::string_view(buf.data() + start, n);
+        consume(n);
+        return true;
+    }
+
+    // 取出全部已缓冲数据 (文本协议)
+    std::string_view takeAll() {
+        std::string_view out(buf.data() + start, end - start);
+        consume(end - start);
+        return out;
+    }
+
+    // 查看全部已缓冲数据但不消费 (热重启时交给新进程)
+    std::string_view peekAll() const {
+        return std::string_view(buf.data() + start, end - start);
+    }
+
+    FrameStatus next(std::string_view& out) {
+        if (end - start < (size_t)FRAME_HEADER_SIZE) return FRAME_NEED_MORE;
+        uint32_t len = decodeFrameHeader(buf.data() + start);
+        if (len > MAX_FRAME_SIZE) return FRAME_TOO_LARGE;
+        if (end - start < FRAME_HEADER_SIZE + (size_t)len) return FRAME_NEED_MORE;
+        out = std::string_view(buf.data() + start + FRAME_HEADER_SIZE, len);
+        consume(FRAME_HEADER_SIZE + len);
+        return FRAME_OK;
+    }
+
+    // 二进制协议: 交出 [操作码][体], 不含长度前缀
+    FrameStatus nextBinary(std::string_view& out) {
+        uint64_t len;
+        int n = getVarint(buf.data() + start, end - start, len);
+        if (n < 0 || len > MAX_FRAME_SIZE) return FRAME_TOO_LARGE;
+        if (n == 0 || end - start < (size_t)n + len) return FRAME_NEED_MORE;
+        out = std::string_view(buf.data() + start + n, len);
+        consume(n + len);
+        return FRAME_OK;
+    }
+
+    // 当前未完成的帧还差多少字节, 用来决定下一次 recv 预留多大空间
+    size_t pendingFrameBytes() const {
+        if (end - start < (size_t)FRAME_HEADER_SIZE) return FRAME_HEADER_SIZE - (end - start);
+        uint32_t len = decodeFrameHeader(buf.data() + start);
+        if (len > MAX_FRAME_SIZE) return 0;
+        return FRAME_HEADER_SIZE + len - (end - start);
+    }
+
+    size_t pendingBinaryBytes() const {
+        uint64_t len;
+        int n = getVarint(buf.data() + start, end - start, len);
+        if (n <= 0 || len > MAX_FRAME_SIZE) return 0;
+        return n + len - (end - start);
+    }
+
+    // 把刚交出的一条消息退回解析器, 下次重新交出; 只能紧接在 next/nextBinary/takeAll 之后调用
+    void unread() {
+        start = lastStart;
+        end = lastEnd;
+    }
+
+    // 空闲时释放为大消息扩出来的内存
+    void shrink(size_t keep) {
+        if (start == end && buf.size() > keep) {
+            std::vector<char>(keep).swap(buf);
+            start = end = 0;
+        }
+    }
+
+private:
+    void consume(size_t n) {
+        lastStart = start;
+        lastEnd = end;
+        start += n;
+        if (start == end) start = end = 0;
+    }
+
+    std::vector<char> buf;
+    size_t start = 0;
+    size_t end = 0;
+    size_t lastStart = 0;
+    size_t lastEnd = 0;
+};
+
+#endif
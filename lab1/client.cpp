@@ -5,12 +5,59 @@
 #include <netinet/in.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <string>
+#include <sys/uio.h>
+#include <atomic>
+#include <unordered_map>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <openssl/ssl.h>        // 链接时需要 -lssl -lcrypto
+#include <openssl/err.h>
+#include "chat_protocol.h"
 
 using namespace std;
 
 const int CBUF_SIZE = 2048;
-char userName[CBUF_SIZE];
-char CsendBuf[CBUF_SIZE];
+const int RECONNECT_ATTEMPTS = 30;  // 断线后每秒重连一次, 最多尝试的次数
+char userName[LOGIN_BLOCK_SIZE];
+string loginName;
+
+// 续传: 服务器下发的会话令牌和已收到的最后一帧的序号, 断线重连时带上, 服务器只补发缺失的消息
+uint64_t sessionToken = 0;
+uint64_t lastSeq = 0;
+atomic<bool> reconnecting(false);
+bool quitting = false;
+pthread_mutex_t socketMutex = PTHREAD_MUTEX_INITIALIZER;
+
+// --binary: 使用二进制操作码协议并请求压缩, 服务器只在用户第一次出现时发送名字, 之后用编号
+bool binaryMode = false;
+unordered_map<uint64_t, string> knownUsers;
+
+// 附件: 同一时间只上传一个, 由单独的线程按块发送, 块与块之间释放 socketMutex 让聊天消息插进来
+struct OutgoingFile {
+    int fd;
+    uint64_t size;
+};
+atomic<bool> uploading(false);
+atomic<bool> uploadCancelled(false);
+
+// 正在接收的附件, 以服务器分配的编号区分. 只有用 --recv-dir 指定了接收目录才保存, 否则只提示后丢弃
+const char* recvDir = nullptr;
+struct IncomingFile {
+    int fd;
+    uint64_t remaining;
+    string path;
+    string sender;
+};
+unordered_map<uint64_t, IncomingFile> incomingFiles;
+
+// --tls: 连接后先握手, 请 OpenSSL 把密钥装进内核 (kTLS), 内核接管的方向照常 send/recv;
+// 没有接管的方向改用内存 BIO: 发送先 SSL_write 再写套接字, 接收由读线程 recv 后交给 SSL_read.
+// 两个方向共用一个 SSL, 加解密都在 socketMutex 内进行
+bool useTls = false;
+const char* tlsCaPath = nullptr;    // --tls-ca: 用来校验服务器证书的 CA, 不指定时不校验
+SSL_CTX* tlsContext = nullptr;
+SSL* tlsSession = nullptr;          // 与 LocalhostSocket 一起在 socketMutex 内替换
 
 int LocalhostSocket;
 struct sockaddr_in LocalhostAddr;
@@ -23,7 +70,7 @@ void bindAddress();
 void connectToServer();
 void getUserName();
 void handleUserInput();
-void sendMessage(const char* input);
+void sendMessage(const string& input);
 void handleQuit();
 void* receiveMessages(void*);
 
@@ -44,51 +91,322 @@ void bindAddress() {
     inet_pton(AF_INET, LocalIP, &LocalhostAddr.sin_addr);
 }
 
+bool initTls() {
+    tlsContext = SSL_CTX_new(TLS_client_method());
+    if (tlsContext == nullptr) return false;
+    SSL_CTX_set_min_proto_version(tlsContext, TLS1_2_VERSION);
+    SSL_CTX_set_options(tlsContext, SSL_OP_ENABLE_KTLS);
+    if (tlsCaPath == nullptr) {
+        cout << "未指定 --tls-ca, 不校验服务器证书" << endl;
+        return true;
+    }
+    if (SSL_CTX_load_verify_locations(tlsContext, tlsCaPath, nullptr) != 1) {
+        cout << "加载 CA 证书失败: " << tlsCaPath << endl;
+        return false;
+    }
+    SSL_CTX_set_verify(tlsContext, SSL_VERIFY_PEER, nullptr);
+    return true;
+}
+
+// 在已连接的 sock 上握手, 失败返回 nullptr
+SSL* tlsConnect(int sock) {
+    SSL* ssl = SSL_new(tlsContext);
+    SSL_set_fd(ssl, sock);
+    X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl), LocalIP);
+    if (SSL_connect(ssl) != 1) {
+        char reason[256];
+        ERR_error_string_n(ERR_get_error(), reason, sizeof(reason));
+        cout << "TLS 握手失败: " << reason << endl;
+        SSL_free(ssl);
+        return nullptr;
+    }
+    if (!BIO_get_ktls_send(SSL_get_wbio(ssl))) SSL_set0_wbio(ssl, BIO_new(BIO_s_mem()));
+    if (!BIO_get_ktls_recv(SSL_get_rbio(ssl))) SSL_set0_rbio(ssl, BIO_new(BIO_s_mem()));
+    return ssl;
+}
+
+bool userSpaceSend(SSL* ssl) {
+    return ssl != nullptr && BIO_method_type(SSL_get_wbio(ssl)) == BIO_TYPE_MEM;
+}
+
+bool userSpaceRecv(SSL* ssl) {
+    return ssl != nullptr && BIO_method_type(SSL_get_rbio(ssl)) == BIO_TYPE_MEM;
+}
+
 void connectToServer() {
     if (connect(LocalhostSocket, (struct sockaddr*)&LocalhostAddr, sizeof(LocalhostAddr)) < 0) {
         cout << "连接服务器失败" << endl;
         close(LocalhostSocket);
         exit(-1);
     }
+    if (useTls) {
+        tlsSession = tlsConnect(LocalhostSocket);
+        if (tlsSession == nullptr) {
+            close(LocalhostSocket);
+            exit(-1);
+        }
+        cout << "TLS 握手完成, 发送由" << (userSpaceSend(tlsSession) ? "用户态" : "内核") << "加密, 接收由"
+             << (userSpaceRecv(tlsSession) ? "用户态" : "内核") << "解密" << endl;
+    }
     cout << "成功连接,欢迎加入聊天！" << endl;
 }
 
+// 在 sock 上写完整个 iov, 出错返回 false. 用户态 TLS 时先整体加密再写;
+// 连接已交给读线程之后调用者要持有 socketMutex
+bool writeAll(int sock, SSL* ssl, struct iovec* iov, int iovcnt) {
+    string cipher;
+    struct iovec encrypted;
+    if (userSpaceSend(ssl)) {
+        string plain;
+        for (int i = 0; i < iovcnt; i++) plain.append((const char*)iov[i].iov_base, iov[i].iov_len);
+        if (SSL_write(ssl, plain.data(), plain.size()) <= 0) return false;
+        BIO* wbio = SSL_get_wbio(ssl);
+        cipher.resize(BIO_ctrl_pending(wbio));
+        BIO_read(wbio, &cipher[0], cipher.size());
+        encrypted.iov_base = &cipher[0];
+        encrypted.iov_len = cipher.size();
+        iov = &encrypted;
+        iovcnt = 1;
+    }
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; i++) total += iov[i].iov_len;
+    int first = 0;
+    // 大块可能一次写不完, 剩下的部分接着写, 否则后面的帧会错位
+    while (total > 0) {
+        ssize_t n = writev(sock, iov + first, iovcnt - first);
+        if (n <= 0) return false;
+        total -= n;
+        while (first < iovcnt && (size_t)n >= iov[first].iov_len) {
+            n -= iov[first].iov_len;
+            first++;
+        }
+        if (first < iovcnt) {
+            iov[first].iov_base = (char*)iov[first].iov_base + n;
+            iov[first].iov_len -= n;
+        }
+    }
+    return true;
+}
+
+void sendLogin(int sock, SSL* ssl, const ResumeTicket& ticket) {
+    if (binaryMode) {
+        buildLoginBlock(userName, loginName, PROTO_BINARY);
+        userName[LOGIN_FLAGS_OFFSET] = LOGIN_FLAG_COMPRESS;
+    } else {
+        buildLoginBlock(userName, loginName, PROTO_RESUMABLE);
+        writeResumeTicket(userName, ticket);
+    }
+    struct iovec iov;
+    iov.iov_base = userName;
+    iov.iov_len = sizeof(userName);
+    writeAll(sock, ssl, &iov, 1);
+}
+
+// 断线后重连, 登录块带上令牌和已收到的序号; gotToken 为 false 说明上一次连接没能接回会话, 改为重新登录
+bool reconnect(bool gotToken) {
+    if (!gotToken) {
+        sessionToken = 0;
+        lastSeq = 0;
+    }
+    for (int attempt = 1; attempt <= RECONNECT_ATTEMPTS && !quitting; attempt++) {
+        sleep(1);
+        int sock = socket(AF_INET, SOCK_STREAM, 0);
+        if (sock == -1) continue;
+        if (connect(sock, (struct sockaddr*)&LocalhostAddr, sizeof(LocalhostAddr)) < 0) {
+            close(sock);
+            continue;
+        }
+        SSL* ssl = nullptr;
+        if (useTls && (ssl = tlsConnect(sock)) == nullptr) {
+            close(sock);
+            continue;
+        }
+        ResumeTicket ticket;
+        ticket.token = sessionToken;
+        ticket.lastSeq = lastSeq;
+        sendLogin(sock, ssl, ticket);
+        pthread_mutex_lock(&socketMutex);
+        if (tlsSession != nullptr) SSL_free(tlsSession);
+        tlsSession = ssl;
+        LocalhostSocket = sock;
+        reconnecting = false;
+        pthread_mutex_unlock(&socketMutex);
+        cout << "已重新连接服务器" << endl;
+        return true;
+    }
+    return false;
+}
+
 void getUserName() {
-    cout << "请输入你的聊天用户名（不要含有空格）: ";
-    cin >> userName + 1;
-    userName[0] = char(strlen(userName + 1));
-    send(LocalhostSocket, userName, sizeof(userName), 0);
+    string name;
+    while (true) {
+        cout << "请输入你的聊天用户名（不要含有空格）: ";
+        cin >> name;
+        if (!name.empty() && name.size() <= (size_t)MAX_NAME_LEN) break;
+        cout << "用户名长度需在 1 到 " << MAX_NAME_LEN << " 字节之间" << endl;
+    }
+    cin.ignore();
+    loginName = name;
+    // 登录块末尾带上续传协议的魔数, 之后的消息都加长度头
+    sendLogin(LocalhostSocket, tlsSession, ResumeTicket());
     cout<<"@=============== 聊天室 ===============@"<< endl;
 }
 
-void sendMessage(const char* input) {
-    memset(CsendBuf, 0, CBUF_SIZE);
-    snprintf(CsendBuf, CBUF_SIZE, "%s", input);
-    send(LocalhostSocket, CsendBuf, strlen(CsendBuf), 0);
+void sendBinaryFrame(string& frame) {
+    struct iovec iov;
+    iov.iov_base = &frame[0];
+    iov.iov_len = frame.size();
+    pthread_mutex_lock(&socketMutex);
+    writeAll(LocalhostSocket, tlsSession, &iov, 1);
+    pthread_mutex_unlock(&socketMutex);
+}
+
+// 把输入的命令翻译成操作码, 其余内容都是普通消息
+void sendBinaryMessage(const string& input) {
+    string frame;
+    if (input == "quit") {
+        appendBinaryFrame(frame, OP_QUIT, string_view());
+    } else if (input == "list") {
+        appendBinaryFrame(frame, OP_LIST, string_view());
+    } else if (input == "/leave") {
+        appendBinaryFrame(frame, OP_LEAVE, string_view());
+    } else if (input == "/rooms") {
+        appendBinaryFrame(frame, OP_ROOMS, string_view());
+    } else if (input.compare(0, 6, "/join ") == 0) {
+        appendBinaryFrame(frame, OP_JOIN, string_view(input).substr(6));
+    } else if (input == "/search" || input.compare(0, 8, "/search ") == 0) {
+        appendBinaryFrame(frame, OP_SEARCH, string_view(input).substr(min(input.size(), (size_t)8)));
+    } else if (input[0] == '@' && input.find(' ') != string::npos && input.find(' ') - 1 <= (size_t)MAX_NAME_LEN) {
+        size_t spacePos = input.find(' ');
+        string body(1, (char)(spacePos - 1));
+        body.append(input, 1, spacePos - 1);
+        body.append(input, spacePos + 1, string::npos);
+        appendBinaryFrame(frame, OP_WHISPER, body);
+    } else {
+        appendBinaryFrame(frame, OP_SAY, input);
+    }
+    sendBinaryFrame(frame);
+}
+
+// 发送一帧 [长度][前缀][数据], 整帧在 socketMutex 内写完, 不会与其他线程的帧交错
+void sendFrame(const char* data, size_t len, string_view prefix = string_view()) {
+    char header[FRAME_HEADER_SIZE];
+    encodeFrameHeader(header, prefix.size() + len);
+    struct iovec iov[3];
+    iov[0].iov_base = header;
+    iov[0].iov_len = FRAME_HEADER_SIZE;
+    iov[1].iov_base = (void*)prefix.data();
+    iov[1].iov_len = prefix.size();
+    iov[2].iov_base = (void*)data;
+    iov[2].iov_len = len;
+    pthread_mutex_lock(&socketMutex);
+    writeAll(LocalhostSocket, tlsSession, iov, 3);
+    pthread_mutex_unlock(&socketMutex);
+}
+
+// 上传线程: 每次读一块文件发出去, 服务器拒收、断线或退出时停止
+void* uploadFile(void* arg) {
+    OutgoingFile* file = (OutgoingFile*)arg;
+    char* chunk = new char[ATTACH_CHUNK_SIZE];
+    uint64_t sent = 0;
+    while (sent < file->size && !uploadCancelled && !reconnecting && !quitting) {
+        ssize_t n = read(file->fd, chunk, ATTACH_CHUNK_SIZE);
+        if (n <= 0) break;
+        sendFrame(chunk, n, CONTROL_DATA);
+        sent += n;
+    }
+    if (sent < file->size && !uploadCancelled && !quitting) {
+        cout << "附件上传中断, 已发送 " << sent << " / " << file->size << " 字节" << endl;
+    }
+    delete[] chunk;
+    close(file->fd);
+    delete file;
+    uploading = false;
+    return nullptr;
+}
+
+// "/send 用户名 文件路径": 先发请求, 再由上传线程发送文件内容
+void sendAttachment(const string& input) {
+    size_t spacePos = input.find(' ', 6);
+    if (spacePos == string::npos || spacePos == 6) {
+        cout << "无效的附件格式，使用 /send 用户名 文件路径" << endl;
+        return;
+    }
+    if (binaryMode) {
+        cout << "二进制协议不支持附件" << endl;
+        return;
+    }
+    if (reconnecting) {
+        cout << "正在重连服务器，附件未发送" << endl;
+        return;
+    }
+    if (uploading) {
+        cout << "上一个附件还在上传" << endl;
+        return;
+    }
+    string target = input.substr(6, spacePos - 6);
+    string path = input.substr(spacePos + 1);
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+        cout << "无法读取文件 " << path << endl;
+        if (fd != -1) close(fd);
+        return;
+    }
+    if (st.st_size == 0) {
+        cout << "不能发送空文件" << endl;
+        close(fd);
+        return;
+    }
+    string name = path.substr(path.rfind('/') == string::npos ? 0 : path.rfind('/') + 1);
+    uploading = true;
+    uploadCancelled = false;
+    sendMessage("/send " + target + " " + to_string((uint64_t)st.st_size) + " " + name);
+    pthread_t tid;
+    pthread_create(&tid, nullptr, uploadFile, new OutgoingFile{fd, (uint64_t)st.st_size});
+    pthread_detach(tid);
+}
+
+void sendMessage(const string& input) {
+    if (reconnecting) {
+        cout << "正在重连服务器，消息未发送" << endl;
+        return;
+    }
+    if (binaryMode) {
+        sendBinaryMessage(input);
+        return;
+    }
+    sendFrame(input.data(), input.size());
 }
 
 void handleQuit() {
-    char quitMsg[CBUF_SIZE] = "quit";
-    send(LocalhostSocket, quitMsg, strlen(quitMsg), 0);
+    quitting = true;
+    sendMessage("quit");
     close(LocalhostSocket);
     cout << "退出聊天，关闭连接" << endl;
 }
 
 void handleUserInput() {
-    char input[CBUF_SIZE];
-    while (1) {
-        cin.getline(input, CBUF_SIZE);
+    string input;
+    while (getline(cin, input)) {
         if(!serverDisconnected){
             cout<<"您已与服务器断开连接，无法继续聊天"<<endl;
             cout << "已退出聊天" << endl;
             break;
         }
+        if (input.empty()) continue;
+        if (input.size() > MAX_FRAME_SIZE) {
+            cout << "消息过长，最多 " << MAX_FRAME_SIZE << " 字节" << endl;
+            continue;
+        }
 
-        if (strcmp(input, "quit") == 0) {
+        if (input == "quit") {
             handleQuit();
             break;
-        } else if (strcmp(input, "list") == 0) {
-            send(LocalhostSocket, input, strlen(input), 0);  // 请求在线用户列表
+        } else if (input == "list") {
+            sendMessage(input);  // 请求在线用户列表
+        } else if (input.compare(0, 6, "/send ") == 0) {
+            sendAttachment(input);
         } else if (input[0] == '@') {  // 私聊消息检测
             sendMessage(input);  // 发送私聊消息格式 "@用户名 消息内容"
         } else {
@@ -97,23 +415,229 @@ void handleUserInput() {
     }
 }
 
+// 收到的附件保存在接收目录, 文件名前加上发送者, 已存在时追加序号
+string receivedPath(const string& sender, const string& name) {
+    string base = string(recvDir) + "/recv_" + sender + "_" + name;
+    string path = base;
+    for (int i = 1; access(path.c_str(), F_OK) == 0; i++) path = base + "." + to_string(i);
+    return path;
+}
+
+void discardIncoming(uint64_t id, const char* reason) {
+    auto it = incomingFiles.find(id);
+    if (it == incomingFiles.end()) return;
+    close(it->second.fd);
+    unlink(it->second.path.c_str());
+    cout << "来自 " << it->second.sender << " 的附件" << reason << ", 已丢弃" << endl;
+    incomingFiles.erase(it);
+}
+
+// 附件的数据块: [CONTROL_CHUNK][8 字节编号][数据]
+void handleChunk(string_view message) {
+    size_t prefixLen = strlen(CONTROL_CHUNK);
+    if (message.size() < prefixLen + 8) return;
+    auto it = incomingFiles.find(decodeU64(message.data() + prefixLen));
+    if (it == incomingFiles.end()) return;
+    IncomingFile& file = it->second;
+    string_view data = message.substr(prefixLen + 8);
+    if (data.size() > file.remaining || write(file.fd, data.data(), data.size()) != (ssize_t)data.size()) {
+        discardIncoming(it->first, "写入失败");
+        return;
+    }
+    file.remaining -= data.size();
+    if (file.remaining == 0) {
+        close(file.fd);
+        cout << "已收到 " << file.sender << " 发来的附件, 保存为 " << file.path << endl;
+        incomingFiles.erase(it);
+    }
+}
+
+// 控制帧由客户端自己处理; 每条连接的第一帧是会话令牌, 与之前不同说明是新会话, 序号从头计.
+// 返回 true 表示是令牌
+bool handleControl(string_view message) {
+    auto startsWith = [&](const char* prefix) { return message.substr(0, strlen(prefix)) == prefix; };
+    if (startsWith(CONTROL_CHUNK)) {
+        handleChunk(message);
+    } else if (startsWith(CONTROL_FILE)) {
+        // "编号 字节数 发送者 文件名", 文件名可能含空格, 放在最后
+        string fields(message.substr(strlen(CONTROL_FILE)));
+        unsigned long long id, size;
+        int senderAt = 0;
+        if (sscanf(fields.c_str(), "%llu %llu %n", &id, &size, &senderAt) < 2 || senderAt == 0) return false;
+        size_t nameAt = fields.find(' ', senderAt);
+        if (nameAt == string::npos || nameAt == (size_t)senderAt || nameAt - senderAt > (size_t)MAX_NAME_LEN) return false;
+        string sender = fields.substr(senderAt, nameAt - senderAt);
+        string name = fields.substr(nameAt + 1);
+        if (name.find('/') != string::npos) return false;
+        if (recvDir == nullptr) {
+            cout << sender << " 发送了附件 " << name << " (" << size << " 字节), 未保存: 启动时用 --recv-dir 指定接收目录" << endl;
+            return false;
+        }
+        string path = receivedPath(sender, name);
+        int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (fd == -1) {
+            cout << "无法保存附件 " << path << endl;
+            return false;
+        }
+        incomingFiles[id] = IncomingFile{fd, size, path, sender};
+        cout << sender << " 正在发送附件 " << name << " (" << size << " 字节)" << endl;
+    } else if (startsWith(CONTROL_ABORT)) {
+        discardIncoming(strtoull(string(message.substr(strlen(CONTROL_ABORT))).c_str(), nullptr, 10), "传输中止");
+    } else if (startsWith(CONTROL_CANCEL)) {
+        uploadCancelled = true;
+    } else if (startsWith(CONTROL_PING)) {
+        sendFrame(nullptr, 0, CONTROL_PONG);
+    } else if (startsWith(CONTROL_TOKEN)) {
+        uint64_t token = strtoull(string(message.substr(strlen(CONTROL_TOKEN))).c_str(), nullptr, 16);
+        if (token != sessionToken) {
+            sessionToken = token;
+            lastSeq = 0;
+        }
+        return true;
+    }
+    return false;
+}
+
+string userFor(uint64_t id) {
+    auto it = knownUsers.find(id);
+    return it != knownUsers.end() ? it->second : "#" + to_string(id);
+}
+
+// 处理一帧二进制消息, OP_BATCH 解压后逐帧递归处理
+void handleBinary(string_view frame) {
+    if (frame.empty()) return;
+    uint8_t op = frame[0];
+    const char* p = frame.data() + 1;
+    size_t len = frame.size() - 1;
+    uint64_t id = 0, n = 0;
+    int used;
+    switch (op) {
+    case OP_TEXT:
+        cout << string_view(p, len) << endl;
+        break;
+    case OP_USER:
+        if ((used = getVarint(p, len, id)) <= 0) return;
+        knownUsers[id] = string(p + used, len - used);
+        break;
+    case OP_CHAT: {
+        if ((used = getVarint(p, len, id)) <= 0) return;
+        p += used; len -= used;
+        if ((used = getVarint(p, len, n)) <= 0 || n > len - used) return;
+        string_view room(p + used, n);
+        string_view text(p + used + n, len - used - n);
+        if (!room.empty()) cout << "[" << room << "] ";
+        cout << userFor(id) << ": " << text << endl;
+        break;
+    }
+    case OP_PRIVATE:
+        if ((used = getVarint(p, len, id)) <= 0) return;
+        cout << "私聊 (" << userFor(id) << "): " << string_view(p + used, len - used) << endl;
+        break;
+    case OP_PING: {
+        string pong;
+        appendBinaryFrame(pong, OP_PONG, string_view());
+        sendBinaryFrame(pong);
+        break;
+    }
+    case OP_BATCH: {
+        if ((used = getVarint(p, len, n)) <= 0 || n > MAX_FRAME_SIZE * 4ULL) return;
+        string raw(n, '\0');
+        if (!lz4Decompress(p + used, len - used, &raw[0], n)) {
+            cout << "压缩数据损坏" << endl;
+            return;
+        }
+        size_t pos = 0;
+        while (pos < raw.size()) {
+            uint64_t frameLen;
+            int headerLen = getVarint(raw.data() + pos, raw.size() - pos, frameLen);
+            if (headerLen <= 0 || frameLen > raw.size() - pos - headerLen) return;
+            handleBinary(string_view(raw.data() + pos + headerLen, frameLen));
+            pos += headerLen + frameLen;
+        }
+        break;
+    }
+    }
+}
+
+// 读线程的接收, 返回值与 recv 相同; 用户态 TLS 时收到的密文交给 SSL_read, 凑够一个记录才有数据
+ssize_t receiveSome(char* buf, size_t len) {
+    if (!userSpaceRecv(tlsSession)) return recv(LocalhostSocket, buf, len, 0);
+    char cipher[CBUF_SIZE * 8];
+    while (true) {
+        pthread_mutex_lock(&socketMutex);
+        int n = SSL_read(tlsSession, buf, len);
+        int err = n > 0 ? SSL_ERROR_NONE : SSL_get_error(tlsSession, n);
+        pthread_mutex_unlock(&socketMutex);
+        if (n > 0) return n;
+        if (err == SSL_ERROR_ZERO_RETURN) return 0;
+        if (err != SSL_ERROR_WANT_READ) return -1;
+        ssize_t got = recv(LocalhostSocket, cipher, sizeof(cipher), 0);
+        if (got <= 0) return got;
+        pthread_mutex_lock(&socketMutex);
+        BIO_write(SSL_get_rbio(tlsSession), cipher, got);
+        pthread_mutex_unlock(&socketMutex);
+    }
+}
+
 void* receiveMessages(void*) {
-    char buffer[CBUF_SIZE];
+    FrameParser parser;
+    bool gotToken = false;
     while (true) {
-        memset(buffer, 0, CBUF_SIZE);
-        int bytesReceived = recv(LocalhostSocket, buffer, CBUF_SIZE, 0);
+        size_t reserve = max((size_t)CBUF_SIZE, binaryMode ? parser.pendingBinaryBytes() : parser.pendingFrameBytes());
+        char* space = parser.prepare(reserve);
+        int bytesReceived = receiveSome(space, parser.writable());
         if (bytesReceived <= 0) {
-            cout << "服务器断开连接" << endl;
             close(LocalhostSocket);
+            if (!quitting) {
+                cout << "与服务器的连接中断，正在重连..." << endl;
+                reconnecting = true;
+                // 断线时发到一半的附件不会再续上
+                while (!incomingFiles.empty()) discardIncoming(incomingFiles.begin()->first, "因断线没有收完");
+                if (reconnect(gotToken)) {
+                    parser = FrameParser();
+                    gotToken = false;
+                    continue;
+                }
+            }
+            cout << "服务器断开连接" << endl;
             serverDisconnected = false;
             pthread_exit(nullptr);  // 正常退出线程
         }
-        cout << buffer << endl;  // 输出接收到的消息
+        parser.commit(bytesReceived);
+
+        string_view message;
+        if (binaryMode) {
+            while (parser.nextBinary(message) == FRAME_OK) handleBinary(message);
+            continue;
+        }
+        while (parser.next(message) == FRAME_OK) {
+            if (!message.empty() && message[0] == CONTROL_PREFIX) {
+                if (handleControl(message)) gotToken = true;
+                continue;
+            }
+            lastSeq++;
+            cout << message << endl;  // 输出接收到的消息
+        }
     }
     return nullptr;
 }
 
-int main() {
+int main(int argc, char* argv[]) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--binary") == 0) {
+            binaryMode = true;
+        } else if (strcmp(argv[i], "--tls") == 0) {
+            useTls = true;
+        } else if (strcmp(argv[i], "--tls-ca") == 0 && i + 1 < argc) {
+            useTls = true;
+            tlsCaPath = argv[++i];
+        } else if (strcmp(argv[i], "--recv-dir") == 0 && i + 1 < argc) {
+            recvDir = argv[++i];
+        }
+    }
+    if (useTls && !initTls()) {
+        return -1;
+    }
     if (!createSocket()) {
         return -1;
     }
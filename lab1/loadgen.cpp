@@ -0,0 +1,397 @@
+#include <iostream>
+#include <arpa/inet.h>
+#include <cstring>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstdio>
+#include <ctime>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include "chat_protocol.h"
+
+using namespace std;
+
+// 聊天服务器压测工具: 模拟大量用户按固定速率发言, 统计广播和私聊从发出到送达的延迟分布.
+// 每条压测消息的正文为 "LG <发送时刻ns> <B|P>" 加填充, 接收方用同一台机器的 CLOCK_MONOTONIC 计算延迟,
+// 因此压测工具应与发送、接收两端运行在同一台机器上
+
+const char* serverIP = "127.0.0.1";
+u_short serverPort = 12870;
+int userCount = 100;
+double messageRate = 100;   // 所有用户合计每秒发出的消息数
+int durationSec = 10;
+double privateRatio = 0.1;  // 私聊消息所占比例
+size_t messageSize = 64;    // 正文长度, 不足时用 'x' 填充
+int threadCount = 1;
+
+uint64_t nowNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// 对数线性分桶的延迟直方图, 与 HdrHistogram 思路相同: 每个 2 的幂区间再均分 SUB_BUCKETS 份,
+// 相对误差不超过 1/SUB_BUCKETS, 记录一次只是一次数组自增
+class LatencyHistogram {
+public:
+    static const int SUB_BITS = 6;
+    static const int SUB_BUCKETS = 1 << SUB_BITS;
+
+    LatencyHistogram() : counts((64 - SUB_BITS) * SUB_BUCKETS + 2 * SUB_BUCKETS, 0), total(0), maxValue(0), sum(0) {}
+
+    void record(uint64_t value) {
+        counts[indexOf(value)]++;
+        total++;
+        sum += value;
+        maxValue = max(maxValue, value);
+    }
+
+    void merge(const LatencyHistogram& other) {
+        for (size_t i = 0; i < counts.size(); i++) counts[i] += other.counts[i];
+        total += other.total;
+        sum += other.sum;
+        maxValue = max(maxValue, other.maxValue);
+    }
+
+    // 第 q 分位 (0~1) 所在桶的中点
+    uint64_t percentile(double q) const {
+        if (total == 0) return 0;
+        uint64_t rank = (uint64_t)(q * total);
+        if (rank >= total) rank = total - 1;
+        uint64_t seen = 0;
+        for (size_t i = 0; i < counts.size(); i++) {
+            seen += counts[i];
+            if (seen > rank) return min(midpointOf(i), maxValue);
+        }
+        return maxValue;
+    }
+
+    uint64_t count() const { return total; }
+    uint64_t maximum() const { return maxValue; }
+    double mean() const { return total == 0 ? 0 : (double)sum / total; }
+
+private:
+    static size_t indexOf(uint64_t value) {
+        if (value < (uint64_t)2 * SUB_BUCKETS) return value;
+        int shift = 63 - __builtin_clzll(value) - SUB_BITS;
+        return (size_t)shift * SUB_BUCKETS + (value >> shift);
+    }
+
+    static uint64_t midpointOf(size_t index) {
+        if (index < (size_t)2 * SUB_BUCKETS) return index;
+        int shift = index / SUB_BUCKETS - 1;
+        uint64_t low = (uint64_t)(index - (size_t)shift * SUB_BUCKETS) << shift;
+        return low + ((1ULL << shift) >> 1);
+    }
+
+    vector<uint64_t> counts;
+    uint64_t total;
+    uint64_t maxValue;
+    uint64_t sum;
+};
+
+struct SimUser {
+    int fd;
+    string name;
+    FrameParser parser;
+    string pending;         // 套接字缓冲区满时没发出去的字节
+    bool wantWrite;         // 当前是否关注 EPOLLOUT
+};
+
+struct Worker {
+    int id;
+    pthread_t tid;
+    vector<SimUser*> users;
+    int epollFd;
+    uint64_t startNs;
+    uint64_t stopNs;        // 停止发送的时刻, 之后再接收一段时间让在途消息送达
+    uint64_t drainNs;
+    uint64_t sentBroadcast;
+    uint64_t sentPrivate;
+    uint64_t sendBlocked;   // 发送缓冲区满导致积压的次数
+    uint64_t received;
+    LatencyHistogram broadcastLatency;
+    LatencyHistogram privateLatency;
+};
+
+vector<SimUser*> allUsers;
+
+void raiseFileLimit() {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+// 与 client.cpp 的 getUserName 相同的登录握手: 2048 字节的登录块, 末尾声明分帧协议
+SimUser* connectUser(const struct sockaddr_in& addr, const string& name) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1) return nullptr;
+    if (connect(fd, (const struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return nullptr;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    char loginBlock[LOGIN_BLOCK_SIZE];
+    buildLoginBlock(loginBlock, name, PROTO_FRAMED);
+    if (send(fd, loginBlock, sizeof(loginBlock), MSG_NOSIGNAL) != (ssize_t)sizeof(loginBlock)) {
+        close(fd);
+        return nullptr;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+
+    SimUser* user = new SimUser();
+    user->fd = fd;
+    user->name = name;
+    user->wantWrite = false;
+    return user;
+}
+
+void flushUser(Worker* w, SimUser* user) {
+    while (!user->pending.empty()) {
+        ssize_t n = send(user->fd, user->pending.data(), user->pending.size(), MSG_NOSIGNAL);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) continue;
+            break;
+        }
+        user->pending.erase(0, n);
+    }
+    // 只在是否有积压发生变化时才修改 epoll 关注的事件
+    bool wantWrite = !user->pending.empty();
+    if (wantWrite != user->wantWrite) {
+        user->wantWrite = wantWrite;
+        struct epoll_event ev;
+        ev.events = EPOLLIN | (wantWrite ? (uint32_t)EPOLLOUT : (uint32_t)0);
+        ev.data.ptr = user;
+        epoll_ctl(w->epollFd, EPOLL_CTL_MOD, user->fd, &ev);
+    }
+}
+
+void sendFrame(Worker* w, SimUser* user, const string& message) {
+    char header[FRAME_HEADER_SIZE];
+    encodeFrameHeader(header, message.size());
+    bool wasEmpty = user->pending.empty();
+    user->pending.append(header, FRAME_HEADER_SIZE);
+    user->pending.append(message);
+    if (!wasEmpty) {
+        // 前面还有积压, 保持顺序, 等 EPOLLOUT
+        w->sendBlocked++;
+        return;
+    }
+    flushUser(w, user);
+    if (!user->pending.empty()) w->sendBlocked++;
+}
+
+// 发出一条压测消息, 私聊对象从所有模拟用户中随机挑选
+void sendOne(Worker* w, SimUser* user, unsigned int& seed) {
+    bool isPrivate = allUsers.size() > 1 && rand_r(&seed) < privateRatio * RAND_MAX;
+    string message;
+    if (isPrivate) {
+        SimUser* target = user;
+        while (target == user) target = allUsers[rand_r(&seed) % allUsers.size()];
+        message = "@" + target->name + " ";
+    }
+    message += "LG " + to_string(nowNs()) + (isPrivate ? " P " : " B ");
+    if (message.size() < messageSize) message.append(messageSize - message.size(), 'x');
+    sendFrame(w, user, message);
+    if (isPrivate) w->sentPrivate++;
+    else w->sentBroadcast++;
+}
+
+// 从收到的消息中找出压测正文并记录延迟; 登录通知、历史回放等其他消息忽略
+void recordDelivery(Worker* w, string_view message, uint64_t now) {
+    size_t pos = message.find("LG ");
+    if (pos == string_view::npos) return;
+    // 登录时回放的历史消息可能来自之前的压测, 按发送时刻过滤掉
+    uint64_t sentAt = strtoull(message.data() + pos + 3, nullptr, 10);
+    if (sentAt < w->startNs || sentAt > now) return;
+    bool isPrivate = message.compare(0, strlen("私聊"), "私聊") == 0;
+    w->received++;
+    if (isPrivate) w->privateLatency.record(now - sentAt);
+    else w->broadcastLatency.record(now - sentAt);
+}
+
+void readUser(Worker* w, SimUser* user) {
+    while (true) {
+        char* space = user->parser.prepare(max((size_t)65536, user->parser.pendingFrameBytes()));
+        ssize_t n = recv(user->fd, space, user->parser.writable(), 0);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) continue;
+            if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+                epoll_ctl(w->epollFd, EPOLL_CTL_DEL, user->fd, nullptr);
+                cout << "用户 " << user->name << " 被服务器断开" << endl;
+            }
+            return;
+        }
+        user->parser.commit(n);
+        uint64_t now = nowNs();
+        string_view message;
+        while (user->parser.next(message) == FRAME_OK) {
+            recordDelivery(w, message, now);
+        }
+    }
+}
+
+void* workerLoop(void* arg) {
+    Worker* w = (Worker*)arg;
+    unsigned int seed = (unsigned int)(w->id * 7919 + time(0));
+    double ratePerThread = messageRate / threadCount;
+    size_t nextUser = 0;
+    uint64_t sent = 0;
+    struct epoll_event events[256];
+
+    while (true) {
+        uint64_t now = nowNs();
+        if (now >= w->drainNs) break;
+        // 开环发送: 按计划时间补发到期的消息, 不因服务器变慢而降低发送速率
+        if (now >= w->startNs && now < w->stopNs && !w->users.empty()) {
+            uint64_t due = (uint64_t)((now - w->startNs) / 1e9 * ratePerThread);
+            while (sent < due) {
+                sendOne(w, w->users[nextUser], seed);
+                nextUser = (nextUser + 1) % w->users.size();
+                sent++;
+            }
+        }
+
+        int n = epoll_wait(w->epollFd, events, 256, 1);
+        for (int i = 0; i < n; i++) {
+            SimUser* user = (SimUser*)events[i].data.ptr;
+            if (events[i].events & EPOLLOUT) flushUser(w, user);
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) readUser(w, user);
+        }
+    }
+    return nullptr;
+}
+
+string formatMicros(uint64_t ns) {
+    char text[32];
+    snprintf(text, sizeof(text), "%.1f", ns / 1000.0);
+    return text;
+}
+
+void printHistogram(const string& title, const LatencyHistogram& h) {
+    cout << title << ": " << h.count() << " 次送达";
+    if (h.count() == 0) {
+        cout << endl;
+        return;
+    }
+    cout << ", 延迟 (us) 平均 " << formatMicros(h.mean())
+         << "  p50 " << formatMicros(h.percentile(0.50))
+         << "  p90 " << formatMicros(h.percentile(0.90))
+         << "  p99 " << formatMicros(h.percentile(0.99))
+         << "  p999 " << formatMicros(h.percentile(0.999))
+         << "  max " << formatMicros(h.maximum()) << endl;
+}
+
+void printUsage(const char* prog) {
+    cout << "用法: " << prog << " [--host IP] [--port N] [--users N] [--rate N] [--duration S]"
+         << " [--private-ratio R] [--size N] [--threads N]" << endl;
+    cout << "  --users          模拟用户数, 默认 100" << endl;
+    cout << "  --rate           所有用户合计每秒发出的消息数, 默认 100" << endl;
+    cout << "  --duration       发送持续的秒数, 默认 10, 之后再接收 2 秒" << endl;
+    cout << "  --private-ratio  私聊所占比例, 默认 0.1" << endl;
+    cout << "  --size           消息正文字节数, 默认 64" << endl;
+    cout << "  --threads        压测线程数, 用户平均分给各线程, 默认 1" << endl;
+}
+
+bool parseArgs(int argc, char* argv[]) {
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (i + 1 >= argc) return false;
+        if (arg == "--host") serverIP = argv[++i];
+        else if (arg == "--port") serverPort = atoi(argv[++i]);
+        else if (arg == "--users") userCount = atoi(argv[++i]);
+        else if (arg == "--rate") messageRate = atof(argv[++i]);
+        else if (arg == "--duration") durationSec = atoi(argv[++i]);
+        else if (arg == "--private-ratio") privateRatio = atof(argv[++i]);
+        else if (arg == "--size") messageSize = strtoull(argv[++i], nullptr, 10);
+        else if (arg == "--threads") threadCount = atoi(argv[++i]);
+        else return false;
+    }
+    return userCount > 0 && threadCount > 0 && messageRate > 0 && durationSec > 0;
+}
+
+int main(int argc, char* argv[]) {
+    if (!parseArgs(argc, argv)) {
+        printUsage(argv[0]);
+        return -1;
+    }
+    raiseFileLimit();
+
+    struct sockaddr_in addr;
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(serverPort);
+    inet_pton(AF_INET, serverIP, &addr.sin_addr);
+
+    // 用户名带上进程号, 同时运行多个压测进程也不会重名
+    string prefix = "lg" + to_string(getpid()) + "_";
+    for (int i = 0; i < userCount; i++) {
+        SimUser* user = connectUser(addr, prefix + to_string(i));
+        if (user == nullptr) {
+            cout << "第 " << i << " 个用户连接失败: " << strerror(errno) << endl;
+            return -1;
+        }
+        allUsers.push_back(user);
+    }
+    cout << "已登录 " << userCount << " 个模拟用户" << endl;
+
+    vector<Worker*> workers;
+    uint64_t startNs = nowNs() + 1000000000ULL;   // 留 1 秒让登录通知和历史回放收完
+    for (int i = 0; i < threadCount; i++) {
+        Worker* w = new Worker();
+        w->id = i;
+        w->epollFd = epoll_create1(0);
+        w->startNs = startNs;
+        w->stopNs = startNs + (uint64_t)durationSec * 1000000000ULL;
+        w->drainNs = w->stopNs + 2000000000ULL;
+        for (size_t u = i; u < allUsers.size(); u += threadCount) {
+            w->users.push_back(allUsers[u]);
+            struct epoll_event ev;
+            ev.events = EPOLLIN;
+            ev.data.ptr = allUsers[u];
+            epoll_ctl(w->epollFd, EPOLL_CTL_ADD, allUsers[u]->fd, &ev);
+        }
+        workers.push_back(w);
+    }
+    for (size_t i = 0; i < workers.size(); i++) {
+        pthread_create(&workers[i]->tid, nullptr, workerLoop, workers[i]);
+    }
+
+    LatencyHistogram broadcastLatency, privateLatency;
+    uint64_t sentBroadcast = 0, sentPrivate = 0, sendBlocked = 0, received = 0;
+    for (size_t i = 0; i < workers.size(); i++) {
+        pthread_join(workers[i]->tid, nullptr);
+        broadcastLatency.merge(workers[i]->broadcastLatency);
+        privateLatency.merge(workers[i]->privateLatency);
+        sentBroadcast += workers[i]->sentBroadcast;
+        sentPrivate += workers[i]->sentPrivate;
+        sendBlocked += workers[i]->sendBlocked;
+        received += workers[i]->received;
+    }
+
+    cout << "发送 " << sentBroadcast << " 条广播, " << sentPrivate << " 条私聊, 用时 " << durationSec << " 秒, "
+         << (sentBroadcast + sentPrivate) / durationSec << " 条/秒";
+    if (sendBlocked > 0) cout << " (发送积压 " << sendBlocked << " 次)";
+    cout << endl;
+    uint64_t expected = sentBroadcast * (allUsers.size() - 1) + sentPrivate;
+    cout << "送达 " << received << " / " << expected << " 次, " << received / durationSec << " 次/秒" << endl;
+    printHistogram("广播", broadcastLatency);
+    printHistogram("私聊", privateLatency);
+
+    for (size_t i = 0; i < allUsers.size(); i++) {
+        close(allUsers[i]->fd);
+    }
+    return 0;
+}
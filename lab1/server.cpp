@@ -9,132 +9,6095 @@
 #include <algorithm>
 #include <string>
 #include <ctime>
+#include <cerrno>
+#include <cstdlib>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <atomic>
+#include <string_view>
+#include <unordered_map>
+#include <deque>
+#include <unordered_set>
+#include <new>
+#include <linux/errqueue.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <charconv>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <csignal>
+#include <sys/random.h>
+#include <netdb.h>
+#include <netinet/tcp.h>
+#include <semaphore.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <linux/io_uring.h>
+#include <openssl/ssl.h>        // 链接时需要 -lssl -lcrypto
+#include <openssl/err.h>
+#include "chat_protocol.h"
 
 using namespace std;
 
 const int SERVER_PORT = 12870;
-const int BACKLOG = 10;
+const int BACKLOG = 4096;    // 连接风暴时 accept 队列满会让客户端等待 SYN 重传, 实际上限由 somaxconn 决定
 const int BUFFER_SIZE = 2048;
+const int MAX_EVENTS = 256;
+const int MAX_IOV = 64;     // 每次 writev 最多合并的消息数
+const size_t COMPRESS_MIN_SIZE = 256;   // 协商了压缩的二进制连接, 不小于该长度的消息和所有批量数据尝试压缩
+
+// 服务器并发模型: thread 为原来的每连接一个线程, epoll 为固定线程数的边缘触发 reactor,
+// pool 为一个轮询线程把就绪的连接分派给固定数量的工作线程
+enum ServerMode { MODE_THREAD, MODE_EPOLL, MODE_POOL };
+ServerMode serverMode = MODE_EPOLL;
+int reactorCount = 0;  // reactor 分片数或工作线程数, 0 表示按 CPU 核数自动选择
+
+// 慢速客户端的发送队列超限时的处理策略
+enum SlowConsumerPolicy {
+    SLOW_DROP_OLDEST,   // 丢弃最早的未发送消息
+    SLOW_DISCONNECT,    // 直接断开
+    SLOW_COALESCE,      // 积压的消息合并成一条跳过提示, 只保留最新一条
+};
+SlowConsumerPolicy slowPolicy = SLOW_DROP_OLDEST;
+
+// 单个会话发送超过限速时的处理策略
+enum RatePolicy {
+    RATE_REJECT,        // 丢弃超限的消息, 每轮超限提示发送者一次
+    RATE_DELAY,         // 暂停读取该连接直到令牌补足, 由 TCP 流控把压力传回客户端
+    RATE_DISCONNECT,    // 直接断开
+};
+RatePolicy ratePolicy = RATE_REJECT;
+double rateMsgs = 0;            // 每个会话每秒允许的消息条数, 0 表示不限
+double rateBytes = 0;           // 每个会话每秒允许的消息字节数, 0 表示不限
+double rateBurstSec = 2;        // 令牌桶容量, 按几秒的配额计
+size_t outQueueMaxBytes = 1 << 20;
+size_t outQueueMaxMsgs = 1024;
+size_t zeroCopyThreshold = 0;   // 大于等于该长度的发送使用 MSG_ZEROCOPY, 0 表示关闭
+bool useIoUring = false;        // epoll 模式的收发改用 io_uring, 由 --io uring 开启
+size_t historyBytes = 64 << 10; // 每个房间保留的历史消息字节数, 0 表示关闭
+size_t historyTotalBytes = 64 << 20;    // 所有房间的历史合计的字节数上限, 用完时回收空房间的历史
+size_t historyReplay = 20;      // 进入房间时回放的最近消息条数
+string logDir;                  // 持久化聊天日志的目录, 为空表示不写日志
+size_t logSegmentBytes = 64 << 20;  // 日志段超过该大小后切换到新文件
+size_t searchBytes = 64 << 20;      // 全文检索索引的内存预算, 超出后丢弃最旧的消息; 0 表示关闭检索
+size_t mailboxBytes = 16 << 20;     // 离线私聊信箱共用的内存, 用完后落盘; 0 表示不保存离线私聊
+int resumeGraceSec = 30;        // 续传协议的会话断线后保留的秒数, 0 表示不支持续传
+size_t resumeBytes = 256 << 10; // 每个续传会话保留的最近下发消息字节数, 断线重连时从中补发
+int heartbeatSec = 30;          // 能应答心跳的连接静默这么久后发一次 PING, 再过同样久仍无数据则断开; 其他连接按此间隔做 TCP keepalive; 0 表示关闭
+int idleTimeoutSec = 0;         // 不能应答心跳的连接 (文本和分帧协议) 静默超过该秒数后断开, 0 表示不限
+const int LOGIN_TIMEOUT_SEC = 10;   // 连上之后这么久还没发完登录块就断开
+const int THREAD_SEND_TIMEOUT_SEC = 5;  // 线程模式和线程池模式下阻塞发送的上限, 超时说明对方不再读取, 断开它
+const int KEEPALIVE_PROBES = 3;     // 不能应答心跳的连接用 TCP keepalive 探测, 连续这么多次无应答后断开
+string statsSocketPath;         // 统计信息的 Unix 域套接字路径, 为空表示不开启
+size_t attachMaxBytes = 256 << 20;  // 单个附件的大小上限, 0 表示不接收附件
+string spoolDir = "/tmp";       // 上传中的附件和落盘的离线私聊的暂存目录, 文件创建后立即 unlink
+string tlsCertPath;             // 客户端端口的 TLS 证书链, 与私钥都指定时开启 TLS
+string tlsKeyPath;
+int serverPort = SERVER_PORT;   // 客户端连接的端口, 本机运行多个节点时各用一个
+int nodeId = 1;                 // 本节点在联邦中的编号, 各节点不能相同
+int relayPort = 0;              // 接收其他节点中继连接的端口, 0 表示不加入联邦
+vector<string> peerAddrs;       // 其他节点的中继地址 host:port
+int takeoverFd = -1;            // 热重启时从旧进程接收状态的 Unix 套接字, 由 --takeover-fd 传入
+string serverBinaryPath;        // 热重启时默认执行的程序, 即当前程序的路径
+vector<string> serverArgs;      // 启动参数, 热重启时原样传给新进程
 
 int serverSocket;
 struct sockaddr_in serverAddr;
 
-vector<int> clientSockets;
-vector<string> userNames;
+// 线程模式下的在线连接 fd -> 会话句柄, 广播时遍历. 以只读快照发布, 由 clientsMutex 串行化写者;
+// 写者等读者离开后才返回, 所以读区内向其中的 fd 发送时, fd 不会被关闭复用
+typedef unordered_map<int, uint64_t> ThreadClientTable;
+atomic<const ThreadClientTable*> threadClients(new ThreadClientTable());
 pthread_mutex_t clientsMutex;
 bool serverRunning = true;  // 控制服务器状态
+int shutdownEventFd = -1;   // 写入后唤醒所有 reactor 线程退出
+atomic<bool> handoffPending(false);     // 热重启: reactor 线程暂停, 由主线程把状态交给新进程
+atomic<uint32_t> nextUserId(1);         // 二进制协议中引用用户的编号, 每次登录分配新的, 不复用
+atomic<int> binaryClients(0);           // 在线的二进制协议连接数, 为 0 时不生成二进制编码
 
-void broadcastMessage(const string& message, int senderSocket) {
-    pthread_mutex_lock(&clientsMutex);
-    for (int i = 0; i < clientSockets.size(); i++) {
-        if (clientSockets[i] != senderSocket) {
-            send(clientSockets[i], message.c_str(), message.size(), 0);
+// ==================== 读多写少的快照 ====================
+
+// 在线用户表这类读远多于写的数据以不可变快照发布: 读者不加锁, 直接读当前指针;
+// 写者复制一份修改后原子替换, 再等已经进入读区的读者全部离开才释放旧快照.
+// 读者进入时按当前周期的奇偶在本线程的槽上计数; 写者把周期推进两次, 每次等上一周期的计数清零,
+// 这样读到周期之后才计数的读者也不会漏掉. 写者要等待, 读区内不能做会阻塞在写者上的事
+const int READER_SLOTS = 128;
+
+struct alignas(64) ReaderSlot {
+    atomic<uint64_t> active[2];
+};
+
+struct ReadDomain {
+    ReaderSlot slots[READER_SLOTS];
+    atomic<uint64_t> epoch;
+    pthread_mutex_t syncMutex;      // 同一时刻只有一个写者推进周期
+    pthread_mutex_t retiredMutex;
+    vector<pair<const void*, void (*)(const void*)>> retired;   // 推迟释放的旧快照
+};
+
+const size_t MAX_DEFERRED_SNAPSHOTS = 64;
+
+atomic<int> nextReaderSlot(0);
+
+inline int myReaderSlot() {
+    thread_local int slot = nextReaderSlot.fetch_add(1, memory_order_relaxed) % READER_SLOTS;
+    return slot;
+}
+
+// 读区, 在作用域内读到的快照指针都保持有效
+class ReadSection {
+public:
+    explicit ReadSection(ReadDomain& domain) {
+        counter = &domain.slots[myReaderSlot()].active[domain.epoch.load(memory_order_seq_cst) & 1];
+        counter->fetch_add(1, memory_order_seq_cst);
+    }
+    ~ReadSection() { counter->fetch_sub(1, memory_order_release); }
+    ReadSection(const ReadSection&) = delete;
+    ReadSection& operator=(const ReadSection&) = delete;
+
+private:
+    atomic<uint64_t>* counter;
+};
+
+void initReadDomain(ReadDomain& domain) {
+    for (int i = 0; i < READER_SLOTS; i++) {
+        domain.slots[i].active[0].store(0);
+        domain.slots[i].active[1].store(0);
+    }
+    domain.epoch.store(0);
+    pthread_mutex_init(&domain.syncMutex, nullptr);
+    pthread_mutex_init(&domain.retiredMutex, nullptr);
+}
+
+// 等待调用前已经进入读区的读者全部离开, 顺带释放此前推迟的旧快照
+void synchronizeReaders(ReadDomain& domain) {
+    vector<pair<const void*, void (*)(const void*)>> retired;
+    pthread_mutex_lock(&domain.retiredMutex);
+    retired.swap(domain.retired);
+    pthread_mutex_unlock(&domain.retiredMutex);
+
+    pthread_mutex_lock(&domain.syncMutex);
+    for (int pass = 0; pass < 2; pass++) {
+        uint64_t parity = domain.epoch.fetch_add(1, memory_order_seq_cst) & 1;
+        while (true) {
+            uint64_t active = 0;
+            for (int i = 0; i < READER_SLOTS; i++) {
+                active += domain.slots[i].active[parity].load(memory_order_acquire);
+            }
+            if (active == 0) break;
+            sched_yield();
+        }
+    }
+    pthread_mutex_unlock(&domain.syncMutex);
+    for (auto& entry : retired) entry.second(entry.first);
+}
+
+template <typename T>
+void deleteSnapshot(const void* snapshot) {
+    delete (const T*)snapshot;
+}
+
+// 新快照已经发布, 等读者离开后释放旧的
+template <typename T>
+void retireSnapshot(ReadDomain& domain, const T* old) {
+    synchronizeReaders(domain);
+    delete old;
+}
+
+// 不需要马上确认读者离开时 (如上线), 旧快照留到下一次同步时释放, 积压太多才就地同步
+template <typename T>
+void deferSnapshot(ReadDomain& domain, const T* old) {
+    pthread_mutex_lock(&domain.retiredMutex);
+    domain.retired.emplace_back(old, deleteSnapshot<T>);
+    bool full = domain.retired.size() >= MAX_DEFERRED_SNAPSHOTS;
+    pthread_mutex_unlock(&domain.retiredMutex);
+    if (full) synchronizeReaders(domain);
+}
+
+// ==================== 会话注册表 ====================
+
+// 会话句柄: 高 16 位分片号, 中间 16 位代数, 低 32 位槽位.
+// 槽位复用时代数加一, 已断开会话的旧句柄自然失效, 不会误投给复用同一 fd 的新连接
+typedef uint64_t SessionId;
+const SessionId INVALID_SESSION = ~0ULL;
+const int THREAD_SHARD = 0xFFFF;    // 线程模式的会话, 槽位即 fd
+
+inline SessionId makeSessionId(int shard, uint32_t slot, uint32_t generation) {
+    return ((uint64_t)shard << 48) | ((uint64_t)(generation & 0xFFFF) << 32) | slot;
+}
+inline int sessionShard(SessionId id) { return (int)(id >> 48); }
+inline uint32_t sessionSlot(SessionId id) { return (uint32_t)id; }
+inline uint32_t sessionGeneration(SessionId id) { return (uint32_t)(id >> 32) & 0xFFFF; }
+
+// 用户名 -> 会话句柄, 按名字哈希分成多个条带, 每个条带是一份只读快照.
+// 私聊寻址、用户列表和联邦的在线同步都不加锁; 上线下线时复制所在条带, 条带锁只在写者之间互斥
+const int DIRECTORY_STRIPES = 64;
+
+typedef unordered_map<string, SessionId> NameTable;
+
+struct alignas(64) DirectoryStripe {
+    pthread_mutex_t mutex;
+    atomic<const NameTable*> names;
+};
+
+DirectoryStripe nameDirectory[DIRECTORY_STRIPES];
+ReadDomain nameReaders;
+ReadDomain threadClientReaders;     // threadClients 的读者, 与名字表分开, 阻塞发送的读者不会拖住上线下线;
+                                    // 发送有 THREAD_SEND_TIMEOUT_SEC 的上限, 不读的客户端拖住下线的时间有界
+
+void initNameDirectory() {
+    initReadDomain(nameReaders);
+    initReadDomain(threadClientReaders);
+    for (int i = 0; i < DIRECTORY_STRIPES; i++) {
+        pthread_mutex_init(&nameDirectory[i].mutex, nullptr);
+        nameDirectory[i].names.store(new NameTable());
+    }
+}
+
+DirectoryStripe& stripeFor(const string& name) {
+    return nameDirectory[hash<string>()(name) % DIRECTORY_STRIPES];
+}
+
+// 持有条带锁时发布修改后的副本, 返回旧快照; 解锁后交给 deferSnapshot
+const NameTable* publishNames(DirectoryStripe& stripe, NameTable* next) {
+    return stripe.names.exchange(next, memory_order_seq_cst);
+}
+
+// 占用用户名, 已被占用时返回 false
+bool claimName(const string& name, SessionId id) {
+    DirectoryStripe& stripe = stripeFor(name);
+    pthread_mutex_lock(&stripe.mutex);
+    const NameTable* current = stripe.names.load(memory_order_relaxed);
+    if (current->count(name) != 0) {
+        pthread_mutex_unlock(&stripe.mutex);
+        return false;
+    }
+    NameTable* next = new NameTable(*current);
+    next->emplace(name, id);
+    const NameTable* old = publishNames(stripe, next);
+    pthread_mutex_unlock(&stripe.mutex);
+    deferSnapshot(nameReaders, old);
+    return true;
+}
+
+// 只释放自己占用的名字, 重复调用无副作用; 返回是否真的释放了
+bool releaseName(const string& name, SessionId id) {
+    DirectoryStripe& stripe = stripeFor(name);
+    pthread_mutex_lock(&stripe.mutex);
+    const NameTable* current = stripe.names.load(memory_order_relaxed);
+    auto it = current->find(name);
+    if (it == current->end() || it->second != id) {
+        pthread_mutex_unlock(&stripe.mutex);
+        return false;
+    }
+    NameTable* next = new NameTable(*current);
+    next->erase(name);
+    const NameTable* old = publishNames(stripe, next);
+    pthread_mutex_unlock(&stripe.mutex);
+    deferSnapshot(nameReaders, old);
+    return true;
+}
+
+SessionId lookupName(const string& name) {
+    ReadSection section(nameReaders);
+    const NameTable* names = stripeFor(name).names.load(memory_order_seq_cst);
+    auto it = names->find(name);
+    return it != names->end() ? it->second : INVALID_SESSION;
+}
+
+void listNames(vector<string>& out) {
+    {
+        ReadSection section(nameReaders);
+        for (int i = 0; i < DIRECTORY_STRIPES; i++) {
+            const NameTable* names = nameDirectory[i].names.load(memory_order_seq_cst);
+            for (auto& entry : *names) {
+                out.push_back(entry.first);
+            }
+        }
+    }
+    sort(out.begin(), out.end());
+}
+
+// 续传令牌 -> 会话. 令牌随登录下发给续传协议的客户端, 断线重连时凭令牌和名字接回原来的会话
+struct ResumeEntry {
+    SessionId session;
+    string userName;
+};
+
+pthread_mutex_t resumeMutex = PTHREAD_MUTEX_INITIALIZER;
+unordered_map<uint64_t, ResumeEntry> resumeTokens;
+
+// 返回 0 表示取随机数失败, 本次登录不支持续传
+uint64_t newResumeToken() {
+    uint64_t token = 0;
+    if (getrandom(&token, sizeof(token), 0) != (ssize_t)sizeof(token)) return 0;
+    return token;
+}
+
+void registerResumeToken(uint64_t token, SessionId id, const string& userName) {
+    pthread_mutex_lock(&resumeMutex);
+    resumeTokens[token] = ResumeEntry{id, userName};
+    pthread_mutex_unlock(&resumeMutex);
+}
+
+void releaseResumeToken(uint64_t token) {
+    pthread_mutex_lock(&resumeMutex);
+    resumeTokens.erase(token);
+    pthread_mutex_unlock(&resumeMutex);
+}
+
+// 令牌不存在或名字不符时返回 INVALID_SESSION
+SessionId lookupResumeToken(uint64_t token, const string& userName) {
+    pthread_mutex_lock(&resumeMutex);
+    auto it = resumeTokens.find(token);
+    SessionId id = it != resumeTokens.end() && it->second.userName == userName ? it->second.session : INVALID_SESSION;
+    pthread_mutex_unlock(&resumeMutex);
+    return id;
+}
+
+// ==================== 聊天室 ====================
+
+// 房间 -> 订阅者索引. 订阅者按 reactor 分片存放, 每个分片的列表只由该分片的线程读写;
+// shardMask 标记哪些分片有订阅者, 发布时只投递给这些分片, 扇出开销与房间人数成正比而不是在线总人数
+const int MAX_REACTORS = 64;
+const string LOBBY_ROOM = "lobby";     // 登录后默认所在的房间
+const size_t MAX_ROOMS = 4096;          // 房间不释放, 数量有上限; 任何客户端和中继节点都能创建房间
+
+struct Connection;
+
+struct alignas(64) RoomShard {
+    vector<Connection*> subscribers;
+};
+
+// 房间最近消息的环形缓冲区, 容量按字节而不是条数计算, 突发流量下内存占用也是固定的.
+// 每条记录按分帧格式 [4 字节长度][负载] 存放, 写不下时从最旧的记录开始淘汰
+struct RoomHistory {
+    pthread_mutex_t mutex;      // 同时保护房间消息序号, 保证回放与实时消息既不重复也不遗漏
+    uint64_t nextSeq;           // 下一条房间消息的序号
+    vector<char> ring;          // 从 HISTORY_MIN_RING 起按需加倍, 最多 historyBytes 字节
+    size_t head;                // 最旧记录的起始偏移
+    size_t used;
+    deque<size_t> records;      // 各条记录的起始偏移, 从旧到新
+};
+
+// 线程模式下房间的一个订阅者; 序号不大于 seqFloor 的消息已经在进入房间时的回放中收到过
+struct ThreadMember {
+    int fd;
+    uint64_t seqFloor;
+};
+typedef vector<ThreadMember> ThreadMemberList;
+
+// 房间创建后不再释放, 邮箱里跨分片的消息可以直接持有指针; 总数不超过 MAX_ROOMS
+struct RoomEntry {
+    string name;
+    atomic<uint64_t> shardMask;
+    atomic<int> memberCount;
+    RoomHistory history;
+    vector<RoomShard> shards;   // 按 reactor 编号下标, epoll 模式使用
+    // 线程模式下的订阅者, 与 threadClients 一样以只读快照发布: 在 threadClientReaders 的读区内读,
+    // clientsMutex 串行化写者; 新快照在 history.mutex 内发布, 与消息序号保持一致
+    atomic<const ThreadMemberList*> threadMembers;
+    atomic<bool> idleQueued;    // 在 idleRooms 中
+};
+
+struct alignas(64) RoomStripe {
+    pthread_mutex_t mutex;
+    unordered_map<string, RoomEntry*> rooms;
+};
+
+RoomStripe roomDirectory[DIRECTORY_STRIPES];
+atomic<size_t> roomCount(0);
+
+// 线程模式下每个 fd 当前所在的房间, 由 clientsMutex 保护
+unordered_map<int, RoomEntry*> threadRooms;
+
+void initRoomDirectory() {
+    for (int i = 0; i < DIRECTORY_STRIPES; i++) {
+        pthread_mutex_init(&roomDirectory[i].mutex, nullptr);
+    }
+}
+
+bool isValidRoomName(const string& name) {
+    return !name.empty() && name.size() <= (size_t)MAX_NAME_LEN && name.find(' ') == string::npos;
+}
+
+// 所有房间的历史环共用 historyTotalBytes 的预算. 环写满时容量加倍, 预算不够就按变空的先后回收没有成员的房间的环,
+// 仍不够则在现有容量内淘汰旧记录. 内存随实际的消息量增长, 总量不超过预算
+const size_t HISTORY_MIN_RING = 4 << 10;
+atomic<size_t> historyAllocated(0);
+pthread_mutex_t idleRoomsMutex = PTHREAD_MUTEX_INITIALIZER;
+deque<RoomEntry*> idleRooms;    // 可能没有成员的房间, 回收时再确认
+
+void queueIdleRoom(RoomEntry* room) {
+    if (room->idleQueued.exchange(true)) return;
+    pthread_mutex_lock(&idleRoomsMutex);
+    idleRooms.push_back(room);
+    pthread_mutex_unlock(&idleRoomsMutex);
+}
+
+// 释放一个没有成员的房间的历史环, 找不到可以回收的返回 false.
+// 调用者持有另一个房间的 history.mutex, 这里只 trylock, 拿不到的放回队尾
+bool reclaimIdleHistory() {
+    pthread_mutex_lock(&idleRoomsMutex);
+    size_t attempts = idleRooms.size();
+    pthread_mutex_unlock(&idleRoomsMutex);
+    for (; attempts > 0; attempts--) {
+        pthread_mutex_lock(&idleRoomsMutex);
+        if (idleRooms.empty()) {
+            pthread_mutex_unlock(&idleRoomsMutex);
+            return false;
+        }
+        RoomEntry* room = idleRooms.front();
+        idleRooms.pop_front();
+        room->idleQueued.store(false);
+        pthread_mutex_unlock(&idleRoomsMutex);
+        // 有成员的房间等它再次变空时重新排队
+        if (room->memberCount.load() != 0) continue;
+        RoomHistory& h = room->history;
+        if (pthread_mutex_trylock(&h.mutex) != 0) {
+            queueIdleRoom(room);
+            continue;
+        }
+        size_t released = 0;
+        if (room->memberCount.load() == 0) {
+            released = h.ring.size();
+            vector<char>().swap(h.ring);
+            h.records.clear();
+            h.head = 0;
+            h.used = 0;
+        }
+        pthread_mutex_unlock(&h.mutex);
+        if (released > 0) {
+            historyAllocated.fetch_sub(released);
+            return true;
+        }
+    }
+    return false;
+}
+
+// 房间数已达 MAX_ROOMS 时不再创建新房间, 返回 nullptr; 大厅总是可以创建
+RoomEntry* findOrCreateRoom(const string& name, size_t shardCount) {
+    RoomStripe& stripe = roomDirectory[hash<string>()(name) % DIRECTORY_STRIPES];
+    pthread_mutex_lock(&stripe.mutex);
+    auto it = stripe.rooms.find(name);
+    if (it != stripe.rooms.end()) {
+        RoomEntry* room = it->second;
+        pthread_mutex_unlock(&stripe.mutex);
+        return room;
+    }
+    if (roomCount.fetch_add(1, memory_order_relaxed) >= MAX_ROOMS && name != LOBBY_ROOM) {
+        roomCount.fetch_sub(1, memory_order_relaxed);
+        pthread_mutex_unlock(&stripe.mutex);
+        return nullptr;
+    }
+    RoomEntry* room = new RoomEntry();
+    room->name = name;
+    room->shardMask.store(0);
+    room->memberCount.store(0);
+    room->shards.resize(shardCount);
+    pthread_mutex_init(&room->history.mutex, nullptr);
+    room->history.nextSeq = 1;
+    room->history.head = 0;
+    room->history.used = 0;
+    room->idleQueued.store(false);
+    room->threadMembers.store(new ThreadMemberList());
+    stripe.rooms[name] = room;
+    pthread_mutex_unlock(&stripe.mutex);
+    queueIdleRoom(room);
+    return room;
+}
+
+// 列出有人的房间及人数, 按房间名排序
+void listRooms(vector<pair<string, int>>& out) {
+    for (int i = 0; i < DIRECTORY_STRIPES; i++) {
+        pthread_mutex_lock(&roomDirectory[i].mutex);
+        for (auto& entry : roomDirectory[i].rooms) {
+            int members = entry.second->memberCount.load(memory_order_relaxed);
+            if (members > 0) out.emplace_back(entry.first, members);
+        }
+        pthread_mutex_unlock(&roomDirectory[i].mutex);
+    }
+    sort(out.begin(), out.end());
+}
+
+// ==================== 运行统计 ====================
+
+// 每个线程独占一个按缓存行对齐的计数槽, 热路径上只对自己的槽做无竞争的原子加;
+// 读取时把所有槽加总. 线程数超过槽数时 (线程模式) 多个线程共用一个槽, 结果仍然正确
+enum StatCounter {
+    STAT_ACCEPTS,
+    STAT_LOGINS,
+    STAT_LOGOUTS,
+    STAT_MSGS_IN,
+    STAT_BYTES_IN,
+    STAT_MSGS_OUT,          // 投递给单个客户端的消息数 (一次广播按接收人数计)
+    STAT_BYTES_OUT,         // 实际写进套接字的字节数
+    STAT_DROPPED,           // 慢速客户端被丢弃或合并掉的消息
+    STAT_FANOUTS,
+    STAT_FANOUT_NS,         // 广播和房间发布在发送线程上的耗时
+    STAT_RATE_REJECTED,     // 超过限速被丢弃的消息
+    STAT_RATE_DELAYED,      // 超过限速而暂停读取的次数
+    STAT_RATE_DISCONNECTS,  // 超过限速被断开的连接
+    STAT_RELAY_FRAMES,      // 转发给其他节点的帧数 (发给几个节点按几帧计)
+    STAT_RELAY_BATCHES,     // 中继链路上的写出次数, 与帧数之比即批量程度
+    STAT_RELAY_RECEIVED,    // 从其他节点收到的帧数
+    STAT_POOL_TASKS,        // 线程池处理的就绪事件
+    STAT_POOL_STEALS,       // 其中从其他工作线程的队列窃取的
+    STAT_URING_ENTERS,      // io_uring_enter 系统调用次数
+    STAT_URING_SQES,        // 提交给 io_uring 的请求数, 与调用次数之比即批量程度
+    STAT_ATTACHMENTS,       // 上传完成的附件数
+    STAT_ATTACH_BYTES,      // 用 sendfile 下发的附件字节数 (也计入 STAT_BYTES_OUT)
+    STAT_TLS_HANDSHAKES,
+    STAT_KTLS_TX,           // 发送方向由内核加密的 TLS 连接数
+    STAT_KTLS_RX,           // 接收方向由内核解密的 TLS 连接数
+    STAT_PINGS,             // 发出的心跳
+    STAT_IDLE_CLOSES,       // 因心跳或空闲超时断开的连接
+    STAT_SEARCHES,
+    STAT_SEARCH_NS,         // /search 查询的耗时
+    STAT_OFFLINE_STORED,    // 存进信箱的离线私聊
+    STAT_OFFLINE_DELIVERED, // 登录时投递的离线私聊
+    STAT_COUNTERS
+};
+
+const int MAX_STAT_SLOTS = 128;
+
+struct alignas(64) StatSlot {
+    atomic<uint64_t> values[STAT_COUNTERS];
+};
+
+StatSlot statSlots[MAX_STAT_SLOTS];
+atomic<int> nextStatSlot(0);
+
+inline StatSlot& myStatSlot() {
+    thread_local StatSlot* slot = &statSlots[nextStatSlot.fetch_add(1, memory_order_relaxed) % MAX_STAT_SLOTS];
+    return *slot;
+}
+
+inline void countStat(StatCounter counter, uint64_t n = 1) {
+    myStatSlot().values[counter].fetch_add(n, memory_order_relaxed);
+}
+
+inline uint64_t monotonicNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// 记录一次扇出在发送线程上的耗时 (本分片直接发送加上给其他分片投递邮件)
+struct FanoutTimer {
+    uint64_t begin = monotonicNs();
+    ~FanoutTimer() {
+        countStat(STAT_FANOUTS);
+        countStat(STAT_FANOUT_NS, monotonicNs() - begin);
+    }
+};
+
+struct StatTotals {
+    uint64_t takenAt;
+    uint64_t values[STAT_COUNTERS];
+};
+
+void sumStats(StatTotals& totals) {
+    totals.takenAt = monotonicNs();
+    for (int c = 0; c < STAT_COUNTERS; c++) {
+        totals.values[c] = 0;
+        for (int i = 0; i < MAX_STAT_SLOTS; i++) {
+            totals.values[c] += statSlots[i].values[c].load(memory_order_relaxed);
+        }
+    }
+}
+
+// ==================== 共享消息缓冲区 ====================
+
+// 一条消息只序列化一次, 所有接收者的发送队列和跨分片邮箱都引用同一块不可变内存,
+// 最后一个引用释放时回收. 内存布局为 [4 字节帧头][负载], 分帧客户端从头发送, 文本客户端跳过帧头
+struct SharedBuffer {
+    atomic<int> refCount;
+    uint32_t length;            // 负载长度
+    bool raw;                   // 负载已按接收者的协议编码好 (如历史回放的多帧批量数据), 不再加帧头
+    // 聊天和私聊消息附带的二进制协议编码, 与文本编码一起创建和释放, 所有二进制连接共享
+    uint32_t senderId;          // 编码中引用的用户编号; 原样发送的数据带着它时, 开头是介绍该用户的 OP_USER 帧
+    SharedBuffer* binary;
+    SharedBuffer* binaryCompressed; // 压缩后的编码, 只在确实变小时存在
+    SharedBuffer* announce;     // 介绍 senderId 的 OP_USER 帧, 接收者第一次见到该用户时先发
+    char* bytes() { return (char*)(this + 1); }
+};
+
+class BufferRef {
+public:
+    BufferRef() : buf(nullptr) {}
+    explicit BufferRef(SharedBuffer* adopted) : buf(adopted) {}
+    BufferRef(const BufferRef& other) : buf(other.buf) {
+        if (buf != nullptr) buf->refCount.fetch_add(1, memory_order_relaxed);
+    }
+    BufferRef(BufferRef&& other) noexcept : buf(other.buf) { other.buf = nullptr; }
+    BufferRef& operator=(BufferRef other) noexcept {
+        swap(buf, other.buf);
+        return *this;
+    }
+    // 交出引用, 由调用者负责释放
+    SharedBuffer* release() {
+        SharedBuffer* out = buf;
+        buf = nullptr;
+        return out;
+    }
+    ~BufferRef() { unref(buf); }
+
+    // 再持有一个引用
+    static BufferRef share(SharedBuffer* shared) {
+        shared->refCount.fetch_add(1, memory_order_relaxed);
+        return BufferRef(shared);
+    }
+
+    explicit operator bool() const { return buf != nullptr; }
+    SharedBuffer* shared() const { return buf; }
+    bool isRaw() const { return buf->raw; }
+    const char* payload() const { return buf->bytes() + FRAME_HEADER_SIZE; }
+    size_t payloadSize() const { return buf->length; }
+    const char* wireData(int protocol) const {
+        return protocol == PROTO_FRAMED && !buf->raw ? buf->bytes() : payload();
+    }
+    size_t wireSize(int protocol) const {
+        return protocol == PROTO_FRAMED && !buf->raw ? FRAME_HEADER_SIZE + buf->length : buf->length;
+    }
+
+private:
+    static void unref(SharedBuffer* shared) {
+        if (shared != nullptr && shared->refCount.fetch_sub(1, memory_order_acq_rel) == 1) {
+            unref(shared->binary);
+            unref(shared->binaryCompressed);
+            unref(shared->announce);
+            free(shared);
+        }
+    }
+
+    SharedBuffer* buf;
+};
+
+SharedBuffer* allocBuffer(size_t len, bool raw) {
+    SharedBuffer* buf = (SharedBuffer*)malloc(sizeof(SharedBuffer) + FRAME_HEADER_SIZE + len);
+    new (&buf->refCount) atomic<int>(1);
+    buf->length = len;
+    buf->raw = raw;
+    buf->senderId = 0;
+    buf->binary = nullptr;
+    buf->binaryCompressed = nullptr;
+    buf->announce = nullptr;
+    encodeFrameHeader(buf->bytes(), len);
+    return buf;
+}
+
+BufferRef makeBuffer(const char* data, size_t len) {
+    SharedBuffer* buf = allocBuffer(len, false);
+    memcpy(buf->bytes() + FRAME_HEADER_SIZE, data, len);
+    return BufferRef(buf);
+}
+
+BufferRef makeBuffer(const string& message) {
+    return makeBuffer(message.data(), message.size());
+}
+
+// 已经按接收者协议编码好的字节, 发送时原样写出
+BufferRef makeRawBuffer(const char* data, size_t len) {
+    SharedBuffer* buf = allocBuffer(len, true);
+    memcpy(buf->bytes() + FRAME_HEADER_SIZE, data, len);
+    return BufferRef(buf);
+}
+
+// ==================== 二进制协议 ====================
+
+// 把若干完整的二进制帧作为一条待发送的数据; 协商了压缩且足够大时整体压缩成 OP_BATCH, 压缩后没有变小则原样发送
+BufferRef encodeBinaryOutput(const string& frames, bool compress, bool batched) {
+    if (compress && (batched || frames.size() >= COMPRESS_MIN_SIZE)) {
+        string header;
+        putVarint(header, frames.size());
+        vector<char> packed(lz4Bound(frames.size()));
+        size_t packedLen = lz4Compress(frames.data(), frames.size(), packed.data());
+        string batch;
+        appendBinaryFrame(batch, OP_BATCH, header + string(packed.data(), packedLen));
+        if (batch.size() < frames.size()) return makeRawBuffer(batch.data(), batch.size());
+    }
+    return makeRawBuffer(frames.data(), frames.size());
+}
+
+// 没有附带二进制编码的文本消息逐连接编码为 OP_TEXT; 分帧格式的批量数据 (历史回放) 拆成多帧后一起压缩
+BufferRef encodeBinaryText(const BufferRef& message, bool compress) {
+    string frames;
+    const char* data = message.payload();
+    size_t len = message.payloadSize();
+    if (!message.isRaw()) {
+        appendBinaryFrame(frames, OP_TEXT, string_view(data, len));
+        return encodeBinaryOutput(frames, compress, false);
+    }
+    for (size_t pos = 0; pos + FRAME_HEADER_SIZE <= len;) {
+        size_t frameLen = decodeFrameHeader(data + pos);
+        appendBinaryFrame(frames, OP_TEXT, string_view(data + pos + FRAME_HEADER_SIZE, frameLen));
+        pos += FRAME_HEADER_SIZE + frameLen;
+    }
+    return encodeBinaryOutput(frames, compress, true);
+}
+
+// ==================== 消息格式化 ====================
+
+// 当前线程缓存的 "YYYY-mm-dd HH:MM:SS", 秒数变化时才重新调用 localtime_r 和 strftime
+string_view cachedTimeStamp() {
+    struct TimeStampCache {
+        time_t second = -1;
+        char text[32];
+        size_t length = 0;
+    };
+    thread_local TimeStampCache cache;
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME_COARSE, &now);
+    if (now.tv_sec != cache.second) {
+        tm localTime;
+        localtime_r(&now.tv_sec, &localTime);
+        cache.length = strftime(cache.text, sizeof(cache.text), "%Y-%m-%d %H:%M:%S", &localTime);
+        cache.second = now.tv_sec;
+    }
+    return string_view(cache.text, cache.length);
+}
+
+// 在线程私有的 arena 上拼接消息, arena 只增长不释放, 稳定后拼接过程不再分配堆内存;
+// 拼好后一次拷贝进共享缓冲区. 同一线程中的多个 MessageFormatter 必须按栈的顺序创建和销毁
+class MessageFormatter {
+public:
+    MessageFormatter() : arena(threadArena()), start(arena.top), length(0) {}
+    ~MessageFormatter() { arena.top = start; }
+    MessageFormatter(const MessageFormatter&) = delete;
+    MessageFormatter& operator=(const MessageFormatter&) = delete;
+
+    MessageFormatter& add(string_view piece) {
+        char* out = reserve(piece.size());
+        memcpy(out, piece.data(), piece.size());
+        length += piece.size();
+        arena.top = start + length;
+        return *this;
+    }
+
+    MessageFormatter& add(uint64_t value) {
+        char digits[24];
+        char* end = to_chars(digits, digits + sizeof(digits), value).ptr;
+        return add(string_view(digits, end - digits));
+    }
+
+    // 系统通知统一的 "[时间]  " 前缀
+    MessageFormatter& timestamp() {
+        return add("[").add(cachedTimeStamp()).add("]  ");
+    }
+
+    string_view view() const { return string_view(arena.bytes.data() + start, length); }
+    BufferRef buffer() const { return makeBuffer(arena.bytes.data() + start, length); }
+
+private:
+    struct Arena {
+        vector<char> bytes;
+        size_t top = 0;
+    };
+
+    static Arena& threadArena() {
+        thread_local Arena arena;
+        return arena;
+    }
+
+    char* reserve(size_t n) {
+        size_t need = start + length + n;
+        if (need > arena.bytes.size()) {
+            arena.bytes.resize(max(need, max(arena.bytes.size() * 2, (size_t)BUFFER_SIZE)));
+        }
+        return arena.bytes.data() + start + length;
+    }
+
+    Arena& arena;
+    size_t start;
+    size_t length;
+};
+
+// ==================== TLS ====================
+
+// 握手在用户态完成, 之后请 OpenSSL 把会话密钥装进内核 (kTLS, TCP_ULP "tls"): 装上以后套接字上的
+// send/writev/sendfile 由内核加密, 广播和附件的发送路径不用改. 内核不支持时退回用户态:
+// 接收用 SSL_read, 发送用 SSL_write 写进内存 BIO, 密文再由调用者写进套接字
+
+const size_t TLS_RECORD_SIZE = 16384;   // 一个 TLS 记录的最大明文长度
+
+SSL_CTX* tlsContext = nullptr;
+
+bool initTls() {
+    tlsContext = SSL_CTX_new(TLS_server_method());
+    if (tlsContext == nullptr) return false;
+    SSL_CTX_set_min_proto_version(tlsContext, TLS1_2_VERSION);
+    // 不发会话票据: 握手之后没有额外的记录, 密钥交给内核时序号是确定的; 客户端直接断开视为正常关闭
+    SSL_CTX_set_num_tickets(tlsContext, 0);
+    SSL_CTX_set_options(tlsContext, SSL_OP_ENABLE_KTLS | SSL_OP_IGNORE_UNEXPECTED_EOF | SSL_OP_NO_RENEGOTIATION);
+    if (SSL_CTX_use_certificate_chain_file(tlsContext, tlsCertPath.c_str()) != 1
+        || SSL_CTX_use_PrivateKey_file(tlsContext, tlsKeyPath.c_str(), SSL_FILETYPE_PEM) != 1
+        || SSL_CTX_check_private_key(tlsContext) != 1) {
+        char reason[256];
+        ERR_error_string_n(ERR_get_error(), reason, sizeof(reason));
+        cout << "加载 TLS 证书失败: " << reason << endl;
+        SSL_CTX_free(tlsContext);
+        tlsContext = nullptr;
+        return false;
+    }
+    return true;
+}
+
+// 非阻塞握手, 返回 1 完成, 0 等待套接字就绪, -1 失败.
+// 完成时 userSend/userRecv 表示该方向内核没有接管, 用户态发送改为写进内存 BIO
+int tlsHandshake(SSL* ssl, bool& userSend, bool& userRecv) {
+    ERR_clear_error();
+    int rc = SSL_do_handshake(ssl);
+    if (rc != 1) {
+        int err = SSL_get_error(ssl, rc);
+        return err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE ? 0 : -1;
+    }
+    userSend = !BIO_get_ktls_send(SSL_get_wbio(ssl));
+    userRecv = !BIO_get_ktls_recv(SSL_get_rbio(ssl));
+    if (userSend) SSL_set0_wbio(ssl, BIO_new(BIO_s_mem()));
+    countStat(STAT_TLS_HANDSHAKES);
+    if (!userSend) countStat(STAT_KTLS_TX);
+    if (!userRecv) countStat(STAT_KTLS_RX);
+    return 1;
+}
+
+// 把内存 BIO 里的密文移到 out
+void tlsDrain(SSL* ssl, string& out) {
+    BIO* wbio = SSL_get_wbio(ssl);
+    size_t pending = BIO_ctrl_pending(wbio);
+    if (pending == 0) return;
+    size_t old = out.size();
+    out.resize(old + pending);
+    out.resize(old + max(0, BIO_read(wbio, &out[old], pending)));
+}
+
+// 从 iov 的第 skip 字节起加密至多一个记录的明文, 密文追加到 out; 返回消耗的明文字节数, 0 表示出错
+size_t tlsEncrypt(SSL* ssl, const struct iovec* iov, int iovcnt, size_t skip, string& out) {
+    char record[TLS_RECORD_SIZE];
+    size_t len = 0;
+    for (int i = 0; i < iovcnt && len < sizeof(record); i++) {
+        if (skip >= iov[i].iov_len) {
+            skip -= iov[i].iov_len;
+            continue;
+        }
+        size_t n = min(iov[i].iov_len - skip, sizeof(record) - len);
+        memcpy(record + len, (const char*)iov[i].iov_base + skip, n);
+        len += n;
+        skip = 0;
+    }
+    ERR_clear_error();
+    if (len == 0 || SSL_write(ssl, record, len) != (int)len) return 0;
+    tlsDrain(ssl, out);
+    return len;
+}
+
+// 用户态解密, 返回值与 recv 相同; 已到的数据不够一个完整记录时 errno 为 EAGAIN.
+// 读的过程中可能产生要回复的记录 (如 TLS 1.3 密钥更新), 追加到 out
+ssize_t tlsRead(SSL* ssl, char* buf, size_t len, string& out) {
+    ERR_clear_error();
+    int n = SSL_read(ssl, buf, len);
+    if (BIO_method_type(SSL_get_wbio(ssl)) == BIO_TYPE_MEM) tlsDrain(ssl, out);
+    if (n > 0) return n;
+    int err = SSL_get_error(ssl, n);
+    if (err == SSL_ERROR_ZERO_RETURN) return 0;
+    errno = err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE ? EAGAIN : ECONNRESET;
+    return -1;
+}
+
+// ==================== 定时轮 ====================
+
+// 分层时间轮: 每个 reactor 一个, 只在自己的线程里操作. 共 WHEEL_LEVELS 层, 每层 WHEEL_SLOTS 个槽,
+// 第 0 层一个槽是一个 tick, 上一层一个槽等于下一层转一整圈. 定时器是嵌在连接里的链表节点,
+// 挂上、摘下都是 O(1); 每个 tick 取走第 0 层的一个槽, 第 0 层转完一圈时再把上一层的一个槽按剩余时间放下来
+
+const uint64_t TIMER_TICK_MS = 1000;
+const int WHEEL_BITS = 6;
+const int WHEEL_SLOTS = 1 << WHEEL_BITS;
+const int WHEEL_LEVELS = 4;     // 可表示 2^24 个 tick, 更远的到期时间截断到最大值
+
+struct Connection;
+
+struct TimerNode {
+    TimerNode* prev;
+    TimerNode* next;            // 没有挂在任何链表上时为 nullptr
+    uint64_t expires;           // 到期的 tick
+    Connection* conn;
+};
+
+struct TimerWheel {
+    uint64_t now;               // 已处理到的 tick
+    size_t armed;               // 挂在轮上的定时器数
+    TimerNode slots[WHEEL_LEVELS][WHEEL_SLOTS];     // 每个槽是带头节点的循环链表
+};
+
+uint64_t currentTick() {
+    return monotonicNs() / 1000000 / TIMER_TICK_MS;
+}
+
+uint64_t secondsToTicks(int seconds) {
+    return ((uint64_t)seconds * 1000 + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+}
+
+void initTimerList(TimerNode& head) {
+    head.prev = &head;
+    head.next = &head;
+}
+
+void initTimerWheel(TimerWheel& wheel) {
+    wheel.now = currentTick();
+    wheel.armed = 0;
+    for (int level = 0; level < WHEEL_LEVELS; level++) {
+        for (int slot = 0; slot < WHEEL_SLOTS; slot++) initTimerList(wheel.slots[level][slot]);
+    }
+}
+
+void linkTimer(TimerNode& head, TimerNode& node) {
+    node.prev = head.prev;
+    node.next = &head;
+    head.prev->next = &node;
+    head.prev = &node;
+}
+
+void unlinkTimer(TimerNode& node) {
+    node.prev->next = node.next;
+    node.next->prev = node.prev;
+    node.prev = node.next = nullptr;
+}
+
+// 按距离到期的 tick 数选层, 槽号取到期时刻在该层的那几位
+void placeTimer(TimerWheel& wheel, TimerNode& node) {
+    uint64_t delta = node.expires - wheel.now;
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 && delta >= (1ULL << ((level + 1) * WHEEL_BITS))) level++;
+    linkTimer(wheel.slots[level][(node.expires >> (level * WHEEL_BITS)) & (WHEEL_SLOTS - 1)], node);
+}
+
+void cancelTimer(TimerWheel& wheel, TimerNode& node) {
+    if (node.next == nullptr) return;
+    unlinkTimer(node);
+    wheel.armed--;
+}
+
+// 挂上或改期, 不晚于下一个 tick
+void armTimer(TimerWheel& wheel, TimerNode& node, uint64_t expires) {
+    cancelTimer(wheel, node);
+    const uint64_t maxDelta = (1ULL << (WHEEL_LEVELS * WHEEL_BITS)) - 1;
+    node.expires = min(max(expires, wheel.now + 1), wheel.now + maxDelta);
+    placeTimer(wheel, node);
+    wheel.armed++;
+}
+
+// 没有定时器时轮子不转, 等待返回后先拨到当前时刻, 新挂的定时器和记下的活动时间才不会落在过去
+inline void syncTimerClock(TimerWheel& wheel) {
+    if (wheel.armed == 0) wheel.now = max(wheel.now, currentTick());
+}
+
+// 推进到 target, 到期的定时器摘下后移到 expired 链表, 由调用者逐个处理
+void advanceTimers(TimerWheel& wheel, uint64_t target, TimerNode& expired) {
+    if (wheel.armed == 0) {
+        wheel.now = max(wheel.now, target);
+        return;
+    }
+    while (wheel.now < target) {
+        wheel.now++;
+        // 从高层往低层放, 放到刚转到的低层槽里的定时器在同一个 tick 里继续往下放
+        for (int level = WHEEL_LEVELS - 1; level > 0; level--) {
+            if ((wheel.now & ((1ULL << (level * WHEEL_BITS)) - 1)) != 0) continue;
+            TimerNode& head = wheel.slots[level][(wheel.now >> (level * WHEEL_BITS)) & (WHEEL_SLOTS - 1)];
+            while (head.next != &head) {
+                TimerNode* node = head.next;
+                unlinkTimer(*node);
+                placeTimer(wheel, *node);
+            }
         }
+        TimerNode& due = wheel.slots[0][wheel.now & (WHEEL_SLOTS - 1)];
+        while (due.next != &due) {
+            TimerNode* node = due.next;
+            unlinkTimer(*node);
+            linkTimer(expired, *node);
+            wheel.armed--;
+        }
+    }
+}
+
+// 不能应答心跳的连接 (文本和分帧协议) 交给内核探测: 静默 heartbeatSec 秒后开始发 keepalive,
+// 连续 KEEPALIVE_PROBES 次没有应答, 或发出的数据同样久仍未被确认, 套接字报错, 按断开处理.
+// 只淘汰对端已经消失的连接, 在线但不说话的用户不受影响
+void enableKeepalive(int fd) {
+    if (heartbeatSec <= 0) return;
+    int on = 1;
+    int idle = heartbeatSec;
+    int interval = max(1, heartbeatSec / KEEPALIVE_PROBES);
+    int probes = KEEPALIVE_PROBES;
+    unsigned int userTimeout = (idle + interval * probes) * 1000U;
+    setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &probes, sizeof(probes));
+    setsockopt(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, &userTimeout, sizeof(userTimeout));
+}
+
+// ==================== 限速 ====================
+// 每个会话一个令牌桶, 条数和字节数分别计. 在接收路径上解析出一条消息后、做任何扇出之前检查,
+// 一个客户端发得再快也只消耗自己的配额, 不会被放大 N 倍压到其他人的发送队列上
+struct TokenBucket {
+    double msgs;
+    double bytes;
+    uint64_t refilledAt;    // 上次补充令牌的时间, 纳秒
+    uint64_t delayUntil;    // RATE_DELAY: 暂停读取到该时刻, 0 表示未暂停
+    bool warned;            // RATE_REJECT: 本轮超限已提示过, 有消息通过后清除
+    uint64_t limited;       // 累计超限次数
+};
+
+void initTokenBucket(TokenBucket& bucket) {
+    bucket.msgs = rateMsgs * rateBurstSec;
+    bucket.bytes = rateBytes * rateBurstSec;
+    bucket.refilledAt = monotonicNs();
+    bucket.delayUntil = 0;
+    bucket.warned = false;
+    bucket.limited = 0;
+}
+
+// 为一条 len 字节的消息取令牌; 不够时返回 false, waitNs 为补足还需要的时间
+bool takeTokens(TokenBucket& bucket, size_t len, uint64_t& waitNs) {
+    if (rateMsgs <= 0 && rateBytes <= 0) return true;
+    uint64_t now = monotonicNs();
+    double elapsed = (now - bucket.refilledAt) / 1e9;
+    bucket.refilledAt = now;
+    bucket.msgs = min(bucket.msgs + elapsed * rateMsgs, rateMsgs * rateBurstSec);
+    bucket.bytes = min(bucket.bytes + elapsed * rateBytes, rateBytes * rateBurstSec);
+
+    double wait = 0;
+    if (rateMsgs > 0 && bucket.msgs < 1) wait = (1 - bucket.msgs) / rateMsgs;
+    if (rateBytes > 0) {
+        // 比桶还大的消息只要求桶装满, 超出的部分记为欠账, 否则永远等不到
+        double need = min((double)len, rateBytes * rateBurstSec);
+        if (bucket.bytes < need) wait = max(wait, (need - bucket.bytes) / rateBytes);
+    }
+    if (wait > 0) {
+        waitNs = (uint64_t)(wait * 1e9) + 1;
+        return false;
+    }
+    if (rateMsgs > 0) bucket.msgs -= 1;
+    if (rateBytes > 0) bucket.bytes -= len;
+    return true;
+}
+
+struct Reactor;
+struct UringState;
+
+// MSG_ZEROCOPY 发送后等待内核完成通知的缓冲区
+struct ZeroCopyPending {
+    uint32_t id;
+    vector<BufferRef> refs;
+};
+
+// 续传会话下发过的一条消息, 历史回放等批量数据一条包含多帧
+struct ResendEntry {
+    uint64_t firstSeq;
+    uint32_t frames;
+    BufferRef message;
+};
+
+// 上传完成的附件, 内容在已 unlink 的暂存文件里; 每个正在下发它的连接持有一个引用
+struct Attachment {
+    atomic<int> refs;
+    int fd;
+    uint64_t id;
+    uint64_t size;
+    string name;
+    string sender;
+    string receiver;            // 上传时的接收方用户名, 归还暂存配额时用
+    SessionId senderSession;
+    SessionId target;
+};
+
+// 正在下发给某个连接的附件. 一块开始发送后必须整块发完, 其他帧才能插进来
+struct FileStream {
+    Attachment* file;
+    uint64_t offset;            // 文件中下一个要发的字节
+    uint64_t chunkLeft;         // 当前块还没发出的文件字节数
+    char header[FRAME_HEADER_SIZE + 10];    // [帧头][CONTROL_CHUNK][8 字节编号]
+    size_t headerLen;           // 当前块的帧头长度, 0 表示不在块中间
+    size_t headerSent;
+};
+
+// 正在接收的上传, 数据追加到暂存文件
+struct Upload {
+    int fd;
+    uint64_t size;
+    uint64_t received;
+    string name;
+    string target;
+};
+
+// epoll 模式下每个连接的状态, 只由所属 reactor 线程读写
+struct Connection {
+    int fd;
+    Reactor* owner;
+    bool loggedIn;
+    int protocol;               // 登录块中协商的协议, 见 chat_protocol.h
+    string userName;
+    SessionId sessionId;
+    size_t clientIndex;         // 在 owner->clients 中的下标, 用于 O(1) 移除
+    FrameParser parser;         // 登录块和后续消息都从这里增量解析
+    deque<BufferRef> outQueue;  // 套接字缓冲区满时排队的消息引用, EPOLLOUT 时用 writev 发出
+    size_t outHeadOffset;       // 队首消息已经发出的字节数
+    size_t outQueuedBytes;
+    size_t outPeakBytes;        // 队列字节数峰值
+    uint64_t outDropped;        // 因发送队列超限被丢弃或合并掉的消息数
+    bool closing;               // 已安排在本轮事件处理结束后关闭
+    bool zeroCopy;              // 套接字已开启 SO_ZEROCOPY
+    uint32_t zcNextId;          // 下一次 MSG_ZEROCOPY 调用的通知编号
+    deque<ZeroCopyPending> zcPending;
+    uint64_t zcSends;
+    uint64_t zcCopied;          // 内核回退为拷贝发送的次数 (如回环网卡)
+    RoomEntry* room;            // 当前所在的房间
+    size_t roomIndex;           // 在该房间本分片订阅列表中的下标
+    uint64_t roomSeqFloor;      // 进入房间时已回放到的消息序号, 之后只接收更新的消息
+    bool resumable;             // 续传协议: 下发的每一帧都编号并记入 resendLog
+    bool detached;              // 连接已断开, 会话保留到 resumeGraceSec 秒后, 期间的消息只记入 resendLog
+    uint64_t resumeToken;
+    uint64_t nextSeq;           // 下一帧的序号
+    deque<ResendEntry> resendLog;   // 最近下发的消息, 总字节数不超过 resumeBytes
+    size_t resendBytes;
+    uint64_t detachedAt;        // 断开的时间, 毫秒
+    SessionId resumeTarget;     // 登录块请求接回的会话, 关闭阶段把 fd 移交给该会话所在的分片
+    uint64_t resumeSeq;         // 客户端已收到的最后一帧
+    uint32_t userId;            // 二进制协议中代表本用户的编号, 登录时分配
+    bool compress;              // 二进制协议: 客户端能解压 OP_BATCH
+    unordered_set<uint32_t> knownUsers;     // 二进制协议: 已经向该连接介绍过的用户编号
+    TokenBucket bucket;
+    UringState* uring;          // io_uring 后端的收发状态, epoll 后端为 nullptr
+    SSL* tls;                   // TLS 连接的会话, 明文连接为 nullptr
+    bool tlsHandshaking;
+    bool tlsUserSend;           // 内核没有接管发送方向的加密, 经 SSL_write 加密后从 tlsOut 发出
+    bool tlsUserRecv;           // 内核没有接管接收方向, 经 SSL_read 解密
+    string tlsOut;              // 已加密还没写进套接字的数据, 总是排在其他数据之前
+    TimerNode idleTimer;        // 登录、心跳和空闲超时, 挂在 owner 的定时轮上
+    uint64_t lastActive;        // 最近一次收到数据的 tick; 收包只更新它, 定时器到期时再据此顺延
+    bool heartbeats;            // 客户端能应答心跳 (续传协议和二进制协议)
+    Upload* upload;             // 正在上传的附件
+    deque<FileStream> files;    // 正在下发的附件, 每个一块轮流发送
+    bool streaming;             // 在 owner->streamingList 中
+    int savedNotsentLowat;      // 开始下发附件前的 TCP_NOTSENT_LOWAT, files 清空后恢复
+};
+
+// 跨分片投递的消息, 通过无锁邮箱交给目标 reactor
+enum MailKind { MAIL_BROADCAST, MAIL_DELIVER, MAIL_ROOM, MAIL_QUEUE_REPORT, MAIL_STATS, MAIL_RESUME, MAIL_KICK, MAIL_ATTACH };
+
+struct StatsQuery;
+
+struct MailItem {
+    MailItem* next;
+    MailKind kind;
+    SessionId target;       // MAIL_DELIVER: 目标会话
+    RoomEntry* room;        // MAIL_ROOM: 目标房间, 投递给本分片的订阅者
+    uint64_t seq;           // MAIL_ROOM: 房间消息序号; MAIL_RESUME: 客户端已收到的最后一帧
+    StatsQuery* query;      // MAIL_STATS: 由本分片填入发送队列情况
+    int fd;                 // MAIL_RESUME: 接回会话的新连接, payload 是它登录块之后已收到的数据
+    Attachment* file;       // MAIL_ATTACH: 交给 target 的附件, 引用随邮件转移
+    SSL* tls;               // MAIL_RESUME: 新连接已握手的 TLS 会话, 随 fd 一起移交
+    BufferRef payload;      // 各分片共享同一块缓冲区
+};
+
+struct SessionSlot {
+    Connection* conn;
+    uint32_t generation;
+};
+
+// 每个 reactor 独占一个 SO_REUSEPORT 监听套接字和自己那一份已登录连接
+struct Reactor {
+    int id;
+    int epollFd;
+    int listenFd;
+    int mailEventFd;
+    atomic<MailItem*> mailHead;     // 多生产者无锁栈, 消费者整体取走后反转
+    atomic<bool> mailSignaled;      // 合并唤醒, 避免每条消息都写一次 eventfd
+    vector<SessionSlot> slots;      // 会话句柄的槽位表
+    vector<uint32_t> freeSlots;
+    vector<Connection*> clients;    // 已登录连接的紧凑数组, 广播时顺序遍历
+    vector<Connection*> closeList;  // 待关闭的连接, 避免在遍历 clients 时修改它
+    vector<Connection*> resumeList; // 热重启接管的连接, 启动时先处理其中已收到的数据
+    vector<Connection*> detachedList;   // 断线后等待续传的会话, 超时后关闭
+    vector<Connection*> throttledList;  // 超过限速而暂停读取的连接, 令牌补足后恢复
+    struct IoRing* ring;            // io_uring 后端: 本分片的提交/完成队列, 在 reactor 线程中创建
+    vector<Connection*> flushList;  // io_uring 后端: 本轮有新数据待发的连接, 循环末尾一次提交
+    vector<Connection*> streamingList;  // 附件发送用完本轮配额的连接, 下一轮继续
+    TimerWheel timers;              // 本分片连接的登录、心跳和空闲超时
+    pthread_t tid;
+};
+
+vector<Reactor*> reactors;
+thread_local Reactor* currentReactor = nullptr;
+
+// 以 fd 为下标的连接表, 仅 epoll 模式使用; 每个元素只由连接所属的 reactor 访问
+vector<Connection*> connTable;
+// 线程模式下各 fd 协商的协议, 广播时据此决定是否加帧头
+vector<unsigned char> fdProtocol;
+
+void postMail(Reactor* r, MailItem* item) {
+    MailItem* head = r->mailHead.load(memory_order_relaxed);
+    do {
+        item->next = head;
+    } while (!r->mailHead.compare_exchange_weak(head, item, memory_order_release, memory_order_relaxed));
+
+    if (!r->mailSignaled.exchange(true, memory_order_acq_rel)) {
+        uint64_t one = 1;
+        write(r->mailEventFd, &one, sizeof(one));
+    }
+}
+
+// 阻塞发送完整的数据, 线程模式使用. 套接字设有 SO_SNDTIMEO, 对方只偶尔腾出一点窗口时每次超时仍会写进去一些,
+// 所以按整次调用计时: 超过 THREAD_SEND_TIMEOUT_SEC 还没发完就关闭连接的收发, 对方的线程随即读到断开并清理.
+// fd 只是 shutdown 而没有 close, 在读区内调用也不会被复用
+void sendAllBlocking(int fd, const char* data, size_t len) {
+    uint64_t deadline = monotonicNs() + THREAD_SEND_TIMEOUT_SEC * 1000000000ULL;
+    while (len > 0) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) return;
+        if (n > 0) {
+            countStat(STAT_BYTES_OUT, n);
+            data += n;
+            len -= n;
+        }
+        if (len > 0 && monotonicNs() >= deadline) {
+            cout << "客户端 " << fd << " 超过 " << THREAD_SEND_TIMEOUT_SEC << " 秒不接收数据, 断开连接" << endl;
+            shutdown(fd, SHUT_RDWR);
+            return;
+        }
+    }
+}
+
+// 线程模式和线程池模式下 fd 的发送状态: 广播、房间消息和私聊会同时从多个线程发往同一个 fd, 都在 mutex 内进行,
+// 字节不会交错. 线程模式在锁内阻塞写完; 线程池模式非阻塞发送, 发不完的进入有界队列, 由轮询线程在 EPOLLOUT 时继续.
+// 连接建立后、登录前创建, 在 unregisterUser 等读者离开之后由 closeBlockingOutput 放手
+struct BlockingOutput {
+    pthread_mutex_t mutex;
+    int fd;
+    atomic<int> refs;           // 连接一份; 线程池模式下等待 EPOLLOUT 期间轮询线程再持有一份
+    bool ownsFd;                // 线程池模式: 最后一份引用释放时才关闭 fd, 轮询线程还在用时 fd 不会被复用
+    bool closed;                // 不再接受输出: 连接已关闭, 或因接收过慢被断开
+    bool writeArmed;            // 已交给轮询线程等待 EPOLLOUT
+    deque<BufferRef> queue;     // 线程池模式下没发完的消息
+    size_t queuedBytes;
+    size_t headOffset;          // 队首消息已经发出的字节数
+};
+
+// 按 fd 下标, 与 fdProtocol 一样大. 接受连接和关闭连接可能在不同线程, fd 复用时只有内核保证先后, 所以用原子量
+vector<atomic<BlockingOutput*>> blockingOutputs;
+
+void openBlockingOutput(int fd, bool ownsFd) {
+    BlockingOutput* out = new BlockingOutput();
+    pthread_mutex_init(&out->mutex, nullptr);
+    out->fd = fd;
+    out->refs.store(1);
+    out->ownsFd = ownsFd;
+    out->closed = false;
+    out->writeArmed = false;
+    out->queuedBytes = 0;
+    out->headOffset = 0;
+    blockingOutputs[fd].store(out, memory_order_release);
+}
+
+void releaseBlockingOutput(BlockingOutput* out) {
+    if (out->refs.fetch_sub(1, memory_order_acq_rel) != 1) return;
+    if (out->ownsFd) close(out->fd);
+    pthread_mutex_destroy(&out->mutex);
+    delete out;
+}
+
+// 连接关闭时调用, 之后不会再有线程找到它. 轮询线程还持有引用时 shutdown 套接字, 让它收到事件后放手
+void closeBlockingOutput(int fd) {
+    BlockingOutput* out = blockingOutputs[fd].exchange(nullptr, memory_order_acq_rel);
+    if (out == nullptr) return;
+    pthread_mutex_lock(&out->mutex);
+    out->closed = true;
+    out->queue.clear();
+    out->queuedBytes = 0;
+    bool armed = out->writeArmed;
+    pthread_mutex_unlock(&out->mutex);
+    if (armed) shutdown(fd, SHUT_RDWR);
+    releaseBlockingOutput(out);
+}
+
+BlockingOutput* blockingOutputFor(int fd) {
+    return fd >= 0 && (size_t)fd < blockingOutputs.size() ? blockingOutputs[fd].load(memory_order_acquire) : nullptr;
+}
+
+// 按 fd 协商的协议阻塞写出一条消息, 调用者持有 fd 的发送锁
+void writeBlocking(int fd, const BufferRef& message) {
+    int protocol = PROTO_TEXT;
+    if (fd >= 0 && (size_t)fd < fdProtocol.size()) protocol = fdProtocol[fd];
+    sendAllBlocking(fd, message.wireData(protocol), message.wireSize(protocol));
+}
+
+void queuePoolOutput(BlockingOutput* out, const BufferRef& message);
+
+// 线程池模式进发送队列, 线程模式 (以及登录前还没有发送状态的 fd) 阻塞写出; 调用者持有 out->mutex
+void writeClientLocked(int fd, BlockingOutput* out, const BufferRef& message) {
+    if (out != nullptr && serverMode == MODE_POOL) queuePoolOutput(out, message);
+    else writeBlocking(fd, message);
+}
+
+// 连接的关闭推迟到当前这一轮事件处理结束
+void scheduleClose(Connection* conn) {
+    if (conn->closing) return;
+    conn->closing = true;
+    conn->owner->closeList.push_back(conn);
+}
+
+// 丢掉带介绍帧的数据时该连接就不再认识这个用户, 下一条消息重新介绍
+void dropQueuedMessage(Connection* conn, size_t index) {
+    const BufferRef& message = conn->outQueue[index];
+    if (message.isRaw() && message.shared()->senderId != 0) conn->knownUsers.erase(message.shared()->senderId);
+    conn->outQueuedBytes -= message.wireSize(conn->protocol);
+    conn->outQueue.erase(conn->outQueue.begin() + index);
+    conn->outDropped++;
+    countStat(STAT_DROPPED);
+}
+
+// 发送队列超出上限时按慢速客户端策略处理; 已发出一部分的队首消息不能丢, 否则会破坏分帧
+void enforceQueueLimits(Connection* conn) {
+    if (conn->outQueuedBytes <= outQueueMaxBytes && conn->outQueue.size() <= outQueueMaxMsgs) return;
+
+    size_t first = conn->outHeadOffset > 0 ? 1 : 0;
+    if (conn->resumable) {
+        // 续传会话丢掉或合并消息会让序号对不上; 断开后客户端会重连, 缺的消息从 resendLog 补发
+        cout << "用户 " << conn->userName << " 接收过慢, 积压 " << conn->outQueuedBytes << " 字节, 断开等待续传" << endl;
+        scheduleClose(conn);
+    } else if (slowPolicy == SLOW_DISCONNECT) {
+        cout << "用户 " << conn->userName << " 接收过慢, 积压 " << conn->outQueuedBytes << " 字节, 断开连接" << endl;
+        scheduleClose(conn);
+    } else if (slowPolicy == SLOW_DROP_OLDEST) {
+        while ((conn->outQueuedBytes > outQueueMaxBytes || conn->outQueue.size() > outQueueMaxMsgs)
+               && conn->outQueue.size() > first + 1) {
+            dropQueuedMessage(conn, first);
+        }
+    } else {
+        size_t skipped = 0;
+        while (conn->outQueue.size() > first + 1) {
+            dropQueuedMessage(conn, first);
+            skipped++;
+        }
+        BufferRef notice = MessageFormatter().add("[系统消息]  网络过慢，已跳过 ").add(skipped).add(" 条消息").buffer();
+        if (conn->protocol == PROTO_BINARY) notice = encodeBinaryText(notice, conn->compress);
+        conn->outQueuedBytes += notice.wireSize(conn->protocol);
+        conn->outQueue.insert(conn->outQueue.begin() + first, move(notice));
+    }
+}
+
+// 把用户态加密好的密文写进套接字, 写完返回 true; 没写完时 errno 为 EAGAIN 或实际的错误
+bool flushTlsOut(Connection* conn) {
+    size_t sent = 0;
+    while (sent < conn->tlsOut.size()) {
+        ssize_t n = send(conn->fd, conn->tlsOut.data() + sent, conn->tlsOut.size() - sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        sent += n;
+        countStat(STAT_BYTES_OUT, n);
+    }
+    conn->tlsOut.erase(0, sent);
+    return conn->tlsOut.empty();
+}
+
+// 用户态 TLS 的发送: 上一个记录的密文写完之后才加密下一个, 所以积压的密文不超过一个记录.
+// 明文一经加密就算已发出, 返回值与 sendmsg 相同
+ssize_t sendTls(Connection* conn, const struct iovec* iov, int iovcnt) {
+    if (!flushTlsOut(conn)) return -1;
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; i++) total += iov[i].iov_len;
+    size_t sent = 0;
+    while (sent < total) {
+        size_t n = tlsEncrypt(conn->tls, iov, iovcnt, sent, conn->tlsOut);
+        if (n == 0) {
+            errno = EPROTO;
+            return -1;
+        }
+        sent += n;
+        if (!flushTlsOut(conn)) break;
+    }
+    return sent;
+}
+
+// 非阻塞发送一组 iovec; 总长度达到阈值时使用 MSG_ZEROCOPY, 并持有 refs 直到内核发回完成通知
+ssize_t sendIov(Connection* conn, struct iovec* iov, int iovcnt, const BufferRef* refs, int refCount, size_t total) {
+    if (conn->tlsUserSend) return sendTls(conn, iov, iovcnt);
+    struct msghdr msg = {};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+    bool zeroCopy = conn->zeroCopy && total >= zeroCopyThreshold;
+    ssize_t n = sendmsg(conn->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT | (zeroCopy ? MSG_ZEROCOPY : 0));
+    if (zeroCopy && n < 0 && errno == ENOBUFS) {
+        // 超出 optmem 限制时退回普通拷贝发送
+        zeroCopy = false;
+        n = sendmsg(conn->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+    }
+    if (zeroCopy && n >= 0) {
+        // 每次成功的 MSG_ZEROCOPY 调用按顺序占用一个通知编号
+        ZeroCopyPending pending;
+        pending.id = conn->zcNextId++;
+        pending.refs.assign(refs, refs + refCount);
+        conn->zcPending.push_back(move(pending));
+        conn->zcSends++;
+    }
+    if (n > 0) countStat(STAT_BYTES_OUT, n);
+    return n;
+}
+
+// epoll 模式下 fd 对应的连接, 线程模式下总是 nullptr
+Connection* connectionFor(int clientSocket) {
+    if (clientSocket >= 0 && (size_t)clientSocket < connTable.size()) {
+        return connTable[clientSocket];
+    }
+    return nullptr;
+}
+
+void markFlush(Connection* conn);
+
+// 由所属 reactor 非阻塞发送, 发不完的消息以引用形式进入有界发送队列, 留到 EPOLLOUT 时继续;
+// 附件块发到一半时消息只能排队, 等这一块发完.
+// io_uring 后端不在这里发送, 只把连接记入 flushList, 由 reactor 循环统一提交
+void queueOutput(Connection* conn, const BufferRef& message) {
+    size_t wireSize = message.wireSize(conn->protocol);
+    size_t sent = 0;
+    if (conn->uring != nullptr) {
+        markFlush(conn);
+    } else if (conn->outQueue.empty() && (conn->files.empty() || conn->files.front().headerLen == 0)) {
+        struct iovec iov;
+        iov.iov_base = (void*)message.wireData(conn->protocol);
+        iov.iov_len = wireSize;
+        ssize_t n = sendIov(conn, &iov, 1, &message, 1, wireSize);
+        if (n > 0) sent = n;
+        if (sent == wireSize) return;
+        // 没发完的消息成为队首, 用 outHeadOffset 记录已发出的字节
+        conn->outHeadOffset = sent;
+    }
+
+    conn->outQueuedBytes += wireSize;
+    conn->outQueue.push_back(message);
+    conn->outPeakBytes = max(conn->outPeakBytes, conn->outQueuedBytes);
+    enforceQueueLimits(conn);
+}
+
+// 给聊天或私聊消息附上二进制编码, 在消息被共享之前调用; 没有二进制连接在线时跳过
+void attachBinary(const BufferRef& message, uint32_t senderId, const string& sender, uint8_t op, string_view room, string_view text) {
+    if (binaryClients.load(memory_order_relaxed) == 0 || senderId == 0) return;
+    SharedBuffer* buf = message.shared();
+    string body;
+    putVarint(body, senderId);
+    if (op == OP_CHAT) {
+        putVarint(body, room.size());
+        body.append(room.data(), room.size());
+    }
+    body.append(text.data(), text.size());
+    string frame;
+    appendBinaryFrame(frame, op, body);
+    buf->senderId = senderId;
+    buf->binary = makeRawBuffer(frame.data(), frame.size()).release();
+    if (frame.size() >= COMPRESS_MIN_SIZE) {
+        BufferRef packed = encodeBinaryOutput(frame, true, false);
+        if (packed.payloadSize() < frame.size()) buf->binaryCompressed = packed.release();
+    }
+    string announce;
+    putVarint(announce, senderId);
+    announce += sender;
+    string announceFrame;
+    appendBinaryFrame(announceFrame, OP_USER, announce);
+    buf->announce = makeRawBuffer(announceFrame.data(), announceFrame.size()).release();
+}
+
+// 二进制连接的发送: 优先使用消息附带的共享编码. 发送者第一次出现时 OP_USER 和消息拼成一块排队,
+// 发送队列超限时两者一起保留或丢弃, 客户端不会收到没介绍过的用户编号
+void queueBinary(Connection* conn, const BufferRef& message) {
+    SharedBuffer* buf = message.shared();
+    if (buf->binary == nullptr) {
+        queueOutput(conn, encodeBinaryText(message, conn->compress));
+        return;
+    }
+    BufferRef encoded = BufferRef::share(conn->compress && buf->binaryCompressed != nullptr ? buf->binaryCompressed : buf->binary);
+    if (!conn->knownUsers.insert(buf->senderId).second) {
+        queueOutput(conn, encoded);
+        return;
+    }
+    BufferRef announce = BufferRef::share(buf->announce);
+    SharedBuffer* joined = allocBuffer(announce.payloadSize() + encoded.payloadSize(), true);
+    memcpy(joined->bytes() + FRAME_HEADER_SIZE, announce.payload(), announce.payloadSize());
+    memcpy(joined->bytes() + FRAME_HEADER_SIZE + announce.payloadSize(), encoded.payload(), encoded.payloadSize());
+    joined->senderId = buf->senderId;
+    queueOutput(conn, BufferRef(joined));
+}
+
+// 多帧的批量数据逐个帧头计数
+uint32_t countFrames(const BufferRef& message) {
+    if (!message.isRaw()) return 1;
+    uint32_t frames = 0;
+    const char* data = message.payload();
+    size_t len = message.payloadSize();
+    for (size_t pos = 0; pos + FRAME_HEADER_SIZE <= len; pos += FRAME_HEADER_SIZE + decodeFrameHeader(data + pos)) {
+        frames++;
+    }
+    return frames;
+}
+
+// 给下发的消息编号并保留引用, 超出 resumeBytes 时淘汰最旧的
+void recordResend(Connection* conn, const BufferRef& message) {
+    uint32_t frames = countFrames(message);
+    conn->resendLog.push_back(ResendEntry{conn->nextSeq, frames, message});
+    conn->nextSeq += frames;
+    conn->resendBytes += message.wireSize(PROTO_FRAMED);
+    while (conn->resendBytes > resumeBytes && conn->resendLog.size() > 1) {
+        conn->resendBytes -= conn->resendLog.front().message.wireSize(PROTO_FRAMED);
+        conn->resendLog.pop_front();
+    }
+}
+
+// 向单个客户端发送, 分帧协议的客户端带 4 字节长度头: 线程模式下阻塞发送;
+// epoll 模式下续传会话先记入 resendLog, 再交给发送队列
+void sendToClient(int clientSocket, const BufferRef& message) {
+    countStat(STAT_MSGS_OUT);
+    Connection* conn = connectionFor(clientSocket);
+    if (conn == nullptr) {
+        BlockingOutput* out = blockingOutputFor(clientSocket);
+        if (out != nullptr) pthread_mutex_lock(&out->mutex);
+        writeClientLocked(clientSocket, out, message);
+        if (out != nullptr) pthread_mutex_unlock(&out->mutex);
+        return;
+    }
+
+    if (conn->resumable) recordResend(conn, message);
+    if (conn->closing || conn->detached) return;
+    if (conn->protocol == PROTO_BINARY) {
+        queueBinary(conn, message);
+    } else {
+        queueOutput(conn, message);
+    }
+}
+
+void sendToClient(int clientSocket, const string& message) {
+    sendToClient(clientSocket, makeBuffer(message));
+}
+
+// 控制帧不计入序号, 也不进 resendLog
+void sendControl(Connection* conn, const string& message) {
+    queueOutput(conn, makeBuffer(message));
+}
+
+// 丢弃尚未发出的数据; 零拷贝的缓冲区和 TLS 会话随旧套接字一起作废
+void resetOutput(Connection* conn) {
+    if (conn->tls != nullptr) {
+        SSL_free(conn->tls);
+        conn->tls = nullptr;
+        conn->tlsUserSend = false;
+        conn->tlsUserRecv = false;
+        conn->tlsOut.clear();
+    }
+    conn->outQueue.clear();
+    conn->outQueuedBytes = 0;
+    conn->outHeadOffset = 0;
+    conn->zcPending.clear();
+}
+
+// 为新登录的连接分配槽位并加入本分片的广播数组
+SessionId attachSession(Reactor* r, Connection* conn) {
+    uint32_t slot;
+    if (!r->freeSlots.empty()) {
+        slot = r->freeSlots.back();
+        r->freeSlots.pop_back();
+    } else {
+        slot = r->slots.size();
+        r->slots.push_back(SessionSlot{nullptr, 0});
+    }
+    r->slots[slot].conn = conn;
+    conn->sessionId = makeSessionId(r->id, slot, r->slots[slot].generation);
+    conn->clientIndex = r->clients.size();
+    r->clients.push_back(conn);
+    return conn->sessionId;
+}
+
+void detachSession(Reactor* r, Connection* conn) {
+    uint32_t slot = sessionSlot(conn->sessionId);
+    r->slots[slot].conn = nullptr;
+    r->slots[slot].generation++;
+    r->freeSlots.push_back(slot);
+
+    // 与末尾元素交换后删除
+    Connection* last = r->clients.back();
+    r->clients[conn->clientIndex] = last;
+    last->clientIndex = conn->clientIndex;
+    r->clients.pop_back();
+    conn->sessionId = INVALID_SESSION;
+}
+
+Connection* findSession(Reactor* r, SessionId id) {
+    uint32_t slot = sessionSlot(id);
+    if (sessionShard(id) != r->id || slot >= r->slots.size()) return nullptr;
+    if ((r->slots[slot].generation & 0xFFFF) != sessionGeneration(id)) return nullptr;
+    return r->slots[slot].conn;
+}
+
+// 按会话句柄投递, 不在当前线程的分片则走邮箱
+void deliverTo(SessionId target, const BufferRef& message) {
+    int shard = sessionShard(target);
+    if (shard == THREAD_SHARD) {
+        // 线程模式下在读区内发送, 目标 fd 在发送完之前不会被关闭复用; 发送有超时, 读区不会被无限拖住
+        int fd = sessionSlot(target);
+        ReadSection section(threadClientReaders);
+        const ThreadClientTable* clients = threadClients.load(memory_order_seq_cst);
+        auto it = clients->find(fd);
+        if (it != clients->end() && it->second == target) {
+            sendToClient(fd, message);
+        }
+        return;
+    }
+    if (currentReactor != nullptr && currentReactor->id == shard) {
+        Connection* conn = findSession(currentReactor, target);
+        if (conn != nullptr) sendToClient(conn->fd, message);
+        return;
+    }
+    MailItem* item = new MailItem();
+    item->kind = MAIL_DELIVER;
+    item->target = target;
+    item->payload = message;
+    postMail(reactors[shard], item);
+}
+
+void broadcastLocal(Reactor* r, const BufferRef& message, int senderSocket) {
+    for (size_t i = 0; i < r->clients.size(); i++) {
+        if (r->clients[i]->fd != senderSocket) {
+            sendToClient(r->clients[i]->fd, message);
+        }
+    }
+}
+
+// 消息只序列化一次, 本分片直接发送, 其他分片各投递一个引用, 整个过程不持有全局锁.
+// 只发给本节点的用户, 加入联邦时由 broadcastMessage 再转发给其他节点
+void broadcastOnNode(const BufferRef& message, int senderSocket) {
+    FanoutTimer timer;
+    if (serverMode == MODE_EPOLL) {
+        for (size_t i = 0; i < reactors.size(); i++) {
+            if (reactors[i] == currentReactor) {
+                broadcastLocal(currentReactor, message, senderSocket);
+                continue;
+            }
+            MailItem* item = new MailItem();
+            item->kind = MAIL_BROADCAST;
+            item->target = INVALID_SESSION;
+            item->payload = message;
+            postMail(reactors[i], item);
+        }
+        return;
+    }
+
+    ReadSection section(threadClientReaders);
+    const ThreadClientTable* clients = threadClients.load(memory_order_seq_cst);
+    for (auto& client : *clients) {
+        if (client.first != senderSocket) {
+            sendToClient(client.first, message);
+        }
+    }
+}
+
+void ringWrite(RoomHistory& h, size_t pos, const char* data, size_t len) {
+    size_t first = min(len, h.ring.size() - pos);
+    memcpy(h.ring.data() + pos, data, first);
+    memcpy(h.ring.data(), data + first, len - first);
+}
+
+void ringRead(const RoomHistory& h, size_t pos, char* out, size_t len) {
+    size_t first = min(len, h.ring.size() - pos);
+    memcpy(out, h.ring.data() + pos, first);
+    memcpy(out + first, h.ring.data(), len - first);
+}
+
+// 环的容量加倍 (不超过 historyBytes), 记录按从旧到新移到开头; 预算不够且没有可回收的环时返回 false. 调用者持有 h.mutex
+bool growHistory(RoomHistory& h) {
+    size_t oldSize = h.ring.size();
+    size_t newSize = min(historyBytes, max(HISTORY_MIN_RING, oldSize * 2));
+    size_t extra = newSize - oldSize;
+    while (historyAllocated.fetch_add(extra) + extra > historyTotalBytes) {
+        historyAllocated.fetch_sub(extra);
+        if (!reclaimIdleHistory()) return false;
+    }
+    vector<char> ring(newSize);
+    if (h.used > 0) ringRead(h, h.head, ring.data(), h.used);
+    for (size_t i = 0; i < h.records.size(); i++) {
+        h.records[i] = (h.records[i] + oldSize - h.head) % oldSize;
+    }
+    h.ring.swap(ring);
+    h.head = 0;
+    return true;
+}
+
+// 记录一条房间消息并返回它的序号, 调用者持有 h.mutex; 比整个环还大的消息不进历史
+uint64_t recordHistory(RoomHistory& h, const BufferRef& message) {
+    uint64_t seq = h.nextSeq++;
+    size_t recordSize = message.wireSize(PROTO_FRAMED);
+    if (historyBytes == 0 || recordSize > historyBytes) return seq;
+
+    while (h.used + recordSize > h.ring.size() && h.ring.size() < historyBytes) {
+        if (!growHistory(h)) break;
+    }
+    // 预算用完, 环还没有这条记录大
+    if (recordSize > h.ring.size()) return seq;
+    while (h.used + recordSize > h.ring.size()) {
+        char header[FRAME_HEADER_SIZE];
+        ringRead(h, h.records.front(), header, FRAME_HEADER_SIZE);
+        size_t evicted = FRAME_HEADER_SIZE + decodeFrameHeader(header);
+        h.head = (h.head + evicted) % h.ring.size();
+        h.used -= evicted;
+        h.records.pop_front();
+    }
+    size_t pos = (h.head + h.used) % h.ring.size();
+    ringWrite(h, pos, message.wireData(PROTO_FRAMED), recordSize);
+    h.records.push_back(pos);
+    h.used += recordSize;
+    return seq;
+}
+
+// 把最近 historyReplay 条消息按接收者的协议拼成一整块, 一次写出; 调用者持有 h.mutex.
+// 二进制协议也取分帧格式, 发送时再转换并压缩
+BufferRef snapshotHistory(const RoomHistory& h, const string& roomName, int protocol) {
+    size_t count = min(historyReplay, h.records.size());
+    if (count == 0) return BufferRef();
+
+    string title = "[历史消息]  房间 " + roomName + " 最近的 " + to_string(count) + " 条消息:";
+    size_t start = h.records[h.records.size() - count];
+    size_t span = h.used - (start + h.ring.size() - h.head) % h.ring.size();
+    SharedBuffer* buf = allocBuffer(FRAME_HEADER_SIZE + title.size() + span, true);
+    char* out = buf->bytes() + FRAME_HEADER_SIZE;
+    if (protocol != PROTO_TEXT) {
+        // 环中的记录本身就是分帧格式, 最多两次 memcpy
+        encodeFrameHeader(out, title.size());
+        memcpy(out + FRAME_HEADER_SIZE, title.data(), title.size());
+        ringRead(h, start, out + FRAME_HEADER_SIZE + title.size(), span);
+        return BufferRef(buf);
+    }
+
+    // 文本协议没有消息边界, 逐条去掉帧头并以换行分隔
+    size_t len = title.size();
+    memcpy(out, title.data(), len);
+    for (size_t i = h.records.size() - count; i < h.records.size(); i++) {
+        char header[FRAME_HEADER_SIZE];
+        ringRead(h, h.records[i], header, FRAME_HEADER_SIZE);
+        size_t payloadLen = decodeFrameHeader(header);
+        out[len++] = '\n';
+        ringRead(h, (h.records[i] + FRAME_HEADER_SIZE) % h.ring.size(), out + len, payloadLen);
+        len += payloadLen;
+    }
+    buf->length = len;
+    return BufferRef(buf);
+}
+
+// 挂到房间在本分片的订阅列表上, 本分片出现第一个订阅者时置位 shardMask
+void subscribeLocal(Connection* conn, RoomEntry* room) {
+    vector<Connection*>& subscribers = room->shards[conn->owner->id].subscribers;
+    conn->room = room;
+    conn->roomIndex = subscribers.size();
+    subscribers.push_back(conn);
+    if (subscribers.size() == 1) {
+        room->shardMask.fetch_or(1ULL << conn->owner->id, memory_order_release);
+    }
+    room->memberCount.fetch_add(1, memory_order_relaxed);
+}
+
+void unsubscribeLocal(Connection* conn) {
+    RoomEntry* room = conn->room;
+    if (room == nullptr) return;
+    // 与末尾元素交换后删除
+    vector<Connection*>& subscribers = room->shards[conn->owner->id].subscribers;
+    Connection* last = subscribers.back();
+    subscribers[conn->roomIndex] = last;
+    last->roomIndex = conn->roomIndex;
+    subscribers.pop_back();
+    if (subscribers.empty()) {
+        room->shardMask.fetch_and(~(1ULL << conn->owner->id), memory_order_release);
+    }
+    if (room->memberCount.fetch_sub(1, memory_order_relaxed) == 1) queueIdleRoom(room);
+    conn->room = nullptr;
+}
+
+// 把会话移到另一个房间并回放该房间的历史, room 为 nullptr 表示离开当前房间 (断开连接时); 重复调用无副作用.
+// 订阅和取历史快照在同一把锁内完成, 之后只接收序号更新的消息
+void moveToRoom(int clientSocket, RoomEntry* room) {
+    Connection* conn = connectionFor(clientSocket);
+    if (conn != nullptr) {
+        unsubscribeLocal(conn);
+        if (room == nullptr) return;
+        pthread_mutex_lock(&room->history.mutex);
+        subscribeLocal(conn, room);
+        conn->roomSeqFloor = room->history.nextSeq - 1;
+        BufferRef replay = snapshotHistory(room->history, room->name, conn->protocol);
+        pthread_mutex_unlock(&room->history.mutex);
+        if (replay) sendToClient(clientSocket, replay);
+        return;
+    }
+
+    // 线程模式: 发布消息不加 clientsMutex, 只在读区内读订阅者快照. 先拿住自己的发送锁再加入房间,
+    // 其他线程发来的新消息要等回放写完, 不会排到历史前面; 锁顺序为发送锁 -> clientsMutex -> history.mutex
+    BlockingOutput* out = room != nullptr ? blockingOutputFor(clientSocket) : nullptr;
+    if (out != nullptr) pthread_mutex_lock(&out->mutex);
+    const ThreadMemberList* leftList = nullptr;
+    const ThreadMemberList* joinedList = nullptr;
+    BufferRef replay;
+    pthread_mutex_lock(&clientsMutex);
+    auto it = threadRooms.find(clientSocket);
+    if (it != threadRooms.end()) {
+        RoomEntry* oldRoom = it->second;
+        leftList = oldRoom->threadMembers.load(memory_order_relaxed);
+        ThreadMemberList* next = new ThreadMemberList();
+        for (const ThreadMember& member : *leftList) {
+            if (member.fd != clientSocket) next->push_back(member);
+        }
+        oldRoom->threadMembers.store(next, memory_order_seq_cst);
+        if (oldRoom->memberCount.fetch_sub(1, memory_order_relaxed) == 1) queueIdleRoom(oldRoom);
+        threadRooms.erase(it);
+    }
+    if (room != nullptr) {
+        room->memberCount.fetch_add(1, memory_order_relaxed);
+        threadRooms[clientSocket] = room;
+        pthread_mutex_lock(&room->history.mutex);
+        joinedList = room->threadMembers.load(memory_order_relaxed);
+        ThreadMemberList* next = new ThreadMemberList(*joinedList);
+        next->push_back(ThreadMember{clientSocket, room->history.nextSeq - 1});
+        room->threadMembers.store(next, memory_order_seq_cst);
+        replay = snapshotHistory(room->history, room->name, fdProtocol[clientSocket]);
+        pthread_mutex_unlock(&room->history.mutex);
+    }
+    pthread_mutex_unlock(&clientsMutex);
+    if (replay) {
+        countStat(STAT_MSGS_OUT);
+        writeClientLocked(clientSocket, out, replay);
+    }
+    if (out != nullptr) pthread_mutex_unlock(&out->mutex);
+    if (leftList != nullptr) deferSnapshot(threadClientReaders, leftList);
+    if (joinedList != nullptr) deferSnapshot(threadClientReaders, joinedList);
+}
+
+RoomEntry* currentRoom(int clientSocket) {
+    Connection* conn = connectionFor(clientSocket);
+    if (conn != nullptr) return conn->room;
+
+    pthread_mutex_lock(&clientsMutex);
+    auto it = threadRooms.find(clientSocket);
+    RoomEntry* room = it != threadRooms.end() ? it->second : nullptr;
+    pthread_mutex_unlock(&clientsMutex);
+    return room;
+}
+
+void publishLocal(Reactor* r, RoomEntry* room, const BufferRef& message, int senderSocket, uint64_t seq) {
+    vector<Connection*>& subscribers = room->shards[r->id].subscribers;
+    for (size_t i = 0; i < subscribers.size(); i++) {
+        // 序号不大于 roomSeqFloor 的消息已经在进入房间时的回放中收到过
+        if (subscribers[i]->fd != senderSocket && seq > subscribers[i]->roomSeqFloor) {
+            sendToClient(subscribers[i]->fd, message);
+        }
+    }
+}
+
+// 只发给房间的订阅者: 本分片直接发送, 其他分片只有在 shardMask 中有订阅者时才投递一个引用.
+// 消息先写入房间历史并取得序号
+void publishOnNode(RoomEntry* room, const BufferRef& message, int senderSocket) {
+    FanoutTimer timer;
+    if (serverMode == MODE_EPOLL) {
+        pthread_mutex_lock(&room->history.mutex);
+        uint64_t seq = recordHistory(room->history, message);
+        uint64_t mask = room->shardMask.load(memory_order_acquire);
+        pthread_mutex_unlock(&room->history.mutex);
+        while (mask != 0) {
+            int shard = __builtin_ctzll(mask);
+            mask &= mask - 1;
+            if (currentReactor != nullptr && currentReactor->id == shard) {
+                publishLocal(currentReactor, room, message, senderSocket, seq);
+                continue;
+            }
+            MailItem* item = new MailItem();
+            item->kind = MAIL_ROOM;
+            item->target = INVALID_SESSION;
+            item->room = room;
+            item->seq = seq;
+            item->payload = message;
+            postMail(reactors[shard], item);
+        }
+        return;
+    }
+
+    // 线程模式: 在读区内向订阅者快照发送, 不持有任何全局锁; 快照中的 fd 在读区结束前不会被关闭复用
+    ReadSection section(threadClientReaders);
+    pthread_mutex_lock(&room->history.mutex);
+    uint64_t seq = recordHistory(room->history, message);
+    const ThreadMemberList* members = room->threadMembers.load(memory_order_seq_cst);
+    pthread_mutex_unlock(&room->history.mutex);
+    for (const ThreadMember& member : *members) {
+        if (member.fd != senderSocket && seq > member.seqFloor) {
+            sendToClient(member.fd, message);
+        }
+    }
+}
+
+// 房间消息的显示格式, 大厅里与原来一致; 日志恢复时用同样的格式重建历史
+BufferRef formatRoomMessage(const string& roomName, const string& sender, string_view text) {
+    MessageFormatter chatMsg;
+    if (roomName != LOBBY_ROOM) chatMsg.add("[").add(roomName).add("] ");
+    return chatMsg.add(sender).add(": ").add(text).buffer();
+}
+
+// ==================== 全文检索 ====================
+
+// 公开消息发布时增量写入倒排索引, /search 按词、发送者、房间和时间范围查找, 结果从新到旧.
+// 索引分段: 新消息进入活动段, 满 SEARCH_SEGMENT_DOCS 条或占用超过预算的 1/4 后原样封存为只读段,
+// 以快照发布, 查询封存段不加锁; 封存段的总占用超过预算的 3/4 时丢弃最旧的段, 总内存不超过 searchBytes.
+// 每段的词表是开放寻址的哈希表, 词的哈希在锁外算好.
+// 倒排表存放递增文档号的差值 varint, 每 SEARCH_SKIP_INTERVAL 个写一次绝对文档号并记一个跳点, 求交时从最短的表出发跳着前进.
+// 英文和数字按词切分并转小写, 中日韩文字每个字是一个词; 查询里切出多个词的片段 (中文短语、a-b 之类) 求交后再核对原文.
+// 发送者和房间作为带前缀的特殊词进索引, 时间范围按每段非递减的时间数组二分. 私聊不进索引
+const uint32_t SEARCH_SEGMENT_DOCS = 1 << 16;
+const uint32_t SEARCH_SKIP_INTERVAL = 128;
+const size_t SEARCH_MAX_RESULTS = 20;
+const size_t SEARCH_MAX_TERM = 32;      // 更长的词截断到这个字节数
+const size_t SEARCH_SNIPPET = 240;      // 结果中每条正文最多显示的字节数
+const size_t SEARCH_MIN_SLOTS = 1024;   // 词表的初始槽数
+const char SEARCH_SENDER_PREFIX = '\x01';
+const char SEARCH_ROOM_PREFIX = '\x02';
+
+struct PostingSkip {
+    uint32_t doc;       // 块中第一个文档号, 按绝对值编码
+    uint32_t offset;
+};
+
+struct PostingList {
+    string bytes;
+    uint32_t count = 0;
+    uint32_t lastDoc = 0;
+    vector<PostingSkip> skips;
+};
+
+struct SearchTerm {
+    string term;
+    uint64_t hash;
+    PostingList postings;
+};
+
+struct SearchSegment {
+    uint64_t baseDoc;               // 段内 0 号文档的全局编号
+    vector<uint32_t> times;         // 每条消息的时间 (秒), 非递减
+    vector<uint32_t> offsets;       // 每条消息在 texts 中的起始偏移
+    string texts;                   // 逐条 [1 字节房间名长度][房间名][1 字节发送者长度][发送者][正文]
+    vector<SearchTerm> terms;       // 按首次出现的顺序
+    vector<uint32_t> slots;         // 开放寻址表, 存 terms 下标加 1, 0 为空槽
+    size_t postingBytes;            // 倒排表和长词的堆上占用
+};
+
+typedef vector<const SearchSegment*> SearchShelf;   // 封存的段, 从旧到新
+
+// 封存时换下的快照和淘汰的段
+struct SearchReclaim {
+    const SearchShelf* shelf;
+    vector<const SearchSegment*> evicted;
+};
+
+struct SearchIndex {
+    pthread_mutex_t mutex;              // 保护活动段, 串行化封存段快照的替换
+    SearchSegment* active;
+    SearchSegment* spare;               // 封存时接替的活动段, 由回收线程在锁外预先分配
+    uint64_t nextDoc;
+    atomic<const SearchShelf*> shelf;
+    size_t shelfBytes;
+    atomic<uint64_t> evictedDocs;
+    ReadDomain readers;
+    pthread_mutex_t reclaimMutex;
+    pthread_cond_t reclaimCond;
+    vector<SearchReclaim> reclaim;      // 等回收线程释放的
+};
+
+SearchIndex searchIndex;
+
+SearchSegment* newSearchSegment(uint64_t baseDoc) {
+    SearchSegment* segment = new SearchSegment();
+    segment->baseDoc = baseDoc;
+    segment->postingBytes = 0;
+    segment->slots.assign(SEARCH_MIN_SLOTS, 0);
+    return segment;
+}
+
+// 回收线程: 段很大, 不能像在线用户表那样推迟到以后一起释放; 也不让发布消息的线程等查询结束,
+// 由这里等正在进行的查询离开后马上释放
+void* searchReclaimLoop(void*) {
+    vector<SearchReclaim> batch;
+    pthread_mutex_lock(&searchIndex.reclaimMutex);
+    while (true) {
+        while (searchIndex.reclaim.empty()) pthread_cond_wait(&searchIndex.reclaimCond, &searchIndex.reclaimMutex);
+        batch.swap(searchIndex.reclaim);
+        pthread_mutex_unlock(&searchIndex.reclaimMutex);
+        synchronizeReaders(searchIndex.readers);
+        for (size_t i = 0; i < batch.size(); i++) {
+            delete batch[i].shelf;
+            for (size_t j = 0; j < batch[i].evicted.size(); j++) delete batch[i].evicted[j];
+        }
+        batch.clear();
+        SearchSegment* spare = newSearchSegment(0);
+        pthread_mutex_lock(&searchIndex.mutex);
+        if (searchIndex.spare == nullptr) swap(searchIndex.spare, spare);
+        pthread_mutex_unlock(&searchIndex.mutex);
+        delete spare;
+        pthread_mutex_lock(&searchIndex.reclaimMutex);
+    }
+    return nullptr;
+}
+
+void initSearchIndex() {
+    pthread_mutex_init(&searchIndex.mutex, nullptr);
+    pthread_mutex_init(&searchIndex.reclaimMutex, nullptr);
+    pthread_cond_init(&searchIndex.reclaimCond, nullptr);
+    initReadDomain(searchIndex.readers);
+    searchIndex.active = newSearchSegment(0);
+    searchIndex.spare = newSearchSegment(0);
+    searchIndex.nextDoc = 0;
+    searchIndex.shelf.store(new SearchShelf());
+    searchIndex.shelfBytes = 0;
+    searchIndex.evictedDocs.store(0);
+    if (searchBytes == 0) return;
+    pthread_t tid;
+    pthread_create(&tid, nullptr, searchReclaimLoop, nullptr);
+    pthread_detach(tid);
+}
+
+// 短字符串存在对象内部, 不占堆
+inline size_t stringHeapBytes(const string& text) {
+    return text.capacity() >= sizeof(string) ? text.capacity() + 1 : 0;
+}
+
+size_t segmentBytes(const SearchSegment& segment) {
+    return segment.postingBytes + segment.texts.capacity() + segment.terms.capacity() * sizeof(SearchTerm)
+         + (segment.times.capacity() + segment.offsets.capacity() + segment.slots.capacity()) * sizeof(uint32_t);
+}
+
+// 解码一个 UTF-8 字符, 非法或截断的编码返回 0, 当作分隔符
+uint32_t nextCodePoint(string_view text, size_t& pos) {
+    unsigned char c = text[pos++];
+    if (c < 0x80) return c;
+    int extra = c >= 0xF0 ? 3 : c >= 0xE0 ? 2 : c >= 0xC0 ? 1 : -1;
+    if (extra < 0 || pos + extra > text.size()) return 0;
+    uint32_t cp = c & (0x3F >> extra);
+    for (int i = 0; i < extra; i++) {
+        unsigned char b = text[pos];
+        if ((b & 0xC0) != 0x80) return 0;
+        cp = (cp << 6) | (b & 0x3F);
+        pos++;
+    }
+    return cp;
+}
+
+// 0: 分隔符; 1: 组成单词的字符; 2: 单独成词 (中日韩文字等)
+int searchCharClass(uint32_t cp) {
+    if (cp < 0x80) return isalnum((int)cp) ? 1 : 0;
+    if (cp < 0xC0) return 0;
+    if (cp < 0x2000) return 1;
+    if (cp < 0x2E80 || (cp >= 0x3000 && cp < 0x3040) || (cp >= 0xFE30 && cp < 0xFE50) || (cp >= 0xFF00 && cp < 0xFFF0)) return 0;
+    return 2;
+}
+
+// 把 text 切成索引词交给 emit, 英文转小写
+template <typename Emit>
+void forEachSearchTerm(string_view text, Emit emit) {
+    char word[SEARCH_MAX_TERM];
+    size_t wordLen = 0;
+    size_t pos = 0;
+    while (pos < text.size()) {
+        size_t start = pos;
+        int kind = searchCharClass(nextCodePoint(text, pos));
+        if (kind == 1) {
+            if (wordLen + (pos - start) <= SEARCH_MAX_TERM) {
+                for (size_t i = start; i < pos; i++) word[wordLen++] = (char)tolower((unsigned char)text[i]);
+            }
+            continue;
+        }
+        if (wordLen > 0) emit(string_view(word, wordLen));
+        wordLen = 0;
+        if (kind == 2) emit(text.substr(start, pos - start));
+    }
+    if (wordLen > 0) emit(string_view(word, wordLen));
+}
+
+uint64_t hashSearchTerm(string_view term) {
+    return hash<string_view>()(term);
+}
+
+// 在活动段的词表中查找, 没有时插入; 装载率超过一半时槽数加倍
+PostingList& activePostings(SearchSegment& segment, const string& term, uint64_t hash) {
+    size_t mask = segment.slots.size() - 1;
+    size_t slot = hash & mask;
+    while (uint32_t index = segment.slots[slot]) {
+        SearchTerm& entry = segment.terms[index - 1];
+        if (entry.hash == hash && entry.term == term) return entry.postings;
+        slot = (slot + 1) & mask;
+    }
+    segment.terms.push_back(SearchTerm{term, hash, PostingList()});
+    segment.slots[slot] = segment.terms.size();
+    segment.postingBytes += stringHeapBytes(segment.terms.back().term);
+    if (segment.terms.size() * 2 > segment.slots.size()) {
+        segment.slots.assign(segment.slots.size() * 2, 0);
+        mask = segment.slots.size() - 1;
+        for (size_t i = 0; i < segment.terms.size(); i++) {
+            slot = segment.terms[i].hash & mask;
+            while (segment.slots[slot] != 0) slot = (slot + 1) & mask;
+            segment.slots[slot] = i + 1;
+        }
+    }
+    return segment.terms.back().postings;
+}
+
+void addPosting(SearchSegment& segment, const string& term, uint64_t hash, uint32_t doc) {
+    PostingList& list = activePostings(segment, term, hash);
+    if (list.count > 0 && list.lastDoc == doc) return;     // 同一条消息里重复的词
+    size_t before = stringHeapBytes(list.bytes) + list.skips.capacity() * sizeof(PostingSkip);
+    if (list.count % SEARCH_SKIP_INTERVAL == 0) {
+        list.skips.push_back(PostingSkip{doc, (uint32_t)list.bytes.size()});
+        putVarint(list.bytes, doc);
+    } else {
+        putVarint(list.bytes, doc - list.lastDoc);
+    }
+    segment.postingBytes += stringHeapBytes(list.bytes) + list.skips.capacity() * sizeof(PostingSkip) - before;
+    list.count++;
+    list.lastDoc = doc;
+}
+
+// 写满的段加入封存段快照, 超出预算时从最旧的段开始丢弃; 需持有 searchIndex.mutex, 只复制指针.
+// 返回被替换的快照, 调用者解锁后连同 evicted 中的段交给回收线程
+const SearchShelf* sealSegment(SearchSegment* full, vector<const SearchSegment*>& evicted) {
+    const SearchShelf* current = searchIndex.shelf.load(memory_order_relaxed);
+    SearchShelf* next = new SearchShelf(*current);
+    next->push_back(full);
+    searchIndex.shelfBytes += segmentBytes(*full);
+    while (searchIndex.shelfBytes > searchBytes / 4 * 3 && next->size() > 1) {
+        const SearchSegment* oldest = next->front();
+        next->erase(next->begin());
+        searchIndex.shelfBytes -= segmentBytes(*oldest);
+        searchIndex.evictedDocs.fetch_add(oldest->times.size(), memory_order_relaxed);
+        evicted.push_back(oldest);
+    }
+    searchIndex.shelf.store(next, memory_order_seq_cst);
+    return current;
+}
+
+// 把一条公开消息加入索引; 分词和计算哈希在锁外完成
+void indexMessage(const string& roomName, const string& sender, string_view text, uint64_t when) {
+    if (searchBytes == 0) return;
+    thread_local vector<string> terms;
+    thread_local vector<uint64_t> hashes;
+    size_t termCount = 0;
+    auto collect = [&](string_view term) {
+        if (termCount == terms.size()) terms.emplace_back();
+        terms[termCount++].assign(term.data(), term.size());
+    };
+    forEachSearchTerm(text, collect);
+    if (termCount + 2 > terms.size()) terms.resize(termCount + 2);
+    terms[termCount++].assign(1, SEARCH_SENDER_PREFIX).append(sender);
+    terms[termCount++].assign(1, SEARCH_ROOM_PREFIX).append(roomName);
+    hashes.resize(termCount);
+    for (size_t i = 0; i < termCount; i++) hashes[i] = hashSearchTerm(terms[i]);
+
+    pthread_mutex_lock(&searchIndex.mutex);
+    SearchSegment* segment = searchIndex.active;
+    uint32_t doc = segment->times.size();
+    // 各线程取的时间可能相差一秒, 保持非递减才能按时间二分
+    segment->times.push_back(max((uint32_t)when, segment->times.empty() ? 0 : segment->times.back()));
+    segment->offsets.push_back(segment->texts.size());
+    segment->texts.push_back((char)roomName.size());
+    segment->texts.append(roomName);
+    segment->texts.push_back((char)sender.size());
+    segment->texts.append(sender);
+    segment->texts.append(text.data(), text.size());
+    for (size_t i = 0; i < termCount; i++) addPosting(*segment, terms[i], hashes[i], doc);
+    searchIndex.nextDoc++;
+    bool full = doc + 1 >= SEARCH_SEGMENT_DOCS || segmentBytes(*segment) >= searchBytes / 4 || segment->texts.size() >= (1U << 31);
+    if (!full) {
+        pthread_mutex_unlock(&searchIndex.mutex);
+        return;
+    }
+    // 锁内只换上新的活动段并发布封存快照, 查询不会漏掉刚封存的段; 释放交给回收线程
+    SearchReclaim reclaim;
+    reclaim.shelf = sealSegment(segment, reclaim.evicted);
+    SearchSegment* fresh = searchIndex.spare != nullptr ? searchIndex.spare : newSearchSegment(0);
+    searchIndex.spare = nullptr;
+    fresh->baseDoc = searchIndex.nextDoc;
+    searchIndex.active = fresh;
+    pthread_mutex_unlock(&searchIndex.mutex);
+
+    pthread_mutex_lock(&searchIndex.reclaimMutex);
+    searchIndex.reclaim.push_back(move(reclaim));
+    pthread_cond_signal(&searchIndex.reclaimCond);
+    pthread_mutex_unlock(&searchIndex.reclaimMutex);
+}
+
+// 按文档号递增遍历一个倒排表
+struct PostingCursor {
+    const PostingList* list;
+    size_t pos;         // 下一个编码的偏移
+    uint32_t index;     // 下一个文档在表中的序号
+    uint32_t doc;       // 当前文档
+    bool valid;
+
+    explicit PostingCursor(const PostingList* postings) : list(postings), pos(0), index(0), doc(0), valid(true) { next(); }
+
+    bool next() {
+        if (index >= list->count) return valid = false;
+        uint64_t value;
+        pos += getVarint(list->bytes.data() + pos, list->bytes.size() - pos, value);
+        doc = index % SEARCH_SKIP_INTERVAL == 0 ? (uint32_t)value : doc + (uint32_t)value;
+        index++;
+        return true;
+    }
+
+    // 前进到第一个不小于 target 的文档, 目标在后面的块里时先按跳点跳过去
+    bool seek(uint32_t target) {
+        if (!valid || doc >= target) return valid;
+        size_t block = upper_bound(list->skips.begin(), list->skips.end(), target,
+                                   [](uint32_t value, const PostingSkip& skip) { return value < skip.doc; }) - list->skips.begin() - 1;
+        if (block > (index - 1) / SEARCH_SKIP_INTERVAL) {
+            pos = list->skips[block].offset;
+            index = block * SEARCH_SKIP_INTERVAL;
+            next();
+        }
+        while (doc < target) {
+            if (!next()) return false;
+        }
+        return true;
+    }
+};
+
+struct SearchQuery {
+    vector<string> terms;       // 全部要求出现的索引词, 含发送者和房间
+    vector<string> phrases;     // 切出多个词的查询片段, 求交后在原文 (英文转小写) 中核对
+    uint32_t since = 0;
+    uint32_t until = UINT32_MAX;
+};
+
+struct SearchHit {
+    uint32_t time;
+    string roomName;
+    string sender;
+    string text;
+};
+
+// "30m" "2h" "7d" 之类的时长, 不带单位按秒
+bool parseDuration(const string& value, uint64_t& seconds) {
+    char* end = nullptr;
+    unsigned long long count = strtoull(value.c_str(), &end, 10);
+    if (end == value.c_str()) return false;
+    string unit(end);
+    if (unit.empty() || unit == "s") seconds = count;
+    else if (unit == "m") seconds = count * 60;
+    else if (unit == "h") seconds = count * 3600;
+    else if (unit == "d") seconds = count * 86400;
+    else return false;
+    return true;
+}
+
+// 查询语法: [from:发送者] [in:房间] [since:时长] [before:时长] 关键词...
+bool parseSearchQuery(string_view text, SearchQuery& query) {
+    uint64_t now = (uint64_t)time(0);
+    size_t pos = 0;
+    while (pos < text.size()) {
+        size_t end = text.find(' ', pos);
+        if (end == string_view::npos) end = text.size();
+        string word(text.substr(pos, end - pos));
+        pos = end + 1;
+        if (word.empty()) continue;
+        uint64_t seconds;
+        if (word.compare(0, 5, "from:") == 0 && word.size() > 5) {
+            query.terms.push_back(SEARCH_SENDER_PREFIX + word.substr(5));
+        } else if (word.compare(0, 3, "in:") == 0 && word.size() > 3) {
+            query.terms.push_back(SEARCH_ROOM_PREFIX + word.substr(3));
+        } else if (word.compare(0, 6, "since:") == 0) {
+            if (!parseDuration(word.substr(6), seconds)) return false;
+            query.since = (uint32_t)(now - min(now, seconds));
+        } else if (word.compare(0, 7, "before:") == 0) {
+            if (!parseDuration(word.substr(7), seconds)) return false;
+            query.until = (uint32_t)(now - min(now, seconds));
+        } else {
+            size_t count = 0;
+            forEachSearchTerm(word, [&](string_view term) {
+                query.terms.emplace_back(term);
+                count++;
+            });
+            if (count > 1) {
+                for (size_t i = 0; i < word.size(); i++) word[i] = (char)tolower((unsigned char)word[i]);
+                query.phrases.push_back(word);
+            }
+        }
+    }
+    sort(query.terms.begin(), query.terms.end());
+    query.terms.erase(unique(query.terms.begin(), query.terms.end()), query.terms.end());
+    return !query.terms.empty();
+}
+
+const PostingList* findPostings(const SearchSegment& segment, const string& term) {
+    uint64_t hash = hashSearchTerm(term);
+    size_t mask = segment.slots.size() - 1;
+    for (size_t slot = hash & mask; segment.slots[slot] != 0; slot = (slot + 1) & mask) {
+        const SearchTerm& entry = segment.terms[segment.slots[slot] - 1];
+        if (entry.hash == hash && entry.term == term) return &entry.postings;
+    }
+    return nullptr;
+}
+
+void readSearchDocument(const SearchSegment& segment, uint32_t doc, string_view& roomName, string_view& sender, string_view& text) {
+    size_t begin = segment.offsets[doc];
+    size_t end = doc + 1 < segment.offsets.size() ? segment.offsets[doc + 1] : segment.texts.size();
+    const char* record = segment.texts.data() + begin;
+    size_t roomLen = (unsigned char)record[0];
+    size_t senderLen = (unsigned char)record[1 + roomLen];
+    roomName = string_view(record + 1, roomLen);
+    sender = string_view(record + 2 + roomLen, senderLen);
+    text = string_view(record + 2 + roomLen + senderLen, end - begin - 2 - roomLen - senderLen);
+}
+
+// 在一个段内查找, 从新到旧追加结果直到 hits 达到 SEARCH_MAX_RESULTS 条
+void searchSegment(const SearchSegment& segment, const SearchQuery& query, vector<SearchHit>& hits) {
+    vector<PostingCursor> cursors;
+    for (size_t i = 0; i < query.terms.size(); i++) {
+        const PostingList* list = findPostings(segment, query.terms[i]);
+        if (list == nullptr) return;
+        cursors.emplace_back(list);
+    }
+    uint32_t low = lower_bound(segment.times.begin(), segment.times.end(), query.since) - segment.times.begin();
+    uint32_t high = lower_bound(segment.times.begin(), segment.times.end(), query.until) - segment.times.begin();
+    if (low >= high) return;
+    sort(cursors.begin(), cursors.end(),
+         [](const PostingCursor& a, const PostingCursor& b) { return a.list->count < b.list->count; });
+
+    // 最短的表提出候选, 其余的表跳到候选处确认; 有表越过候选时以它为新的候选
+    thread_local vector<uint32_t> matches;
+    matches.clear();
+    uint32_t target = low;
+    bool more = true;
+    while (more && cursors[0].seek(target) && cursors[0].doc < high) {
+        target = cursors[0].doc;
+        bool all = true;
+        for (size_t i = 1; i < cursors.size() && all; i++) {
+            if (!cursors[i].seek(target)) {
+                more = all = false;
+            } else if (cursors[i].doc > target) {
+                target = cursors[i].doc;
+                all = false;
+            }
+        }
+        if (all) matches.push_back(target++);
+    }
+
+    thread_local string lowered;
+    for (size_t i = matches.size(); i > 0 && hits.size() < SEARCH_MAX_RESULTS; i--) {
+        string_view roomName, sender, text;
+        readSearchDocument(segment, matches[i - 1], roomName, sender, text);
+        bool found = true;
+        if (!query.phrases.empty()) {
+            lowered.assign(text.data(), text.size());
+            for (size_t k = 0; k < lowered.size(); k++) lowered[k] = (char)tolower((unsigned char)lowered[k]);
+            for (size_t k = 0; k < query.phrases.size() && found; k++) found = lowered.find(query.phrases[k]) != string::npos;
+        }
+        if (found) hits.push_back(SearchHit{segment.times[matches[i - 1]], string(roomName), string(sender), string(text)});
+    }
+}
+
+// 执行一次查询, 返回发给用户或打印到控制台的文本. 先在锁内查活动段, 再在读区内从新到旧查封存段;
+// 两步之间活动段可能已经封存, 按起始文档号跳过查过的段
+string runSearch(string_view queryText) {
+    if (searchBytes == 0) return "服务器没有开启检索";
+    SearchQuery query;
+    if (!parseSearchQuery(queryText, query)) {
+        return "用法: /search [from:用户] [in:房间] [since:时长] [before:时长] 关键词..., 时长如 30m 2h 7d";
+    }
+    uint64_t begin = monotonicNs();
+    vector<SearchHit> hits;
+    pthread_mutex_lock(&searchIndex.mutex);
+    searchSegment(*searchIndex.active, query, hits);
+    uint64_t floorDoc = searchIndex.active->baseDoc;
+    uint64_t indexed = searchIndex.nextDoc - searchIndex.evictedDocs.load(memory_order_relaxed);
+    pthread_mutex_unlock(&searchIndex.mutex);
+    {
+        ReadSection section(searchIndex.readers);
+        const SearchShelf* shelf = searchIndex.shelf.load(memory_order_seq_cst);
+        for (size_t i = shelf->size(); i > 0 && hits.size() < SEARCH_MAX_RESULTS; i--) {
+            if ((*shelf)[i - 1]->baseDoc < floorDoc) searchSegment(*(*shelf)[i - 1], query, hits);
+        }
+    }
+    uint64_t elapsed = monotonicNs() - begin;
+    countStat(STAT_SEARCHES);
+    countStat(STAT_SEARCH_NS, elapsed);
+
+    char summary[128];
+    snprintf(summary, sizeof(summary), "用时 %.2f ms, 索引中共 %llu 条消息", elapsed / 1e6, (unsigned long long)indexed);
+    if (hits.empty()) return string("没有找到匹配的消息 (") + summary + ")";
+    // 结果达到上限时说明还有更早的匹配没有显示
+    string reply = string(hits.size() >= SEARCH_MAX_RESULTS ? "最近的 " : "找到 ") + to_string(hits.size())
+                 + " 条匹配 (" + summary + "):\n";
+    for (size_t i = 0; i < hits.size(); i++) {
+        time_t when = hits[i].time;
+        tm localTime;
+        localtime_r(&when, &localTime);
+        char stamp[32];
+        strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &localTime);
+        reply.append("[").append(stamp).append("]  ");
+        if (hits[i].roomName != LOBBY_ROOM) reply.append("[").append(hits[i].roomName).append("] ");
+        reply.append(hits[i].sender).append(": ");
+        string_view text = hits[i].text;
+        if (text.size() > SEARCH_SNIPPET) {
+            size_t len = SEARCH_SNIPPET;
+            while (len > 0 && ((unsigned char)text[len] & 0xC0) == 0x80) len--;
+            reply.append(text.substr(0, len)).append("...");
+        } else {
+            reply.append(text);
+        }
+        reply.push_back('\n');
+    }
+    return reply;
+}
+
+// 运行统计用: 索引中的消息数、估计占用和封存段数
+void searchIndexUsage(uint64_t& docs, size_t& bytes, size_t& segments) {
+    pthread_mutex_lock(&searchIndex.mutex);
+    docs = searchIndex.nextDoc - searchIndex.evictedDocs.load(memory_order_relaxed);
+    bytes = segmentBytes(*searchIndex.active) + searchIndex.shelfBytes;
+    segments = searchIndex.shelf.load(memory_order_relaxed)->size();
+    pthread_mutex_unlock(&searchIndex.mutex);
+}
+
+// ==================== 离线私聊 ====================
+
+// 发给不在线用户的私聊存进收件人的信箱, 登录时按接收者的协议拼成一整块, 一次写出.
+// 所有信箱共用一块 mailboxBytes 大小的内存, 切成 MAILBOX_BLOCK 字节的块, 每个信箱是一条块链,
+// 记录按分帧格式 [4 字节帧头][负载] 首尾相接写入. 内存用完后新消息追加到暂存目录下的落盘文件 (创建后立即 unlink);
+// 信箱一旦有消息落盘, 之后的消息也落盘, 投递时先内存后文件即为原来的顺序. 落盘文件不超过内存预算的
+// MAILBOX_SPILL_RATIO 倍, 其中的消息全部投递后截断. 信箱按用户名放在哈希表里, 只在本节点投递.
+// 只给在本节点登录过的用户存信: 最近登录过的 MAILBOX_KNOWN_USERS 个用户名按先后排成队列, 满了淘汰最早的
+// (有信箱的跳过). 随便编的用户名占不了信箱, 每个发送者存入的字节数和信箱个数也另有上限
+const size_t MAILBOX_BLOCK = 256;
+const size_t MAILBOX_USER_BYTES = 256 << 10;    // 单个信箱的上限, 一个人刷屏占不满所有人的空间
+const size_t MAILBOX_SENDER_BYTES = 1 << 20;    // 一个发送者在所有信箱里的上限
+const size_t MAILBOX_MAX_BOXES = 1 << 14;
+const size_t MAILBOX_KNOWN_USERS = 1 << 16;     // 须大于 MAILBOX_MAX_BOXES, 淘汰时总能找到没有信箱的用户名
+const size_t MAILBOX_SPILL_RATIO = 16;
+const uint32_t MAILBOX_NO_BLOCK = UINT32_MAX;
+
+enum MailboxResult { MAILBOX_STORED, MAILBOX_ONLINE, MAILBOX_UNKNOWN, MAILBOX_QUOTA, MAILBOX_FULL };
+
+struct SpillExtent {
+    uint64_t offset;
+    uint32_t length;
+};
+
+struct Mailbox {
+    uint32_t head = MAILBOX_NO_BLOCK;
+    uint32_t tail = MAILBOX_NO_BLOCK;
+    uint32_t tailUsed = 0;          // 尾块中已写的字节数
+    uint32_t count = 0;
+    size_t memoryBytes = 0;         // 块链中记录的总字节数
+    size_t spillBytes = 0;
+    vector<SpillExtent> spilled;    // 落盘的记录, 文件中相邻的合并成一段
+    unordered_map<string, size_t> senders;  // 各发送者存入的字节数, 投递后从 senderBytes 中扣除
+};
+
+struct MailboxStore {
+    pthread_mutex_t mutex;
+    char* arena = nullptr;
+    vector<uint32_t> nextBlock;     // 块链的后继; 空闲块也用它串成空闲链
+    uint32_t freeHead = MAILBOX_NO_BLOCK;
+    size_t freeBlocks = 0;
+    unordered_map<string, Mailbox> boxes;
+    unordered_map<string, size_t> senderBytes;  // 各发送者在所有信箱里的字节数
+    unordered_set<string> knownUsers;
+    deque<string> knownOrder;       // knownUsers 按首次登录的先后
+    int spillFd = -1;
+    uint64_t spillEnd = 0;          // 落盘文件的写入位置
+    uint64_t spillLive = 0;         // 其中还没投递的字节
+};
+
+MailboxStore mailboxStore;
+
+void initMailboxes() {
+    MailboxStore& s = mailboxStore;
+    pthread_mutex_init(&s.mutex, nullptr);
+    size_t blocks = min(mailboxBytes / MAILBOX_BLOCK, (size_t)MAILBOX_NO_BLOCK);
+    if (blocks == 0) return;
+    // 只有写过的页才占物理内存
+    s.arena = (char*)malloc(blocks * MAILBOX_BLOCK);
+    s.nextBlock.resize(blocks);
+    for (size_t i = 0; i < blocks; i++) {
+        s.nextBlock[i] = i + 1 < blocks ? i + 1 : MAILBOX_NO_BLOCK;
+    }
+    s.freeHead = 0;
+    s.freeBlocks = blocks;
+}
+
+size_t mailboxBlocksNeeded(const Mailbox& box, size_t len) {
+    size_t room = box.tail == MAILBOX_NO_BLOCK ? 0 : MAILBOX_BLOCK - box.tailUsed;
+    return len <= room ? 0 : (len - room + MAILBOX_BLOCK - 1) / MAILBOX_BLOCK;
+}
+
+// 接到块链末尾, 调用者持有锁并已确认空闲块足够
+void mailboxWrite(Mailbox& box, const char* data, size_t len) {
+    MailboxStore& s = mailboxStore;
+    while (len > 0) {
+        if (box.tail == MAILBOX_NO_BLOCK || box.tailUsed == MAILBOX_BLOCK) {
+            uint32_t block = s.freeHead;
+            s.freeHead = s.nextBlock[block];
+            s.freeBlocks--;
+            s.nextBlock[block] = MAILBOX_NO_BLOCK;
+            if (box.tail == MAILBOX_NO_BLOCK) box.head = block;
+            else s.nextBlock[box.tail] = block;
+            box.tail = block;
+            box.tailUsed = 0;
+        }
+        size_t n = min(len, MAILBOX_BLOCK - box.tailUsed);
+        memcpy(s.arena + (size_t)box.tail * MAILBOX_BLOCK + box.tailUsed, data, n);
+        box.tailUsed += n;
+        data += n;
+        len -= n;
+    }
+}
+
+// 追加到落盘文件, 调用者持有锁
+bool mailboxSpill(Mailbox& box, const char* data, size_t len) {
+    MailboxStore& s = mailboxStore;
+    if (s.spillEnd + len > mailboxBytes * MAILBOX_SPILL_RATIO) return false;
+    if (s.spillFd == -1) {
+        string path = spoolDir + "/chat-mailbox-XXXXXX";
+        s.spillFd = mkostemp(&path[0], O_CLOEXEC);
+        if (s.spillFd == -1) {
+            cout << "创建离线私聊落盘文件失败: " << strerror(errno) << endl;
+            return false;
+        }
+        unlink(path.c_str());
+    }
+    for (size_t done = 0; done < len;) {
+        ssize_t n = pwrite(s.spillFd, data + done, len - done, s.spillEnd + done);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) continue;
+            cout << "写离线私聊落盘文件失败: " << strerror(errno) << endl;
+            return false;
+        }
+        done += n;
+    }
+    if (!box.spilled.empty() && box.spilled.back().offset + box.spilled.back().length == s.spillEnd) {
+        box.spilled.back().length += len;
+    } else {
+        box.spilled.push_back(SpillExtent{s.spillEnd, (uint32_t)len});
+    }
+    s.spillEnd += len;
+    s.spillLive += len;
+    box.spillBytes += len;
+    return true;
+}
+
+// 记下在本节点登录过的用户, 调用者持有锁
+void rememberMailboxUser(const string& name) {
+    MailboxStore& s = mailboxStore;
+    if (!s.knownUsers.insert(name).second) return;
+    s.knownOrder.push_back(name);
+    for (size_t tries = s.knownOrder.size(); s.knownUsers.size() > MAILBOX_KNOWN_USERS && tries > 0; tries--) {
+        string oldest = std::move(s.knownOrder.front());
+        s.knownOrder.pop_front();
+        if (s.boxes.count(oldest) > 0) s.knownOrder.push_back(std::move(oldest));
+        else s.knownUsers.erase(oldest);
+    }
+}
+
+// 存一条分帧格式的记录并记在发送者名下 (sender 为空时不记); 调用者持有锁
+bool mailboxStoreRecord(const string& recipient, const string& sender, const char* record, size_t len) {
+    MailboxStore& s = mailboxStore;
+    auto it = s.boxes.find(recipient);
+    if (it != s.boxes.end() && it->second.memoryBytes + it->second.spillBytes + len > MAILBOX_USER_BYTES) return false;
+    if (it == s.boxes.end()) {
+        if (len > MAILBOX_USER_BYTES || s.boxes.size() >= MAILBOX_MAX_BOXES) return false;
+        it = s.boxes.emplace(recipient, Mailbox()).first;
+    }
+    Mailbox& box = it->second;
+    bool stored;
+    if (box.spillBytes == 0 && mailboxBlocksNeeded(box, len) <= s.freeBlocks) {
+        mailboxWrite(box, record, len);
+        box.memoryBytes += len;
+        stored = true;
+    } else {
+        stored = mailboxSpill(box, record, len);
+    }
+    if (stored) {
+        box.count++;
+        if (!sender.empty()) {
+            box.senders[sender] += len;
+            s.senderBytes[sender] += len;
+        }
+    } else if (box.count == 0) {
+        s.boxes.erase(it);
+    }
+    return stored;
+}
+
+// 发送者在所有信箱里已存入的字节数, 调用者持有锁
+size_t mailboxSenderBytes(const string& sender) {
+    auto it = mailboxStore.senderBytes.find(sender);
+    return it != mailboxStore.senderBytes.end() ? it->second : 0;
+}
+
+// 在信箱的锁内再确认一次收件人不在线: 登录时先占用户名再取信箱, 这样不会有消息在信箱被取走之后才存进去
+MailboxResult storeOfflineMessage(const string& recipient, const string& sender, const BufferRef& message) {
+    size_t len = message.wireSize(PROTO_FRAMED);
+    pthread_mutex_lock(&mailboxStore.mutex);
+    MailboxResult result = MAILBOX_FULL;
+    if (lookupName(recipient) != INVALID_SESSION) {
+        result = MAILBOX_ONLINE;
+    } else if (mailboxStore.knownUsers.count(recipient) == 0) {
+        result = MAILBOX_UNKNOWN;
+    } else if (mailboxSenderBytes(sender) + len > MAILBOX_SENDER_BYTES) {
+        result = MAILBOX_QUOTA;
+    } else if (mailboxStoreRecord(recipient, sender, message.wireData(PROTO_FRAMED), len)) {
+        result = MAILBOX_STORED;
+    }
+    pthread_mutex_unlock(&mailboxStore.mutex);
+    if (result == MAILBOX_STORED) countStat(STAT_OFFLINE_STORED);
+    return result;
+}
+
+// 把信箱的全部记录按顺序复制到 out, 返回复制的字节数 (读落盘文件失败时少于总数); 调用者持有锁
+size_t mailboxCopy(const Mailbox& box, char* out) {
+    MailboxStore& s = mailboxStore;
+    size_t len = 0;
+    for (uint32_t block = box.head; block != MAILBOX_NO_BLOCK; block = s.nextBlock[block]) {
+        size_t n = min(box.memoryBytes - len, MAILBOX_BLOCK);
+        memcpy(out + len, s.arena + (size_t)block * MAILBOX_BLOCK, n);
+        len += n;
+    }
+    for (size_t i = 0; i < box.spilled.size(); i++) {
+        const SpillExtent& extent = box.spilled[i];
+        if (pread(s.spillFd, out + len, extent.length, extent.offset) != (ssize_t)extent.length) {
+            cout << "读离线私聊落盘文件失败: " << strerror(errno) << endl;
+            break;
+        }
+        len += extent.length;
+    }
+    return len;
+}
+
+// 删除信箱, 块还给空闲链; 落盘文件里已经没有未投递的消息时截断. 调用者持有锁
+void mailboxErase(unordered_map<string, Mailbox>::iterator it) {
+    MailboxStore& s = mailboxStore;
+    Mailbox& box = it->second;
+    for (uint32_t block = box.head; block != MAILBOX_NO_BLOCK;) {
+        uint32_t next = s.nextBlock[block];
+        s.nextBlock[block] = s.freeHead;
+        s.freeHead = block;
+        s.freeBlocks++;
+        block = next;
+    }
+    for (auto& entry : box.senders) {
+        auto sent = s.senderBytes.find(entry.first);
+        if (sent == s.senderBytes.end()) continue;
+        if (sent->second <= entry.second) s.senderBytes.erase(sent);
+        else sent->second -= entry.second;
+    }
+    s.spillLive -= box.spillBytes;
+    if (s.spillLive == 0 && s.spillEnd > 0 && ftruncate(s.spillFd, 0) == 0) s.spillEnd = 0;
+    s.boxes.erase(it);
+}
+
+// 登录时调用: 记下用户名, 取走他的全部离线私聊, 按接收者的协议拼成一整块; 二进制协议也取分帧格式, 发送时再转换并压缩.
+// 总是加锁查找: 与 storeOfflineMessage 在同一把锁下先后看到用户名和信箱, 消息才不会留在在线用户的信箱里
+BufferRef takeOfflineMessages(const string& recipient, int protocol) {
+    pthread_mutex_lock(&mailboxStore.mutex);
+    if (mailboxBytes > 0) rememberMailboxUser(recipient);
+    auto it = mailboxStore.boxes.find(recipient);
+    if (it == mailboxStore.boxes.end()) {
+        pthread_mutex_unlock(&mailboxStore.mutex);
+        return BufferRef();
+    }
+    Mailbox& box = it->second;
+    uint32_t count = box.count;
+    string title = "[离线私聊]  你不在线时收到 " + to_string(count) + " 条私聊:";
+    SharedBuffer* buf = allocBuffer(FRAME_HEADER_SIZE + title.size() + box.memoryBytes + box.spillBytes, true);
+    char* out = buf->bytes() + FRAME_HEADER_SIZE;
+    encodeFrameHeader(out, title.size());
+    memcpy(out + FRAME_HEADER_SIZE, title.data(), title.size());
+    size_t len = FRAME_HEADER_SIZE + title.size() + mailboxCopy(box, out + FRAME_HEADER_SIZE + title.size());
+    mailboxErase(it);
+    pthread_mutex_unlock(&mailboxStore.mutex);
+    countStat(STAT_OFFLINE_DELIVERED, count);
+
+    if (protocol != PROTO_TEXT) {
+        buf->length = len;
+        return BufferRef(buf);
+    }
+    // 文本协议没有消息边界, 就地去掉帧头并以换行分隔
+    size_t textLen = 0;
+    for (size_t pos = 0; pos + FRAME_HEADER_SIZE <= len;) {
+        size_t payloadLen = decodeFrameHeader(out + pos);
+        if (textLen > 0) out[textLen++] = '\n';
+        memmove(out + textLen, out + pos + FRAME_HEADER_SIZE, payloadLen);
+        textLen += payloadLen;
+        pos += FRAME_HEADER_SIZE + payloadLen;
+    }
+    buf->length = textLen;
+    return BufferRef(buf);
+}
+
+// 运行统计用: 信箱数、登录过的用户数、内存中占用的块的字节数和落盘文件的大小
+void mailboxUsage(size_t& boxes, size_t& knownUsers, size_t& memoryBytes, uint64_t& spillBytes) {
+    pthread_mutex_lock(&mailboxStore.mutex);
+    boxes = mailboxStore.boxes.size();
+    knownUsers = mailboxStore.knownUsers.size();
+    memoryBytes = (mailboxStore.nextBlock.size() - mailboxStore.freeBlocks) * MAILBOX_BLOCK;
+    spillBytes = mailboxStore.spillEnd;
+    pthread_mutex_unlock(&mailboxStore.mutex);
+}
+
+// ==================== 持久化聊天日志 ====================
+
+// 只追加的二进制日志, 按段轮转, 文件名为递增的段号. 每个段以 LOG_SEGMENT_MAGIC 开头, 之后是连续的记录:
+//   [4 字节体长][4 字节 CRC32][体: 类型 1 | 时间 8 | 目标长度 1 | 发送者长度 1 | 目标 | 发送者 | 正文]
+// 目标对公开消息是房间名, 对私聊是接收者. 所有整数为大端.
+// 消息线程只把记录追加到内存中的待写缓冲区, 由单独的写线程成批 write 并 fdatasync 一次 (group commit).
+// 磁盘跟不上时待写缓冲区最多 LOG_PENDING_MAX 字节, 超出的记录丢弃并计数, 不让消息线程等磁盘;
+// 一批写失败时截回上次成功的位置 (截不回去就换新段), 这一批计入丢弃, 段里不会留下半条记录
+enum LogRecordKind { LOG_PUBLIC = 1, LOG_PRIVATE = 2 };
+
+const char LOG_SEGMENT_MAGIC[8] = {'C', 'H', 'A', 'T', 'L', 'O', 'G', '1'};
+const size_t LOG_RECORD_HEADER = 8;
+const size_t LOG_PENDING_MAX = 64 << 20;
+
+struct ChatLog {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    pthread_cond_t drained;     // 写线程把待写记录全部落盘后通知 flushChatLog
+    string pending;             // 等待写盘的记录
+    uint64_t pendingRecords;
+    bool writerIdle;            // 写线程在等待新记录, 只有这时才需要唤醒它
+    bool stopping;
+    int segmentFd;
+    uint64_t segmentIndex;
+    size_t segmentSize;         // 最后一次成功落盘后的段大小
+    uint64_t batches;
+    uint64_t records;
+    uint64_t dropped;           // 缓冲区满或写盘失败而丢掉的记录
+    pthread_t writer;
+};
+
+ChatLog chatLog;
+
+uint32_t crc32(const char* data, size_t len) {
+    static uint32_t table[256];
+    static bool ready = [] {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+            table[i] = c;
+        }
+        return true;
+    }();
+    (void)ready;
+    uint32_t crc = 0xFFFFFFFF;
+    for (size_t i = 0; i < len; i++) {
+        crc = table[(crc ^ (unsigned char)data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return crc ^ 0xFFFFFFFF;
+}
+
+string segmentPath(uint64_t index) {
+    char name[32];
+    snprintf(name, sizeof(name), "/%08llu.log", (unsigned long long)index);
+    return logDir + name;
+}
+
+bool writeAll(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+// 新建一个日志段, 同步目录项, 保证崩溃后文件本身还在
+bool openSegment(uint64_t index) {
+    int fd = open(segmentPath(index).c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (fd == -1) return false;
+    if (!writeAll(fd, LOG_SEGMENT_MAGIC, sizeof(LOG_SEGMENT_MAGIC)) || fdatasync(fd) == -1) {
+        close(fd);
+        return false;
+    }
+    int dirFd = open(logDir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirFd != -1) {
+        fsync(dirFd);
+        close(dirFd);
+    }
+    chatLog.segmentFd = fd;
+    chatLog.segmentIndex = index;
+    chatLog.segmentSize = sizeof(LOG_SEGMENT_MAGIC);
+    return true;
+}
+
+// 写下一个段; 失败时关闭日志, 之后的记录都计入丢弃
+void rotateSegment() {
+    close(chatLog.segmentFd);
+    if (!openSegment(chatLog.segmentIndex + 1)) {
+        cout << "无法创建日志段 " << segmentPath(chatLog.segmentIndex + 1) << ", 停止写日志" << endl;
+        chatLog.segmentFd = -1;
+    }
+}
+
+void* logWriterLoop(void*) {
+    string batch;
+    uint64_t batchRecords = 0;
+    bool failing = false;       // 连续失败时只在第一次和恢复时打印
+    pthread_mutex_lock(&chatLog.mutex);
+    while (true) {
+        while (chatLog.pending.empty() && !chatLog.stopping) {
+            chatLog.writerIdle = true;
+            pthread_cond_broadcast(&chatLog.drained);
+            pthread_cond_wait(&chatLog.cond, &chatLog.mutex);
+        }
+        chatLog.writerIdle = false;
+        if (chatLog.pending.empty()) break;
+        // 上一次 fdatasync 期间积累的记录一起落盘
+        batch.swap(chatLog.pending);
+        batchRecords = chatLog.pendingRecords;
+        chatLog.pendingRecords = 0;
+        pthread_mutex_unlock(&chatLog.mutex);
+
+        if (chatLog.segmentFd != -1 && chatLog.segmentSize + batch.size() > logSegmentBytes
+            && chatLog.segmentSize > sizeof(LOG_SEGMENT_MAGIC)) {
+            rotateSegment();
+        }
+        bool written = false;
+        if (chatLog.segmentFd != -1) {
+            written = writeAll(chatLog.segmentFd, batch.data(), batch.size()) && fdatasync(chatLog.segmentFd) == 0;
+            if (written) {
+                chatLog.segmentSize += batch.size();
+                if (failing) cout << "日志恢复写入" << endl;
+                failing = false;
+            } else {
+                if (!failing) cout << "写日志失败: " << strerror(errno) << ", 丢弃这一批及之后失败的记录" << endl;
+                failing = true;
+                if (ftruncate(chatLog.segmentFd, chatLog.segmentSize) == -1) rotateSegment();
+            }
+        }
+        chatLog.batches++;
+        batch.clear();
+        pthread_mutex_lock(&chatLog.mutex);
+        if (!written) chatLog.dropped += batchRecords;
+    }
+    pthread_mutex_unlock(&chatLog.mutex);
+    return nullptr;
+}
+
+// 追加一条记录; 编码和校验在锁外完成, 持锁只做一次拷贝, 写线程空闲时才唤醒
+void appendChatLog(LogRecordKind kind, const string& target, const string& sender, string_view text) {
+    if (logDir.empty()) return;
+
+    thread_local string record;
+    size_t bodyLen = 1 + 8 + 2 + target.size() + sender.size() + text.size();
+    record.resize(LOG_RECORD_HEADER + bodyLen);
+    char* body = &record[LOG_RECORD_HEADER];
+    uint64_t now = (uint64_t)time(0);
+    body[0] = (char)kind;
+    encodeFrameHeader(body + 1, (uint32_t)(now >> 32));
+    encodeFrameHeader(body + 5, (uint32_t)now);
+    body[9] = (char)target.size();
+    body[10] = (char)sender.size();
+    memcpy(body + 11, target.data(), target.size());
+    memcpy(body + 11 + target.size(), sender.data(), sender.size());
+    memcpy(body + 11 + target.size() + sender.size(), text.data(), text.size());
+    encodeFrameHeader(&record[0], bodyLen);
+    encodeFrameHeader(&record[4], crc32(body, bodyLen));
+
+    pthread_mutex_lock(&chatLog.mutex);
+    if (chatLog.pending.size() + record.size() > LOG_PENDING_MAX) {
+        chatLog.dropped++;
+        pthread_mutex_unlock(&chatLog.mutex);
+        return;
+    }
+    chatLog.pending += record;
+    chatLog.pendingRecords++;
+    chatLog.records++;
+    if (chatLog.writerIdle) {
+        chatLog.writerIdle = false;
+        pthread_cond_signal(&chatLog.cond);
+    }
+    pthread_mutex_unlock(&chatLog.mutex);
+}
+
+// 顺序读取一个日志段, 公开消息写回房间历史 (restoreHistory 为 true 时) 并加入检索索引,
+// 遇到截断或校验失败的记录就停止; 返回恢复的记录数
+size_t replaySegment(const string& path, vector<char>& data, bool restoreHistory) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return 0;
+    struct stat st;
+    fstat(fd, &st);
+    data.resize(st.st_size);
+    size_t got = 0;
+    while (got < data.size()) {
+        ssize_t n = read(fd, data.data() + got, data.size() - got);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) continue;
+            break;
+        }
+        got += n;
+    }
+    close(fd);
+
+    if (got < sizeof(LOG_SEGMENT_MAGIC) || memcmp(data.data(), LOG_SEGMENT_MAGIC, sizeof(LOG_SEGMENT_MAGIC)) != 0) {
+        cout << "日志段 " << path << " 格式不对, 已跳过" << endl;
+        return 0;
+    }
+    size_t pos = sizeof(LOG_SEGMENT_MAGIC);
+    size_t recovered = 0;
+    while (pos + LOG_RECORD_HEADER <= got) {
+        size_t bodyLen = decodeFrameHeader(data.data() + pos);
+        const char* body = data.data() + pos + LOG_RECORD_HEADER;
+        if (bodyLen < 11 || pos + LOG_RECORD_HEADER + bodyLen > got
+            || crc32(body, bodyLen) != decodeFrameHeader(data.data() + pos + 4)) {
+            break;
+        }
+        size_t targetLen = (unsigned char)body[9];
+        size_t senderLen = (unsigned char)body[10];
+        if (11 + targetLen + senderLen > bodyLen) break;
+        if (body[0] == LOG_PUBLIC) {
+            string roomName(body + 11, targetLen);
+            string sender(body + 11 + targetLen, senderLen);
+            string_view text(body + 11 + targetLen + senderLen, bodyLen - 11 - targetLen - senderLen);
+            if (restoreHistory) {
+                RoomEntry* room = findOrCreateRoom(roomName, reactors.size());
+                if (room != nullptr) {
+                    pthread_mutex_lock(&room->history.mutex);
+                    recordHistory(room->history, formatRoomMessage(roomName, sender, text));
+                    pthread_mutex_unlock(&room->history.mutex);
+                }
+            }
+            indexMessage(roomName, sender, text, ((uint64_t)decodeFrameHeader(body + 1) << 32) | decodeFrameHeader(body + 5));
+        }
+        recovered++;
+        pos += LOG_RECORD_HEADER + bodyLen;
+    }
+    if (pos < got) {
+        cout << "日志段 " << path << " 在偏移 " << pos << " 处不完整, 之后的 " << got - pos << " 字节被忽略" << endl;
+    }
+    return recovered;
+}
+
+// 启动时按段号顺序恢复全部日志, 然后在新的段上继续追加并启动写线程; 需在 reactor 创建之后调用.
+// 热重启时房间历史由旧进程直接交接, replayHistory 为 false, 日志只用来重建检索索引
+bool startChatLog(bool replayHistory) {
+    if (logDir.empty()) return true;
+    if (mkdir(logDir.c_str(), 0755) == -1 && errno != EEXIST) {
+        cout << "无法创建日志目录 " << logDir << endl;
+        return false;
+    }
+
+    vector<uint64_t> segments;
+    DIR* dir = opendir(logDir.c_str());
+    if (dir == nullptr) {
+        cout << "无法打开日志目录 " << logDir << endl;
+        return false;
+    }
+    while (struct dirent* entry = readdir(dir)) {
+        unsigned long long index;
+        char suffix[8];
+        if (sscanf(entry->d_name, "%llu.%7s", &index, suffix) == 2 && strcmp(suffix, "log") == 0) {
+            segments.push_back(index);
+        }
+    }
+    closedir(dir);
+    sort(segments.begin(), segments.end());
+
+    timespec begin, end;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    vector<char> data;
+    size_t recovered = 0;
+    bool replay = replayHistory || searchBytes > 0;
+    for (size_t i = 0; i < segments.size() && replay; i++) {
+        recovered += replaySegment(segmentPath(segments[i]), data, replayHistory);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (!segments.empty() && replay) {
+        long ms = (end.tv_sec - begin.tv_sec) * 1000 + (end.tv_nsec - begin.tv_nsec) / 1000000;
+        cout << "从 " << segments.size() << " 个日志段" << (replayHistory ? "恢复 " : "重建检索索引, ") << recovered
+             << " 条消息, 用时 " << ms << " ms" << endl;
+    }
+
+    pthread_mutex_init(&chatLog.mutex, nullptr);
+    pthread_cond_init(&chatLog.cond, nullptr);
+    pthread_cond_init(&chatLog.drained, nullptr);
+    chatLog.writerIdle = false;
+    chatLog.stopping = false;
+    chatLog.pendingRecords = 0;
+    chatLog.batches = 0;
+    chatLog.records = 0;
+    chatLog.dropped = 0;
+    if (!openSegment(segments.empty() ? 1 : segments.back() + 1)) {
+        cout << "无法创建日志段 " << segmentPath(segments.empty() ? 1 : segments.back() + 1) << endl;
+        return false;
+    }
+    pthread_create(&chatLog.writer, nullptr, logWriterLoop, nullptr);
+    return true;
+}
+
+// 等待已追加的记录全部落盘, 热重启交接前调用, 保证新进程开新段时旧进程不会再写
+void flushChatLog() {
+    if (logDir.empty()) return;
+    pthread_mutex_lock(&chatLog.mutex);
+    while (!chatLog.pending.empty() || !chatLog.writerIdle) {
+        pthread_cond_wait(&chatLog.drained, &chatLog.mutex);
+    }
+    pthread_mutex_unlock(&chatLog.mutex);
+}
+
+// 把剩余的记录写完后停止写线程
+void stopChatLog() {
+    if (logDir.empty()) return;
+    pthread_mutex_lock(&chatLog.mutex);
+    chatLog.stopping = true;
+    pthread_cond_signal(&chatLog.cond);
+    pthread_mutex_unlock(&chatLog.mutex);
+    pthread_join(chatLog.writer, nullptr);
+    if (chatLog.segmentFd != -1) close(chatLog.segmentFd);
+    cout << "聊天日志: " << chatLog.records << " 条记录, " << chatLog.batches << " 次批量落盘";
+    if (chatLog.dropped > 0) cout << ", 丢弃 " << chatLog.dropped << " 条";
+    cout << endl;
+}
+
+// ==================== 联邦中继 ====================
+
+// 多个节点组成全互联网格: 每个节点向每个对端主动建立一条只发不收的出站链路, 从对端的入站链路接收.
+// 在线用户表复制到所有节点, 远端用户以 REMOTE_SHARD 的会话句柄占用本地名字表, 于是查重、list 和私聊寻址
+// 都覆盖整个集群. 广播和房间消息发给所有对端, 私聊只发给目标用户所在的节点; 收到的消息只在本节点投递, 不再转发.
+// 每条出站链路一个发送线程, 各线程产生的帧先追加到链路的缓冲区, 由发送线程把积攒的帧一次写出
+
+const int REMOTE_SHARD = 0xFFFE;            // 其他节点上的会话, 槽位为节点编号
+const int RELAY_RETRY_MS = 1000;            // 对端不可达时的重连间隔
+const int RELAY_HELLO_MS = 5000;            // 等待对端回复握手
+const size_t RELAY_MAX_PENDING = 64 << 20;  // 发送线程跟不上时缓冲区的上限, 超过后断开链路重新同步
+const size_t RELAY_MAX_FRAME = MAX_FRAME_SIZE + 4096;
+
+// 帧格式与客户端分帧协议相同: [4 字节大端长度][1 字节类型][内容].
+// 除广播外内容以 [1 字节长度][用户名或房间名] 开头, 其余是已格式化好的消息
+enum RelayType { RELAY_HELLO = 1, RELAY_JOIN, RELAY_LEAVE, RELAY_BROADCAST, RELAY_ROOM, RELAY_PRIVATE };
+
+struct PeerLink {
+    string address;
+    struct sockaddr_in addr;
+    atomic<int> node;           // 对端节点编号, 握手后得知
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    bool connected;
+    string pending;             // 待写出的帧
+    pthread_t tid;
+};
+
+vector<PeerLink*> peerLinks;
+int relayListenFd = -1;
+
+// 入站链路: 节点编号 -> 当前链路的 fd, 对端重连后旧链路断开时不能删掉新同步来的用户
+pthread_mutex_t inboundMutex = PTHREAD_MUTEX_INITIALIZER;
+unordered_map<int, int> inboundLinks;
+
+inline SessionId remoteSession(int node) { return makeSessionId(REMOTE_SHARD, node, 0); }
+inline bool isRemoteSession(SessionId id) { return sessionShard(id) == REMOTE_SHARD; }
+
+string relayFrame(RelayType type, string_view name, string_view payload) {
+    string frame(FRAME_HEADER_SIZE, '\0');
+    frame.push_back((char)type);
+    if (type != RELAY_BROADCAST) {
+        frame.push_back((char)name.size());
+        frame.append(name.data(), name.size());
+    }
+    frame.append(payload.data(), payload.size());
+    encodeFrameHeader(&frame[0], frame.size() - FRAME_HEADER_SIZE);
+    return frame;
+}
+
+void queueRelay(PeerLink* link, const string& frame) {
+    pthread_mutex_lock(&link->mutex);
+    if (link->connected) {
+        link->pending += frame;
+        if (link->pending.size() > RELAY_MAX_PENDING) {
+            // 丢帧会让在线用户表不一致, 不如断开, 重连时对端重新同步
+            cout << "联邦: 发往 " << link->address << " 的数据积压过多, 断开重连" << endl;
+            link->connected = false;
+        }
+        pthread_cond_signal(&link->cond);
+        countStat(STAT_RELAY_FRAMES);
+    }
+    pthread_mutex_unlock(&link->mutex);
+}
+
+void relayToAll(const string& frame) {
+    for (size_t i = 0; i < peerLinks.size(); i++) {
+        queueRelay(peerLinks[i], frame);
+    }
+}
+
+void relayToNode(int node, const string& frame) {
+    for (size_t i = 0; i < peerLinks.size(); i++) {
+        if (peerLinks[i]->node == node) {
+            queueRelay(peerLinks[i], frame);
+            return;
+        }
+    }
+}
+
+void relayPresence(RelayType type, const string& userName) {
+    if (!peerLinks.empty()) relayToAll(relayFrame(type, userName, string_view()));
+}
+
+// 本节点的全部在线用户, 链路建立后先发给对端
+string presenceSnapshot() {
+    string frames;
+    ReadSection section(nameReaders);
+    for (int i = 0; i < DIRECTORY_STRIPES; i++) {
+        const NameTable* names = nameDirectory[i].names.load(memory_order_seq_cst);
+        for (auto& entry : *names) {
+            if (!isRemoteSession(entry.second)) frames += relayFrame(RELAY_JOIN, entry.first, string_view());
+        }
+    }
+    return frames;
+}
+
+// 本节点的用户被其他节点抢先占用了名字, 通知后断开; epoll 模式交给会话所在的分片处理
+void kickSession(SessionId target, const string& userName) {
+    BufferRef notice = makeBuffer("用户名 " + userName + " 已在其他节点上登录, 连接已关闭");
+    if (sessionShard(target) == THREAD_SHARD) {
+        int fd = sessionSlot(target);
+        ReadSection section(threadClientReaders);
+        const ThreadClientTable* clients = threadClients.load(memory_order_seq_cst);
+        auto it = clients->find(fd);
+        if (it != clients->end() && it->second == target) {
+            sendToClient(fd, notice);
+            shutdown(fd, SHUT_RDWR);
+        }
+        return;
+    }
+    MailItem* item = new MailItem();
+    item->kind = MAIL_KICK;
+    item->target = target;
+    item->payload = notice;
+    postMail(reactors[sessionShard(target)], item);
+}
+
+// 其他节点上线了一个用户. 两个节点同时接受了同一个名字时编号小的节点胜出,
+// 各节点按同样的规则裁决, 输掉的一方踢掉自己的用户, 不需要额外的协商
+void adoptRemoteName(const string& userName, int node) {
+    SessionId remote = remoteSession(node);
+    SessionId kicked = INVALID_SESSION;
+    DirectoryStripe& stripe = stripeFor(userName);
+    pthread_mutex_lock(&stripe.mutex);
+    const NameTable* current = stripe.names.load(memory_order_relaxed);
+    auto it = current->find(userName);
+    bool replace = it == current->end();
+    if (!replace && it->second != remote) {
+        int owner = isRemoteSession(it->second) ? (int)sessionSlot(it->second) : nodeId;
+        if (node < owner) {
+            if (owner == nodeId) kicked = it->second;
+            replace = true;
+        }
+    }
+    if (!replace) {
+        pthread_mutex_unlock(&stripe.mutex);
+        return;
+    }
+    NameTable* next = new NameTable(*current);
+    (*next)[userName] = remote;
+    const NameTable* old = publishNames(stripe, next);
+    pthread_mutex_unlock(&stripe.mutex);
+    deferSnapshot(nameReaders, old);
+    if (kicked != INVALID_SESSION) {
+        countStat(STAT_LOGOUTS);
+        cout << "[" << cachedTimeStamp() << "]  用户名 " << userName << " 与节点 " << node << " 冲突, 断开本节点的用户" << endl;
+        kickSession(kicked, userName);
+    }
+}
+
+// 对端节点下线, 它的用户全部移出名字表
+void dropNodeNames(int node) {
+    SessionId remote = remoteSession(node);
+    for (int i = 0; i < DIRECTORY_STRIPES; i++) {
+        DirectoryStripe& stripe = nameDirectory[i];
+        pthread_mutex_lock(&stripe.mutex);
+        const NameTable* current = stripe.names.load(memory_order_relaxed);
+        NameTable* next = new NameTable();
+        for (auto& entry : *current) {
+            if (entry.second != remote) next->insert(entry);
+        }
+        if (next->size() == current->size()) {
+            pthread_mutex_unlock(&stripe.mutex);
+            delete next;
+            continue;
+        }
+        const NameTable* old = publishNames(stripe, next);
+        pthread_mutex_unlock(&stripe.mutex);
+        deferSnapshot(nameReaders, old);
+    }
+}
+
+void handleRelayFrame(int node, string_view frame) {
+    countStat(STAT_RELAY_RECEIVED);
+    uint8_t type = frame[0];
+    string_view body = frame.substr(1);
+    if (type == RELAY_BROADCAST) {
+        broadcastOnNode(makeBuffer(body.data(), body.size()), -1);
+        return;
+    }
+    size_t nameLen = body.empty() ? 0 : (unsigned char)body[0];
+    if (body.size() < 1 + nameLen) return;
+    string name(body.substr(1, nameLen));
+    string_view payload = body.substr(1 + nameLen);
+    if (type == RELAY_JOIN) {
+        adoptRemoteName(name, node);
+    } else if (type == RELAY_LEAVE) {
+        releaseName(name, remoteSession(node));
+    } else if (type == RELAY_ROOM) {
+        // 本节点的房间数已满时收不到这个房间的消息
+        RoomEntry* room = isValidRoomName(name) ? findOrCreateRoom(name, reactors.size()) : nullptr;
+        if (room != nullptr) publishOnNode(room, makeBuffer(payload.data(), payload.size()), -1);
+    } else if (type == RELAY_PRIVATE) {
+        SessionId target = lookupName(name);
+        if (target != INVALID_SESSION && !isRemoteSession(target)) {
+            deliverTo(target, makeBuffer(payload.data(), payload.size()));
+        }
+    }
+}
+
+bool sendRelay(int fd, const string& data) {
+    size_t sent = 0;
+    while (sent < data.size()) {
+        ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        sent += n;
+    }
+    return true;
+}
+
+// 连接对端并交换节点编号, 返回 fd, 失败返回 -1
+int connectPeer(PeerLink* link) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) return -1;
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    struct timeval timeout = {RELAY_HELLO_MS / 1000, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    char reply[FRAME_HEADER_SIZE + 16];
+    if (connect(fd, (struct sockaddr*)&link->addr, sizeof(link->addr)) == -1
+        || !sendRelay(fd, relayFrame(RELAY_HELLO, to_string(nodeId), string_view()))
+        || recv(fd, reply, FRAME_HEADER_SIZE, MSG_WAITALL) != FRAME_HEADER_SIZE) {
+        close(fd);
+        return -1;
+    }
+    uint32_t len = decodeFrameHeader(reply);
+    if (len < 2 || len > sizeof(reply) - FRAME_HEADER_SIZE
+        || recv(fd, reply + FRAME_HEADER_SIZE, len, MSG_WAITALL) != (ssize_t)len || reply[FRAME_HEADER_SIZE] != RELAY_HELLO) {
+        close(fd);
+        return -1;
+    }
+    link->node = atoi(string(reply + FRAME_HEADER_SIZE + 2, len - 2).c_str());
+    return fd;
+}
+
+void* peerSenderLoop(void* arg) {
+    PeerLink* link = (PeerLink*)arg;
+    while (serverRunning) {
+        int fd = connectPeer(link);
+        if (fd == -1) {
+            usleep(RELAY_RETRY_MS * 1000);
+            continue;
+        }
+        pthread_mutex_lock(&link->mutex);
+        link->connected = true;
+        link->pending.clear();
+        pthread_mutex_unlock(&link->mutex);
+        cout << "联邦: 已连接节点 " << link->node << " (" << link->address << ")" << endl;
+
+        // 先同步本节点的在线用户, 之后的变化都排在它后面; 与快照重复的 JOIN 在对端没有影响
+        string batch = presenceSnapshot();
+        while (sendRelay(fd, batch)) {
+            countStat(STAT_RELAY_BATCHES);
+            batch.clear();
+            pthread_mutex_lock(&link->mutex);
+            while (link->connected && link->pending.empty()) {
+                pthread_cond_wait(&link->cond, &link->mutex);
+            }
+            bool connected = link->connected;
+            batch.swap(link->pending);
+            pthread_mutex_unlock(&link->mutex);
+            if (!connected) break;
+        }
+        pthread_mutex_lock(&link->mutex);
+        link->connected = false;
+        link->pending.clear();
+        pthread_mutex_unlock(&link->mutex);
+        close(fd);
+        cout << "联邦: 与节点 " << link->node << " 的链路断开, 稍后重连" << endl;
+        usleep(RELAY_RETRY_MS * 1000);
+    }
+    return nullptr;
+}
+
+// 一条入站链路: 第一帧是对端的节点编号, 之后的帧逐条处理
+void* peerReceiverLoop(void* arg) {
+    int fd = (int)(intptr_t)arg;
+    int node = 0;
+    vector<char> buf(1 << 16);
+    size_t start = 0, end = 0;
+    while (true) {
+        if (buf.size() - end < (size_t)FRAME_HEADER_SIZE + 1) {
+            memmove(buf.data(), buf.data() + start, end - start);
+            end -= start;
+            start = 0;
+        }
+        ssize_t n = recv(fd, buf.data() + end, buf.size() - end, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        end += n;
+
+        bool valid = true;
+        while (end - start >= (size_t)FRAME_HEADER_SIZE) {
+            uint32_t len = decodeFrameHeader(buf.data() + start);
+            if (len == 0 || len > RELAY_MAX_FRAME) {
+                valid = false;
+                break;
+            }
+            if (end - start < FRAME_HEADER_SIZE + len) {
+                // 大帧一次扩到整帧
+                if (buf.size() - start < FRAME_HEADER_SIZE + len) buf.resize(start + FRAME_HEADER_SIZE + len);
+                break;
+            }
+            string_view frame(buf.data() + start + FRAME_HEADER_SIZE, len);
+            start += FRAME_HEADER_SIZE + len;
+            if (node != 0) {
+                handleRelayFrame(node, frame);
+                continue;
+            }
+            node = frame[0] == RELAY_HELLO && frame.size() > 2 ? atoi(string(frame.substr(2)).c_str()) : 0;
+            if (node <= 0 || node == nodeId || !sendRelay(fd, relayFrame(RELAY_HELLO, to_string(nodeId), string_view()))) {
+                valid = false;
+                break;
+            }
+            pthread_mutex_lock(&inboundMutex);
+            auto it = inboundLinks.find(node);
+            if (it != inboundLinks.end()) shutdown(it->second, SHUT_RDWR);
+            inboundLinks[node] = fd;
+            pthread_mutex_unlock(&inboundMutex);
+        }
+        if (!valid) break;
+        if (start == end) start = end = 0;
+    }
+
+    if (node > 0) {
+        pthread_mutex_lock(&inboundMutex);
+        auto it = inboundLinks.find(node);
+        bool current = it != inboundLinks.end() && it->second == fd;
+        if (current) inboundLinks.erase(it);
+        pthread_mutex_unlock(&inboundMutex);
+        if (current) {
+            dropNodeNames(node);
+            cout << "联邦: 节点 " << node << " 下线, 移除它的在线用户" << endl;
+        }
+    }
+    close(fd);
+    return nullptr;
+}
+
+void* relayAcceptLoop(void*) {
+    while (serverRunning) {
+        int fd = accept4(relayListenFd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            break;
+        }
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        pthread_t tid;
+        if (pthread_create(&tid, nullptr, peerReceiverLoop, (void*)(intptr_t)fd) != 0) {
+            close(fd);
+            continue;
+        }
+        pthread_detach(tid);
+    }
+    return nullptr;
+}
+
+bool resolvePeer(const string& address, struct sockaddr_in& addr) {
+    size_t colon = address.rfind(':');
+    if (colon == string::npos) return false;
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo* result = nullptr;
+    if (getaddrinfo(address.substr(0, colon).c_str(), address.substr(colon + 1).c_str(), &hints, &result) != 0) return false;
+    memcpy(&addr, result->ai_addr, sizeof(addr));
+    freeaddrinfo(result);
+    return true;
+}
+
+// 监听中继端口并为每个对端启动发送线程; 必须在 reactor 创建之后调用
+bool startFederation() {
+    if (relayPort == 0) return true;
+    relayListenFd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int optval = 1;
+    setsockopt(relayListenFd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+    struct sockaddr_in addr = serverAddr;
+    addr.sin_port = htons(relayPort);
+    if (bind(relayListenFd, (struct sockaddr*)&addr, sizeof(addr)) == -1 || listen(relayListenFd, BACKLOG) == -1) {
+        cout << "中继端口 " << relayPort << " 监听失败" << endl;
+        return false;
+    }
+    for (size_t i = 0; i < peerAddrs.size(); i++) {
+        PeerLink* link = new PeerLink();
+        link->address = peerAddrs[i];
+        link->node = 0;
+        link->connected = false;
+        if (!resolvePeer(link->address, link->addr)) {
+            cout << "无法解析节点地址 " << link->address << endl;
+            return false;
+        }
+        pthread_mutex_init(&link->mutex, nullptr);
+        pthread_cond_init(&link->cond, nullptr);
+        peerLinks.push_back(link);
+    }
+    pthread_t tid;
+    pthread_create(&tid, nullptr, relayAcceptLoop, nullptr);
+    pthread_detach(tid);
+    for (size_t i = 0; i < peerLinks.size(); i++) {
+        pthread_create(&peerLinks[i]->tid, nullptr, peerSenderLoop, peerLinks[i]);
+        pthread_detach(peerLinks[i]->tid);
+    }
+    cout << "联邦: 节点 " << nodeId << ", 中继端口 " << relayPort << ", 对端 " << peerLinks.size() << " 个" << endl;
+    return true;
+}
+
+size_t connectedPeers() {
+    size_t count = 0;
+    for (size_t i = 0; i < peerLinks.size(); i++) {
+        pthread_mutex_lock(&peerLinks[i]->mutex);
+        if (peerLinks[i]->connected) count++;
+        pthread_mutex_unlock(&peerLinks[i]->mutex);
+    }
+    return count;
+}
+
+// 发给所有用户: 本节点直接投递, 再转发给其他节点
+void broadcastMessage(const BufferRef& message, int senderSocket) {
+    broadcastOnNode(message, senderSocket);
+    if (!peerLinks.empty()) relayToAll(relayFrame(RELAY_BROADCAST, string_view(), string_view(message.payload(), message.payloadSize())));
+}
+
+void broadcastMessage(const string& message, int senderSocket) {
+    broadcastMessage(makeBuffer(message), senderSocket);
+}
+
+void publishToRoom(RoomEntry* room, const BufferRef& message, int senderSocket) {
+    publishOnNode(room, message, senderSocket);
+    if (!peerLinks.empty()) relayToAll(relayFrame(RELAY_ROOM, room->name, string_view(message.payload(), message.payloadSize())));
+}
+
+void sendPrivateMessage(int clientSocket, const string& targetUser, string_view privateMessage, const string& sender) {
+    SessionId target = lookupName(targetUser);
+    while (target == INVALID_SESSION) {
+        if (mailboxBytes == 0 || targetUser.empty() || targetUser.size() > (size_t)MAX_NAME_LEN) {
+            string errorMsg = "用户 " + targetUser + " 不在线或不存在";
+            sendToClient(clientSocket, errorMsg);
+            return;
+        }
+        BufferRef offline = MessageFormatter().timestamp().add("私聊 (").add(sender).add("): ").add(privateMessage).buffer();
+        MailboxResult result = storeOfflineMessage(targetUser, sender, offline);
+        if (result == MAILBOX_UNKNOWN) {
+            sendToClient(clientSocket, MessageFormatter().add("用户 ").add(targetUser).add(" 不在线或不存在").buffer());
+            return;
+        }
+        if (result == MAILBOX_QUOTA) {
+            sendToClient(clientSocket, MessageFormatter().add("你存入离线信箱的私聊已达 ").add(MAILBOX_SENDER_BYTES >> 10)
+                                       .add(" KiB 上限, 对方登录取走后才能继续存").buffer());
+            return;
+        }
+        if (result == MAILBOX_FULL) {
+            sendToClient(clientSocket, MessageFormatter().add("用户 ").add(targetUser).add(" 不在线, 离线信箱已满, 消息未保存").buffer());
+            return;
+        }
+        if (result == MAILBOX_STORED) {
+            appendChatLog(LOG_PRIVATE, targetUser, sender, privateMessage);
+            sendToClient(clientSocket, MessageFormatter().add("用户 ").add(targetUser).add(" 不在线, 消息已存入离线信箱, 对方登录后送达").buffer());
+            return;
+        }
+        // 对方刚好登录, 改为直接发送
+        target = lookupName(targetUser);
+    }
+    BufferRef message = MessageFormatter().add("私聊 (").add(sender).add("): ").add(privateMessage).buffer();
+    Connection* conn = connectionFor(clientSocket);
+    if (conn != nullptr) attachBinary(message, conn->userId, sender, OP_PRIVATE, string_view(), privateMessage);
+    if (isRemoteSession(target)) {
+        relayToNode(sessionSlot(target), relayFrame(RELAY_PRIVATE, targetUser, string_view(message.payload(), message.payloadSize())));
+    } else {
+        deliverTo(target, message);
+    }
+    appendChatLog(LOG_PRIVATE, targetUser, sender, privateMessage);
+    sendToClient(clientSocket, MessageFormatter().add("消息已发送给 ").add(targetUser).buffer());
+}
+
+// 登记新用户, 用户名重复时返回 false
+bool registerUser(int clientSocket, SessionId sessionId, const string& userName) {
+    //防止重复用户名
+    if (!claimName(userName, sessionId)) {
+        return false;
+    }
+    relayPresence(RELAY_JOIN, userName);
+    if (sessionShard(sessionId) == THREAD_SHARD) {
+        pthread_mutex_lock(&clientsMutex);
+        const ThreadClientTable* current = threadClients.load(memory_order_relaxed);
+        ThreadClientTable* next = new ThreadClientTable(*current);
+        (*next)[clientSocket] = sessionId;
+        threadClients.store(next, memory_order_seq_cst);
+        pthread_mutex_unlock(&clientsMutex);
+        deferSnapshot(threadClientReaders, current);
+    }
+
+    moveToRoom(clientSocket, findOrCreateRoom(LOBBY_ROOM, reactors.size()));
+
+    broadcastMessage(MessageFormatter().timestamp().add("欢迎").add(userName).add("加入了聊天").buffer(), clientSocket);
+    cout << "[" << cachedTimeStamp() << "]  用户 " << userName << " 已经连接到服务器" << endl;
+    countStat(STAT_LOGINS);
+
+    Connection* conn = connectionFor(clientSocket);
+    BufferRef offline = takeOfflineMessages(userName, conn != nullptr ? conn->protocol : fdProtocol[clientSocket]);
+    if (offline) {
+        sendToClient(clientSocket, offline);
+        cout << "[" << cachedTimeStamp() << "]  向用户 " << userName << " 投递了离线私聊" << endl;
+    }
+    return true;
+}
+
+void unregisterUser(int clientSocket, SessionId sessionId, const string& userName) {
+    if (releaseName(userName, sessionId)) {
+        countStat(STAT_LOGOUTS);
+        relayPresence(RELAY_LEAVE, userName);
+    }
+    moveToRoom(clientSocket, nullptr);
+    if (sessionShard(sessionId) == THREAD_SHARD) {
+        pthread_mutex_lock(&clientsMutex);
+        const ThreadClientTable* current = threadClients.load(memory_order_relaxed);
+        ThreadClientTable* next = new ThreadClientTable(*current);
+        next->erase(clientSocket);
+        threadClients.store(next, memory_order_seq_cst);
+        pthread_mutex_unlock(&clientsMutex);
+        // 等正在向这个 fd 发送的读者离开, 调用方随后才能关闭它
+        retireSnapshot(threadClientReaders, current);
+    }
+}
+
+// 离开当前房间并进入 roomName, 两边的其他成员都会收到通知
+void switchRoom(int clientSocket, const string& userName, const string& roomName) {
+    RoomEntry* oldRoom = currentRoom(clientSocket);
+    if (oldRoom != nullptr && oldRoom->name == roomName) {
+        sendToClient(clientSocket, "你已经在房间 " + roomName + " 中");
+        return;
+    }
+    RoomEntry* room = findOrCreateRoom(roomName, reactors.size());
+    if (room == nullptr) {
+        sendToClient(clientSocket, MessageFormatter().add("房间数已达上限 ").add(MAX_ROOMS).add(", 无法创建房间 ").add(roomName).buffer());
+        return;
+    }
+    moveToRoom(clientSocket, room);
+    if (oldRoom != nullptr) {
+        publishToRoom(oldRoom, MessageFormatter().timestamp().add(userName).add(" 离开了房间 ").add(oldRoom->name).buffer(), clientSocket);
+    }
+    publishToRoom(room, MessageFormatter().timestamp().add(userName).add(" 进入了房间 ").add(roomName).buffer(), clientSocket);
+    uint64_t members = room->memberCount.load(memory_order_relaxed);
+    sendToClient(clientSocket, MessageFormatter().add("已进入房间 ").add(roomName).add(", 当前 ").add(members).add(" 人").buffer());
+    cout << "[" << cachedTimeStamp() << "]  用户 " << userName << " 进入房间 " << roomName << endl;
+}
+
+void sendUserList(int clientSocket, const string& userName) {
+    vector<string> userNames;
+    listNames(userNames);
+    int userCount = userNames.size();
+    string onlineUsers = "在线用户人数: " + to_string(userCount) + "\n";
+    for (size_t i = 0; i < userNames.size(); ++i) {
+        onlineUsers += to_string(i + 1) + ". " + userNames[i] + "\n";
+    }
+    sendToClient(clientSocket, onlineUsers);
+    cout << "[" << cachedTimeStamp() << "]  用户 " << userName << " 请求用户列表" << endl;
+}
+
+void joinRoom(int clientSocket, const string& userName, const string& roomName) {
+    if (isValidRoomName(roomName)) {
+        switchRoom(clientSocket, userName, roomName);
+    } else {
+        string errorMsg = "无效的房间名，使用 /join 房间名 (不含空格, 最多 " + to_string(MAX_NAME_LEN) + " 字节)";
+        sendToClient(clientSocket, errorMsg);
+    }
+}
+
+void sendRoomList(int clientSocket) {
+    vector<pair<string, int>> rooms;
+    listRooms(rooms);
+    string roomList = "房间数: " + to_string(rooms.size()) + "\n";
+    for (size_t i = 0; i < rooms.size(); ++i) {
+        roomList += to_string(i + 1) + ". " + rooms[i].first + " (" + to_string(rooms[i].second) + " 人)\n";
+    }
+    sendToClient(clientSocket, roomList);
+}
+
+void quitSession(int clientSocket, SessionId sessionId, const string& userName) {
+    // 主动退出的会话不再保留等待续传
+    Connection* conn = connectionFor(clientSocket);
+    if (conn != nullptr) conn->resumable = false;
+    unregisterUser(clientSocket, sessionId, userName);
+    broadcastMessage(MessageFormatter().timestamp().add(userName).add(" 离开了聊天").buffer(), -1);
+    cout << "[" << cachedTimeStamp() << "]  用户 " << userName << " 退出" << endl;
+}
+
+// 普通消息只发给当前房间, 大厅里的消息格式与原来一致
+void publishChat(int clientSocket, const string& userName, string_view message) {
+    RoomEntry* room = currentRoom(clientSocket);
+    if (room == nullptr) return;
+    BufferRef chatMsg = formatRoomMessage(room->name, userName, message);
+    Connection* conn = connectionFor(clientSocket);
+    if (conn != nullptr) {
+        attachBinary(chatMsg, conn->userId, userName, OP_CHAT, room->name != LOBBY_ROOM ? room->name : string(), message);
+    }
+    cout << "[" << cachedTimeStamp() << "]  ";
+    if (room->name != LOBBY_ROOM) cout << "[" << room->name << "] ";
+    cout << "(" << userName << "): " << message << endl;
+    publishToRoom(room, chatMsg, clientSocket);
+    appendChatLog(LOG_PUBLIC, room->name, userName, message);
+    indexMessage(room->name, userName, message, (uint64_t)time(0));
+}
+
+void beginUpload(int clientSocket, const string& userName, string_view args);
+void receiveUpload(int clientSocket, string_view message);
+
+// 处理一条客户端消息, message 直接指向接收缓冲区; 返回 false 表示客户端请求退出
+bool processMessage(int clientSocket, SessionId sessionId, const string& userName, string_view message) {
+    if (message.empty()) return true;
+    countStat(STAT_MSGS_IN);
+
+    if (message[0] == '@') {
+        size_t spacePos = message.find(' ');
+        if (spacePos != string_view::npos) {
+            string targetUser(message.substr(1, spacePos - 1));           // 提取目标用户名
+            string_view privateMessage = message.substr(spacePos + 1);    // 提取私聊内容
+            sendPrivateMessage(clientSocket, targetUser, privateMessage, userName);
+        } else {
+            string errorMsg = "无效的私聊格式，使用 @用户名 消息";
+            sendToClient(clientSocket, errorMsg);
+        }
+    }
+    else if (message == "list") {
+        sendUserList(clientSocket, userName);
+    }
+    else if (message.substr(0, 6) == "/join ") {
+        joinRoom(clientSocket, userName, string(message.substr(6)));
+    }
+    else if (message == "/leave") {
+        switchRoom(clientSocket, userName, LOBBY_ROOM);
+    }
+    else if (message == "/rooms") {
+        sendRoomList(clientSocket);
+    }
+    else if (message.substr(0, 6) == "/send ") {
+        beginUpload(clientSocket, userName, message.substr(6));
+    }
+    else if (message == "/search" || message.substr(0, 8) == "/search ") {
+        sendToClient(clientSocket, runSearch(message.substr(min(message.size(), (size_t)8))));
+    }
+    else if (message == "quit") {
+        quitSession(clientSocket, sessionId, userName);
+        return false;
+    }
+    else {
+        publishChat(clientSocket, userName, message);
+    }
+    return true;
+}
+
+// 二进制协议按操作码分派, 正文不再需要猜测是不是命令
+bool processBinaryMessage(int clientSocket, SessionId sessionId, const string& userName, string_view frame) {
+    // 心跳应答只需要收到, 收包时已经记下了活动时间
+    if (frame.empty() || (uint8_t)frame[0] == OP_PONG) return true;
+    countStat(STAT_MSGS_IN);
+
+    uint8_t op = frame[0];
+    string_view body = frame.substr(1);
+    if (op == OP_SAY) {
+        if (!body.empty()) publishChat(clientSocket, userName, body);
+    } else if (op == OP_WHISPER) {
+        size_t nameLen = body.empty() ? 0 : (unsigned char)body[0];
+        if (nameLen == 0 || body.size() < 1 + nameLen) {
+            sendToClient(clientSocket, string("无效的私聊格式"));
+            return true;
+        }
+        sendPrivateMessage(clientSocket, string(body.substr(1, nameLen)), body.substr(1 + nameLen), userName);
+    } else if (op == OP_LIST) {
+        sendUserList(clientSocket, userName);
+    } else if (op == OP_JOIN) {
+        joinRoom(clientSocket, userName, string(body));
+    } else if (op == OP_LEAVE) {
+        switchRoom(clientSocket, userName, LOBBY_ROOM);
+    } else if (op == OP_ROOMS) {
+        sendRoomList(clientSocket);
+    } else if (op == OP_SEARCH) {
+        sendToClient(clientSocket, runSearch(body));
+    } else if (op == OP_QUIT) {
+        quitSession(clientSocket, sessionId, userName);
+        return false;
+    } else {
+        sendToClient(clientSocket, "未知的操作码 " + to_string(op));
+    }
+    return true;
+}
+
+enum RateVerdict { RATE_PASS, RATE_DROP, RATE_WAIT, RATE_CLOSE };
+
+RateVerdict checkRate(int clientSocket, const string& userName, TokenBucket& bucket, size_t len) {
+    uint64_t waitNs;
+    if (takeTokens(bucket, len, waitNs)) {
+        bucket.warned = false;
+        return RATE_PASS;
+    }
+    bucket.limited++;
+    if (ratePolicy == RATE_DELAY) {
+        countStat(STAT_RATE_DELAYED);
+        bucket.delayUntil = monotonicNs() + waitNs;
+        return RATE_WAIT;
+    }
+    if (ratePolicy == RATE_DISCONNECT) {
+        countStat(STAT_RATE_DISCONNECTS);
+        // 因限速断开的会话不保留续传
+        Connection* conn = connectionFor(clientSocket);
+        if (conn != nullptr) conn->resumable = false;
+        sendToClient(clientSocket, string("发送过快，连接已关闭"));
+        cout << "用户 " << userName << " 发送过快, 断开连接" << endl;
+        return RATE_CLOSE;
+    }
+    countStat(STAT_RATE_REJECTED);
+    if (!bucket.warned) {
+        bucket.warned = true;
+        string limit;
+        if (rateMsgs > 0) limit += " " + to_string((uint64_t)rateMsgs) + " 条";
+        if (rateBytes > 0) limit += " " + to_string((uint64_t)rateBytes) + " 字节";
+        sendToClient(clientSocket, "发送过快，消息已丢弃 (每秒最多" + limit + ")");
+    }
+    return RATE_DROP;
+}
+
+// 处理解析器中所有完整的消息, 返回 false 表示连接应关闭.
+// 超过限速且策略为延迟时把消息留在解析器里, 设置 bucket.delayUntil 后返回 true
+bool dispatchMessages(int clientSocket, SessionId sessionId, const string& userName, int protocol, FrameParser& parser, TokenBucket& bucket) {
+    string_view message;
+    RateVerdict verdict;
+    if (protocol == PROTO_TEXT) {
+        // 老客户端没有分帧, 每次读到的数据当作一条消息
+        if (parser.buffered() == 0) return true;
+        message = parser.takeAll();
+        verdict = checkRate(clientSocket, userName, bucket, message.size());
+        if (verdict == RATE_WAIT) parser.unread();
+        if (verdict != RATE_PASS) return verdict != RATE_CLOSE;
+        return processMessage(clientSocket, sessionId, userName, message);
+    }
+
+    FrameStatus status;
+    while ((status = protocol == PROTO_BINARY ? parser.nextBinary(message) : parser.next(message)) == FRAME_OK) {
+        // 附件数据不是聊天消息, 不计入限速, 总量由 /send 声明的大小约束
+        if (protocol != PROTO_BINARY && !message.empty() && message[0] == CONTROL_PREFIX) {
+            receiveUpload(clientSocket, message);
+            continue;
+        }
+        verdict = checkRate(clientSocket, userName, bucket, message.size());
+        if (verdict == RATE_WAIT) {
+            parser.unread();
+            return true;
+        }
+        if (verdict == RATE_CLOSE) return false;
+        if (verdict == RATE_DROP) continue;
+        bool alive = protocol == PROTO_BINARY ? processBinaryMessage(clientSocket, sessionId, userName, message)
+                                              : processMessage(clientSocket, sessionId, userName, message);
+        if (!alive) return false;
+    }
+    if (status == FRAME_TOO_LARGE) {
+        string errorMsg = "消息过长，连接已关闭";
+        sendToClient(clientSocket, errorMsg);
+        cout << "用户 " << userName << " 发送的消息超过上限" << endl;
+        return false;
+    }
+    if (parser.buffered() == 0) parser.shrink(BUFFER_SIZE);
+    return true;
+}
+
+// 下一次 recv 预留的空间: 大消息一次预留到整帧, 避免反复扩容
+size_t recvReserve(const FrameParser& parser, int protocol) {
+    if (protocol == PROTO_TEXT) return BUFFER_SIZE;
+    if (protocol == PROTO_BINARY) return max((size_t)BUFFER_SIZE, parser.pendingBinaryBytes());
+    return max((size_t)BUFFER_SIZE, parser.pendingFrameBytes());
+}
+
+// 线程模式和线程池模式共用的登录: 解析登录块并登记用户, 失败返回 INVALID_SESSION, 由调用者关闭连接
+SessionId loginBlockingClient(int clientSocket, string_view loginBlock, string& userName, int& protocol) {
+    if (!parseLoginBlock(loginBlock.data(), loginBlock.size(), userName, protocol) || protocol > PROTO_BINARY) {
+        return INVALID_SESSION;
+    }
+    // 这两种模式不支持续传, 按普通分帧协议服务; 客户端收不到令牌, 断线后会重新登录
+    if (protocol == PROTO_RESUMABLE) protocol = PROTO_FRAMED;
+    // 二进制协议只在 epoll 模式下提供
+    if (protocol == PROTO_BINARY) {
+        cout << "当前模式不支持二进制协议, 拒绝用户 " << userName << endl;
+        return INVALID_SESSION;
+    }
+    fdProtocol[clientSocket] = protocol;
+    struct timeval sendTimeout = {THREAD_SEND_TIMEOUT_SEC, 0};
+    setsockopt(clientSocket, SOL_SOCKET, SO_SNDTIMEO, &sendTimeout, sizeof(sendTimeout));
+
+    static atomic<uint32_t> threadGeneration(0);
+    SessionId sessionId = makeSessionId(THREAD_SHARD, clientSocket, threadGeneration++);
+    if (!registerUser(clientSocket, sessionId, userName)) {
+        string errorMsg = "用户名已存在，请重试。";
+        sendToClient(clientSocket, errorMsg);
+        return INVALID_SESSION;
+    }
+    enableKeepalive(clientSocket);
+    return sessionId;
+}
+
+void* handleClient(void* arg) {
+    int clientSocket = (int)(intptr_t)arg;
+    FrameParser parser;
+    string_view loginBlock;
+    string userName;
+    int protocol = PROTO_TEXT;
+    while (!parser.take(LOGIN_BLOCK_SIZE, loginBlock)) {
+        char* space = parser.prepare(LOGIN_BLOCK_SIZE);
+        ssize_t n = recv(clientSocket, space, parser.writable(), 0);
+        if (n <= 0) {
+            close(clientSocket);
+            return nullptr;
+        }
+        parser.commit(n);
+    }
+    openBlockingOutput(clientSocket, false);
+    SessionId sessionId = loginBlockingClient(clientSocket, loginBlock, userName, protocol);
+    if (sessionId == INVALID_SESSION) {
+        closeBlockingOutput(clientSocket);
+        close(clientSocket);
+        return nullptr;  // 结束线程
+    }
+
+    TokenBucket bucket;
+    initTokenBucket(bucket);
+    while (dispatchMessages(clientSocket, sessionId, userName, protocol, parser, bucket)) {
+        // 线程模式直接睡到令牌补足, 期间不读套接字
+        if (bucket.delayUntil != 0) {
+            uint64_t now = monotonicNs();
+            if (bucket.delayUntil > now) usleep((bucket.delayUntil - now + 999) / 1000);
+            bucket.delayUntil = 0;
+            continue;
+        }
+        char* space = parser.prepare(recvReserve(parser, protocol));
+        ssize_t bytesReceived = recv(clientSocket, space, parser.writable(), 0);
+        if (bytesReceived <= 0) {
+            cout << "客户端断开连接: " << userName << endl;
+            break;
+        }
+        parser.commit(bytesReceived);
+        countStat(STAT_BYTES_IN, bytesReceived);
+    }
+    unregisterUser(clientSocket, sessionId, userName);
+    closeBlockingOutput(clientSocket);
+
+    close(clientSocket);
+
+    return nullptr;
+}
+
+// ==================== 工作线程池 ====================
+
+// 线程池模式: 轮询线程用 EPOLLONESHOT 等待连接就绪, 把就绪的连接作为任务放进工作线程的队列.
+// 同一个连接在重新登记之前不会再次就绪, 所以任何时刻只有一个工作线程在处理它, 会话状态不需要加锁.
+// 任务按 fd 固定分到一个队列, 队列的主人从队首取, 空闲的工作线程从其他队列的队尾窃取.
+// 用户表、房间和发送路径与线程模式相同, 但发送不阻塞: 发不完的消息进入每个连接的有界队列,
+// 由轮询线程在 EPOLLOUT 时继续写, 不接收的客户端占不住工作线程
+const int POOL_READS_PER_TASK = 16;     // 每个任务最多读几次, 读不完的等下一次就绪, 避免一个连接占住工作线程
+
+struct PoolSession {
+    int fd;
+    FrameParser parser;
+    bool loggedIn;
+    string userName;
+    int protocol;
+    SessionId sessionId;
+    TokenBucket bucket;
+};
+
+struct alignas(64) WorkerQueue {
+    pthread_mutex_t mutex;
+    deque<PoolSession*> tasks;
+};
+
+vector<WorkerQueue*> workerQueues;
+sem_t poolReady;                        // 计数等于所有队列中的任务数, 空闲的工作线程在上面等待
+int poolEpollFd = -1;
+int poolWakeFd = -1;                    // 限速暂停的连接到期时唤醒轮询线程
+pthread_mutex_t poolDelayMutex = PTHREAD_MUTEX_INITIALIZER;
+vector<PoolSession*> poolDelayed;       // 超过限速而暂停读取的连接, 到期后重新分派
+int poolWriteEpollFd = -1;              // 有积压的发送队列在这里等待 EPOLLOUT, 本身登记在 poolEpollFd 中
+pthread_mutex_t poolFlushMutex = PTHREAD_MUTEX_INITIALIZER;
+vector<BlockingOutput*> poolFlushRequests;  // 刚开始积压、还没登记 EPOLLOUT 的发送队列
+
+void dropPoolMessage(BlockingOutput* out, size_t index, int protocol) {
+    out->queuedBytes -= out->queue[index].wireSize(protocol);
+    out->queue.erase(out->queue.begin() + index);
+    countStat(STAT_DROPPED);
+}
+
+// 发送队列超出上限时按慢速客户端策略处理, 与 epoll 模式相同; 调用者持有 out->mutex
+void enforcePoolQueueLimits(BlockingOutput* out, int protocol) {
+    if (out->queuedBytes <= outQueueMaxBytes && out->queue.size() <= outQueueMaxMsgs) return;
+
+    size_t first = out->headOffset > 0 ? 1 : 0;
+    if (slowPolicy == SLOW_DISCONNECT) {
+        cout << "客户端 " << out->fd << " 接收过慢, 积压 " << out->queuedBytes << " 字节, 断开连接" << endl;
+        out->closed = true;
+        out->queue.clear();
+        out->queuedBytes = 0;
+        shutdown(out->fd, SHUT_RDWR);
+    } else if (slowPolicy == SLOW_DROP_OLDEST) {
+        while ((out->queuedBytes > outQueueMaxBytes || out->queue.size() > outQueueMaxMsgs) && out->queue.size() > first + 1) {
+            dropPoolMessage(out, first, protocol);
+        }
+    } else {
+        size_t skipped = 0;
+        while (out->queue.size() > first + 1) {
+            dropPoolMessage(out, first, protocol);
+            skipped++;
+        }
+        BufferRef notice = MessageFormatter().add("[系统消息]  网络过慢，已跳过 ").add(skipped).add(" 条消息").buffer();
+        out->queuedBytes += notice.wireSize(protocol);
+        out->queue.insert(out->queue.begin() + first, move(notice));
+    }
+}
+
+// 线程池模式的发送: 队列为空时直接非阻塞发送, 发不完的进入队列, 刚开始积压时请轮询线程登记 EPOLLOUT.
+// 调用者持有 out->mutex
+void queuePoolOutput(BlockingOutput* out, const BufferRef& message) {
+    if (out->closed) return;
+    int protocol = fdProtocol[out->fd];
+    size_t wireSize = message.wireSize(protocol);
+    if (out->queue.empty()) {
+        ssize_t n;
+        do {
+            n = send(out->fd, message.wireData(protocol), wireSize, MSG_NOSIGNAL | MSG_DONTWAIT);
+        } while (n < 0 && errno == EINTR);
+        if (n > 0) countStat(STAT_BYTES_OUT, n);
+        if (n == (ssize_t)wireSize) return;
+        // 连接已出错, 由工作线程读到断开后清理
+        if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) return;
+        out->headOffset = n > 0 ? n : 0;
+    }
+    out->queue.push_back(message);
+    out->queuedBytes += wireSize;
+    enforcePoolQueueLimits(out, protocol);
+    if (out->closed || out->writeArmed) return;
+
+    out->writeArmed = true;
+    out->refs.fetch_add(1, memory_order_relaxed);
+    pthread_mutex_lock(&poolFlushMutex);
+    poolFlushRequests.push_back(out);
+    pthread_mutex_unlock(&poolFlushMutex);
+    uint64_t one = 1;
+    write(poolWakeFd, &one, sizeof(one));
+}
+
+// 非阻塞地把队列写进套接字, 返回 true 表示还有剩余, 要继续等 EPOLLOUT; 调用者持有 out->mutex
+bool flushPoolOutput(BlockingOutput* out) {
+    int protocol = fdProtocol[out->fd];
+    while (!out->queue.empty()) {
+        struct iovec iov[MAX_IOV];
+        int iovcnt = 0;
+        for (size_t i = 0; i < out->queue.size() && iovcnt < MAX_IOV; i++) {
+            size_t offset = i == 0 ? out->headOffset : 0;
+            iov[iovcnt].iov_base = (void*)(out->queue[i].wireData(protocol) + offset);
+            iov[iovcnt].iov_len = out->queue[i].wireSize(protocol) - offset;
+            iovcnt++;
+        }
+        struct msghdr msg = {};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+        ssize_t n = sendmsg(out->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return true;
+            out->queue.clear();
+            out->queuedBytes = 0;
+            return false;
+        }
+        countStat(STAT_BYTES_OUT, n);
+        size_t written = n;
+        while (written > 0) {
+            size_t size = out->queue.front().wireSize(protocol);
+            size_t remain = size - out->headOffset;
+            if (written < remain) {
+                out->headOffset += written;
+                break;
+            }
+            written -= remain;
+            out->queuedBytes -= size;
+            out->queue.pop_front();
+            out->headOffset = 0;
+        }
+    }
+    return false;
+}
+
+// 轮询线程: 为新积压的队列登记 EPOLLOUT. 登记之后连接才关闭的, 关闭时的 shutdown 会触发事件
+void armPoolFlushes() {
+    vector<BlockingOutput*> requests;
+    pthread_mutex_lock(&poolFlushMutex);
+    requests.swap(poolFlushRequests);
+    pthread_mutex_unlock(&poolFlushMutex);
+    for (BlockingOutput* out : requests) {
+        struct epoll_event ev;
+        ev.events = EPOLLOUT | EPOLLONESHOT;
+        ev.data.ptr = out;
+        if (epoll_ctl(poolWriteEpollFd, EPOLL_CTL_ADD, out->fd, &ev) == 0) continue;
+        pthread_mutex_lock(&out->mutex);
+        out->writeArmed = false;
+        pthread_mutex_unlock(&out->mutex);
+        releaseBlockingOutput(out);
+    }
+}
+
+// 轮询线程: 继续写可写的队列, 写空或连接已关闭时撤销登记并放手
+void servePoolFlushes() {
+    struct epoll_event events[MAX_EVENTS];
+    int n = epoll_wait(poolWriteEpollFd, events, MAX_EVENTS, 0);
+    for (int i = 0; i < n; i++) {
+        BlockingOutput* out = (BlockingOutput*)events[i].data.ptr;
+        pthread_mutex_lock(&out->mutex);
+        bool more = !out->closed && flushPoolOutput(out);
+        if (!more) out->writeArmed = false;
+        pthread_mutex_unlock(&out->mutex);
+        if (more) {
+            epoll_ctl(poolWriteEpollFd, EPOLL_CTL_MOD, out->fd, &events[i]);
+            continue;
+        }
+        epoll_ctl(poolWriteEpollFd, EPOLL_CTL_DEL, out->fd, nullptr);
+        releaseBlockingOutput(out);
+    }
+}
+
+void dispatchPoolTask(PoolSession* session) {
+    WorkerQueue* queue = workerQueues[session->fd % workerQueues.size()];
+    pthread_mutex_lock(&queue->mutex);
+    queue->tasks.push_back(session);
+    pthread_mutex_unlock(&queue->mutex);
+    sem_post(&poolReady);
+}
+
+// 先看自己的队列, 再依次窃取其他队列; sem_wait 成功保证至少还有一个任务没被取走
+PoolSession* takePoolTask(int worker) {
+    int count = workerQueues.size();
+    for (int k = 0; ; k = (k + 1) % count) {
+        WorkerQueue* queue = workerQueues[(worker + k) % count];
+        pthread_mutex_lock(&queue->mutex);
+        if (queue->tasks.empty()) {
+            pthread_mutex_unlock(&queue->mutex);
+            continue;
+        }
+        PoolSession* session;
+        if (k == 0) {
+            session = queue->tasks.front();
+            queue->tasks.pop_front();
+        } else {
+            session = queue->tasks.back();
+            queue->tasks.pop_back();
+            countStat(STAT_POOL_STEALS);
+        }
+        pthread_mutex_unlock(&queue->mutex);
+        return session;
+    }
+}
+
+void rearmPoolSession(PoolSession* session) {
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    ev.data.ptr = session;
+    epoll_ctl(poolEpollFd, EPOLL_CTL_MOD, session->fd, &ev);
+}
+
+void closePoolSession(PoolSession* session) {
+    if (session->loggedIn) unregisterUser(session->fd, session->sessionId, session->userName);
+    epoll_ctl(poolEpollFd, EPOLL_CTL_DEL, session->fd, nullptr);
+    // fd 由发送状态在最后一份引用释放时关闭
+    closeBlockingOutput(session->fd);
+    delete session;
+}
+
+// 处理已缓冲的数据, 返回 false 表示连接应关闭
+bool processPoolSession(PoolSession* session) {
+    if (!session->loggedIn) {
+        string_view loginBlock;
+        if (!session->parser.take(LOGIN_BLOCK_SIZE, loginBlock)) return true;
+        session->sessionId = loginBlockingClient(session->fd, loginBlock, session->userName, session->protocol);
+        if (session->sessionId == INVALID_SESSION) return false;
+        session->loggedIn = true;
+    }
+    return dispatchMessages(session->fd, session->sessionId, session->userName, session->protocol, session->parser, session->bucket);
+}
+
+void servePoolSession(PoolSession* session) {
+    if (!processPoolSession(session)) {
+        closePoolSession(session);
+        return;
+    }
+    for (int i = 0; i < POOL_READS_PER_TASK && session->bucket.delayUntil == 0; i++) {
+        size_t reserve = session->loggedIn ? recvReserve(session->parser, session->protocol) : (size_t)LOGIN_BLOCK_SIZE;
+        char* space = session->parser.prepare(reserve);
+        ssize_t n = recv(session->fd, space, session->parser.writable(), MSG_DONTWAIT);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        if (n <= 0) {
+            if (session->loggedIn) cout << "客户端断开连接: " << session->userName << endl;
+            closePoolSession(session);
+            return;
+        }
+        session->parser.commit(n);
+        countStat(STAT_BYTES_IN, n);
+        if (!processPoolSession(session)) {
+            closePoolSession(session);
+            return;
+        }
+    }
+    if (session->bucket.delayUntil != 0) {
+        // 暂停期间不重新登记, 到期后由轮询线程直接分派
+        pthread_mutex_lock(&poolDelayMutex);
+        poolDelayed.push_back(session);
+        pthread_mutex_unlock(&poolDelayMutex);
+        uint64_t one = 1;
+        write(poolWakeFd, &one, sizeof(one));
+        return;
+    }
+    rearmPoolSession(session);
+}
+
+void* poolWorkerLoop(void* arg) {
+    int worker = (int)(intptr_t)arg;
+    while (true) {
+        if (sem_wait(&poolReady) == -1) continue;
+        if (!serverRunning) break;
+        countStat(STAT_POOL_TASKS);
+        servePoolSession(takePoolTask(worker));
+    }
+    return nullptr;
+}
+
+// 把到期的暂停连接重新分派, 返回下一个到期时刻距现在的毫秒数, 没有则返回 -1
+int releasePoolDelayed() {
+    uint64_t now = monotonicNs();
+    uint64_t earliest = UINT64_MAX;
+    vector<PoolSession*> due;
+    pthread_mutex_lock(&poolDelayMutex);
+    for (size_t i = 0; i < poolDelayed.size();) {
+        PoolSession* session = poolDelayed[i];
+        if (session->bucket.delayUntil <= now) {
+            session->bucket.delayUntil = 0;
+            due.push_back(session);
+            poolDelayed[i] = poolDelayed.back();
+            poolDelayed.pop_back();
+        } else {
+            earliest = min(earliest, session->bucket.delayUntil);
+            i++;
+        }
+    }
+    pthread_mutex_unlock(&poolDelayMutex);
+    for (size_t i = 0; i < due.size(); i++) {
+        dispatchPoolTask(due[i]);
+    }
+    return earliest == UINT64_MAX ? -1 : (int)((earliest - now + 999999) / 1000000);
+}
+
+void acceptPoolConnections() {
+    while (true) {
+        int clientSocket = accept4(serverSocket, nullptr, nullptr, SOCK_CLOEXEC);
+        if (clientSocket == -1) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK && serverRunning) {
+                cout << "接受客户端连接失败" << endl;
+            }
+            return;
+        }
+        if ((size_t)clientSocket >= fdProtocol.size()) {
+            close(clientSocket);
+            continue;
+        }
+        countStat(STAT_ACCEPTS);
+        openBlockingOutput(clientSocket, true);
+        PoolSession* session = new PoolSession();
+        session->fd = clientSocket;
+        session->loggedIn = false;
+        session->protocol = PROTO_TEXT;
+        session->sessionId = INVALID_SESSION;
+        initTokenBucket(session->bucket);
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+        ev.data.ptr = session;
+        if (epoll_ctl(poolEpollFd, EPOLL_CTL_ADD, clientSocket, &ev) == -1) {
+            closeBlockingOutput(clientSocket);
+            delete session;
+        }
+    }
+}
+
+// ==================== io_uring ====================
+
+// --io uring: reactor 的收发改走 io_uring, 直接用系统调用和 mmap 操作提交/完成队列.
+// 每个分片在监听套接字上挂一个多次触发的 accept, 每个连接挂一个多次触发的 recv, 数据落进分片的
+// 缓冲区环, 拷进解析器后立即归还. 发送时连接只记入 flushList, 每轮循环为它们各准备一个 SENDMSG,
+// 与等待完成事件合并成一次 io_uring_enter: 一次广播不论有多少接收者都只需要一次系统调用
+const unsigned URING_ENTRIES = 4096;
+const unsigned URING_BUFFERS = 512;         // 缓冲区环的大小, 必须是 2 的幂
+const unsigned URING_BUFFER_SIZE = 8192;
+const uint16_t URING_BUFFER_GROUP = 0;
+
+// user_data 的低 4 位是请求类型, 中间是连接指针, 高 16 位是连接的 fd 代数.
+// 不属于连接的请求指针部分为 0
+enum UringOp { URING_IGNORE, URING_ACCEPT, URING_MAIL, URING_SHUTDOWN, URING_RECV, URING_SEND };
+const uint64_t URING_OP_MASK = 0xF;
+const uint64_t URING_PTR_MASK = 0x0000FFFFFFFFFFF0ULL;
+
+struct IoRing {
+    int fd;
+    unsigned sqEntries;
+    unsigned sqMask;
+    unsigned cqMask;
+    unsigned* sqHead;
+    unsigned* sqTail;
+    unsigned* cqHead;
+    unsigned* cqTail;
+    unsigned sqLocalTail;       // 已准备但还没有发布给内核的请求在 sqLocalTail 之前
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    struct io_uring_buf_ring* bufRing;
+    char* bufBase;
+    uint16_t bufTail;
+    void* ringPtr;
+    size_t ringLen;
+    size_t sqesLen;
+    size_t bufRingLen;
+};
+
+// 连接在 io_uring 后端的状态. 请求在内核里时连接不能释放, 关闭和移交都要等 ops 归零
+struct UringState {
+    uint16_t generation;        // 续传换 fd 时加一, 旧 fd 上残留的完成事件据此识别并丢弃
+    int ops;                    // 尚未收到最后一个完成事件的请求数
+    bool recvArmed;
+    bool sending;
+    bool queuedFlush;           // 已在 owner->flushList 中
+    bool retired;               // 已关闭或已移交, 等请求全部结束后释放
+    bool transfer;              // 释放时把 fd 交给续传会话所在的分片, 而不是关闭
+    vector<BufferRef> inFlight; // 正在发送的消息, 完成前必须持有引用
+    size_t inFlightOffset;      // inFlight 第一条消息此前已发出的字节数
+    struct iovec iov[MAX_IOV];
+    struct msghdr msg;
+};
+
+int ioUringSetup(unsigned entries, struct io_uring_params* params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+int ioUringEnter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags, void* arg, size_t argSize) {
+    return (int)syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, arg, argSize);
+}
+
+int ioUringRegister(int fd, unsigned opcode, void* arg, unsigned nrArgs) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nrArgs);
+}
+
+void destroyIoRing(IoRing* ring) {
+    if (ring->sqes != nullptr && ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqesLen);
+    if (ring->ringPtr != nullptr && ring->ringPtr != MAP_FAILED) munmap(ring->ringPtr, ring->ringLen);
+    if (ring->bufRing != nullptr && ring->bufRing != MAP_FAILED) munmap(ring->bufRing, ring->bufRingLen);
+    delete[] ring->bufBase;
+    close(ring->fd);
+    delete ring;
+}
+
+// 把编号为 bid 的缓冲区还给内核. 头文件里的 bufs 柔性数组在 C++ 下前面多出一个空结构体,
+// 偏移不是 0, 这里直接按环的起始地址计算
+void provideBuffer(IoRing* ring, uint16_t bid) {
+    struct io_uring_buf* buf = (struct io_uring_buf*)ring->bufRing + (ring->bufTail & (URING_BUFFERS - 1));
+    buf->addr = (uint64_t)(uintptr_t)(ring->bufBase + (size_t)bid * URING_BUFFER_SIZE);
+    buf->len = URING_BUFFER_SIZE;
+    buf->bid = bid;
+    ring->bufTail++;
+    __atomic_store_n(&ring->bufRing->tail, ring->bufTail, __ATOMIC_RELEASE);
+}
+
+// 建立提交/完成队列并注册缓冲区环; 内核不支持需要的特性时返回 nullptr
+IoRing* createIoRing() {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    // 只有本线程提交, 完成事件推迟到 io_uring_enter 时处理, 避免内核打断 reactor 线程
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN
+                 | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    params.cq_entries = URING_ENTRIES * 4;
+    int fd = ioUringSetup(URING_ENTRIES, &params);
+    if (fd == -1) {
+        memset(&params, 0, sizeof(params));
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = URING_ENTRIES * 4;
+        fd = ioUringSetup(URING_ENTRIES, &params);
+    }
+    if (fd == -1) return nullptr;
+
+    IoRing* ring = new IoRing();
+    ring->fd = fd;
+    unsigned required = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+    if ((params.features & required) != required) {
+        destroyIoRing(ring);
+        return nullptr;
+    }
+
+    ring->ringLen = max(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+                        params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe));
+    ring->ringPtr = mmap(nullptr, ring->ringLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    ring->sqesLen = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = (struct io_uring_sqe*)mmap(nullptr, ring->sqesLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    ring->bufRingLen = URING_BUFFERS * sizeof(struct io_uring_buf);
+    ring->bufRing = (struct io_uring_buf_ring*)mmap(nullptr, ring->bufRingLen, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->ringPtr == MAP_FAILED || ring->sqes == MAP_FAILED || ring->bufRing == MAP_FAILED) {
+        destroyIoRing(ring);
+        return nullptr;
+    }
+
+    char* base = (char*)ring->ringPtr;
+    ring->sqEntries = params.sq_entries;
+    ring->sqMask = *(unsigned*)(base + params.sq_off.ring_mask);
+    ring->sqHead = (unsigned*)(base + params.sq_off.head);
+    ring->sqTail = (unsigned*)(base + params.sq_off.tail);
+    ring->cqMask = *(unsigned*)(base + params.cq_off.ring_mask);
+    ring->cqHead = (unsigned*)(base + params.cq_off.head);
+    ring->cqTail = (unsigned*)(base + params.cq_off.tail);
+    ring->cqes = (struct io_uring_cqe*)(base + params.cq_off.cqes);
+    // 提交队列的下标数组固定为恒等映射
+    unsigned* array = (unsigned*)(base + params.sq_off.array);
+    for (unsigned i = 0; i < params.sq_entries; i++) array[i] = i;
+    ring->sqLocalTail = *ring->sqTail;
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)ring->bufRing;
+    reg.ring_entries = URING_BUFFERS;
+    reg.bgid = URING_BUFFER_GROUP;
+    if (ioUringRegister(fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+        destroyIoRing(ring);
+        return nullptr;
+    }
+    ring->bufBase = new char[(size_t)URING_BUFFERS * URING_BUFFER_SIZE];
+    ring->bufTail = 0;
+    for (unsigned i = 0; i < URING_BUFFERS; i++) provideBuffer(ring, i);
+    return ring;
+}
+
+// 发布已准备的请求, 一次 io_uring_enter 提交并等待至少 waitNr 个完成事件; timeoutMs < 0 表示不限时
+void submitRing(IoRing* ring, unsigned waitNr, int timeoutMs) {
+    __atomic_store_n(ring->sqTail, ring->sqLocalTail, __ATOMIC_RELEASE);
+    unsigned toSubmit = ring->sqLocalTail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    if (timeoutMs >= 0) {
+        ts.tv_sec = timeoutMs / 1000;
+        ts.tv_nsec = (long long)(timeoutMs % 1000) * 1000000;
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+    }
+    // 推迟处理的完成事件只在带 GETEVENTS 的调用中产生, 不等待时也要带上
+    ioUringEnter(ring->fd, toSubmit, waitNr, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    countStat(STAT_URING_ENTERS);
+}
+
+// 取一个空闲的提交项, 提交队列满时先把已准备的提交掉
+struct io_uring_sqe* getSqe(IoRing* ring) {
+    while (ring->sqLocalTail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE) >= ring->sqEntries) {
+        submitRing(ring, 0, 0);
+    }
+    struct io_uring_sqe* sqe = &ring->sqes[ring->sqLocalTail & ring->sqMask];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sqLocalTail++;
+    countStat(STAT_URING_SQES);
+    return sqe;
+}
+
+inline uint64_t uringTag(Connection* conn, UringOp op) {
+    return ((uint64_t)conn->uring->generation << 48) | (uint64_t)(uintptr_t)conn | op;
+}
+
+// 多次触发的 POLL_ADD, 用于邮箱和退出通知的 eventfd
+void uringArmPoll(IoRing* ring, int fd, UringOp op) {
+    struct io_uring_sqe* sqe = getSqe(ring);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = op;
+}
+
+void uringArmAccept(IoRing* ring, int listenFd) {
+    struct io_uring_sqe* sqe = getSqe(ring);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listenFd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = URING_ACCEPT;
+}
+
+// 多次触发的 recv, 每次完成时由内核从缓冲区环中挑一块缓冲区
+void uringArmRecv(Connection* conn) {
+    struct io_uring_sqe* sqe = getSqe(conn->owner->ring);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->user_data = uringTag(conn, URING_RECV);
+    conn->uring->recvArmed = true;
+    conn->uring->ops++;
+}
+
+void uringCancel(Connection* conn, UringOp op) {
+    struct io_uring_sqe* sqe = getSqe(conn->owner->ring);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = uringTag(conn, op);
+    sqe->user_data = URING_IGNORE;
+}
+
+void markFlush(Connection* conn) {
+    if (conn->uring->queuedFlush) return;
+    conn->uring->queuedFlush = true;
+    conn->owner->flushList.push_back(conn);
+}
+
+void unmarkFlush(Connection* conn) {
+    if (!conn->uring->queuedFlush) return;
+    vector<Connection*>& list = conn->owner->flushList;
+    list.erase(find(list.begin(), list.end(), conn));
+    conn->uring->queuedFlush = false;
+}
+
+// 把发送队列前面的消息移入 inFlight, 合并成一个 SENDMSG 请求; 它们不再计入队列, 慢速客户端策略不会动到
+void uringSubmitSend(Connection* conn) {
+    UringState* u = conn->uring;
+    int iovcnt = 0;
+    u->inFlightOffset = conn->outHeadOffset;
+    while (!conn->outQueue.empty() && iovcnt < MAX_IOV) {
+        BufferRef& message = conn->outQueue.front();
+        size_t offset = iovcnt == 0 ? conn->outHeadOffset : 0;
+        u->iov[iovcnt].iov_base = (void*)(message.wireData(conn->protocol) + offset);
+        u->iov[iovcnt].iov_len = message.wireSize(conn->protocol) - offset;
+        conn->outQueuedBytes -= message.wireSize(conn->protocol);
+        u->inFlight.push_back(move(message));
+        conn->outQueue.pop_front();
+        iovcnt++;
+    }
+    conn->outHeadOffset = 0;
+
+    memset(&u->msg, 0, sizeof(u->msg));
+    u->msg.msg_iov = u->iov;
+    u->msg.msg_iovlen = iovcnt;
+    struct io_uring_sqe* sqe = getSqe(conn->owner->ring);
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = conn->fd;
+    sqe->addr = (uint64_t)(uintptr_t)&u->msg;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = uringTag(conn, URING_SEND);
+    u->sending = true;
+    u->ops++;
+}
+
+// 本轮积累了输出的连接各提交一个发送请求, 随后与等待合并成一次 io_uring_enter
+void uringFlushPending(Reactor* r) {
+    for (size_t i = 0; i < r->flushList.size(); i++) {
+        Connection* conn = r->flushList[i];
+        conn->uring->queuedFlush = false;
+        if (conn->closing || conn->detached || conn->uring->sending || conn->outQueue.empty()) continue;
+        uringSubmitSend(conn);
+    }
+    r->flushList.clear();
+}
+
+// 取消连接上的收发请求, 它们的最后一个完成事件仍会到达
+void uringCancelAll(Connection* conn) {
+    if (conn->uring->recvArmed) uringCancel(conn, URING_RECV);
+    if (conn->uring->sending) uringCancel(conn, URING_SEND);
+    unmarkFlush(conn);
+}
+
+// 把请求续传的新连接连同它登录块之后已收到的数据交给会话所在的分片
+void postResumeMail(Connection* conn) {
+    string_view pending = conn->parser.peekAll();
+    MailItem* item = new MailItem();
+    item->kind = MAIL_RESUME;
+    item->target = conn->resumeTarget;
+    item->seq = conn->resumeSeq;
+    item->fd = conn->fd;
+    item->tls = conn->tls;
+    conn->tls = nullptr;
+    item->payload = makeBuffer(pending.data(), pending.size());
+    postMail(reactors[sessionShard(conn->resumeTarget)], item);
+}
+
+void uringRelease(Connection* conn) {
+    if (conn->uring->transfer) {
+        postResumeMail(conn);
+    } else {
+        close(conn->fd);
+    }
+    delete conn->uring;
+    delete conn;
+}
+
+// 关闭或移交连接: 请求都结束后才能关闭 fd 和释放内存, 否则内核可能写进已释放的缓冲区,
+// 移交出去的 fd 上残留的 recv 也会抢走新分片的数据
+void uringRetire(Connection* conn, bool transfer) {
+    conn->uring->retired = true;
+    conn->uring->transfer = transfer;
+    uringCancelAll(conn);
+    if (conn->uring->ops == 0) uringRelease(conn);
+}
+
+// ==================== 附件 ====================
+
+// 大文件不经过发送队列: 上传的数据写进暂存文件, 下发时用 sendfile 从文件直接送进套接字.
+// 每块是一个完整的控制帧, 块与块之间先发排队的聊天消息, 大附件不会让其他消息排在它整个后面.
+// 只支持 epoll 后端上分帧和续传协议的客户端
+
+const int ATTACH_CHUNKS_PER_FLUSH = 4;          // 一次连续发送的附件块数, 用完后让给其他连接, 下一轮继续
+const size_t UPLOAD_READ_BUDGET = 256 << 10;    // 上传中的连接每轮最多读取的字节数
+const int ATTACH_NOTSENT_LOWAT = 128 << 10;     // 下发附件时内核中未发出数据的上限, 新消息最多排在这么多数据之后
+const size_t ATTACH_SPOOL_RATIO = 4;            // 暂存中的附件合计不超过单个附件上限的这么多倍
+const int ATTACH_PER_RECEIVER = 8;              // 每个接收方同时在上传或等待下发的附件数
+
+atomic<uint64_t> nextAttachmentId(1);
+
+// 暂存配额: 上传开始时按声明的大小预留, 上传中止或附件释放时归还
+pthread_mutex_t spoolMutex = PTHREAD_MUTEX_INITIALIZER;
+uint64_t spoolBytes = 0;
+unordered_map<string, int> spoolReceivers;     // 接收方 -> 占用配额的附件数
+
+// 返回空串表示预留成功, 否则是拒绝的原因
+string reserveSpool(const string& receiver, uint64_t size) {
+    string reason;
+    pthread_mutex_lock(&spoolMutex);
+    if (spoolBytes + size > attachMaxBytes * ATTACH_SPOOL_RATIO) {
+        reason = "服务器暂存的附件已满, 请稍后再发";
+    } else if (spoolReceivers[receiver] >= ATTACH_PER_RECEIVER) {
+        reason = "发给 " + receiver + " 的附件过多, 请等对方收完再发";
+    } else {
+        spoolBytes += size;
+        spoolReceivers[receiver]++;
+    }
+    if (!reason.empty() && spoolReceivers[receiver] == 0) spoolReceivers.erase(receiver);
+    pthread_mutex_unlock(&spoolMutex);
+    return reason;
+}
+
+void releaseSpool(const string& receiver, uint64_t size) {
+    pthread_mutex_lock(&spoolMutex);
+    spoolBytes -= size;
+    if (--spoolReceivers[receiver] == 0) spoolReceivers.erase(receiver);
+    pthread_mutex_unlock(&spoolMutex);
+}
+
+bool flushConnection(Connection* conn);
+
+void releaseAttachment(Attachment* file) {
+    if (file->refs.fetch_sub(1, memory_order_acq_rel) == 1) {
+        close(file->fd);
+        releaseSpool(file->receiver, file->size);
+        delete file;
+    }
+}
+
+// 拒绝或中止上传: 客户端收到 CONTROL_CANCEL 后停止发送, 已在路上的数据帧被丢弃
+void rejectUpload(int clientSocket, const string& reason) {
+    Connection* conn = connectionFor(clientSocket);
+    if (conn != nullptr) {
+        sendControl(conn, CONTROL_CANCEL);
+    } else {
+        sendToClient(clientSocket, string(CONTROL_CANCEL));
+    }
+    sendToClient(clientSocket, reason);
+}
+
+void abortUpload(Connection* conn) {
+    if (conn->upload == nullptr) return;
+    close(conn->upload->fd);
+    releaseSpool(conn->upload->target, conn->upload->size);
+    delete conn->upload;
+    conn->upload = nullptr;
+}
+
+// 文件名只保留一段, 不含路径和控制字符
+bool isValidFileName(string_view name) {
+    if (name.empty() || name.size() > 255 || name == "." || name == "..") return false;
+    for (size_t i = 0; i < name.size(); i++) {
+        if (name[i] == '/' || (unsigned char)name[i] < 0x20) return false;
+    }
+    return true;
+}
+
+// "/send 用户 字节数 文件名": 检查接收方后创建暂存文件, 之后的 CONTROL_DATA 帧写入其中
+void beginUpload(int clientSocket, const string& userName, string_view args) {
+    Connection* conn = connectionFor(clientSocket);
+    if (conn == nullptr || conn->uring != nullptr || attachMaxBytes == 0) {
+        rejectUpload(clientSocket, "当前服务器不支持附件");
+        return;
+    }
+    if (conn->protocol != PROTO_FRAMED) {
+        sendToClient(clientSocket, string("文本协议的客户端不能发送附件"));
+        return;
+    }
+    if (conn->upload != nullptr) {
+        abortUpload(conn);
+        rejectUpload(clientSocket, "上一个附件还没有上传完, 两个都已取消");
+        return;
+    }
+    size_t nameEnd = args.find(' ');
+    size_t sizeEnd = nameEnd == string_view::npos ? string_view::npos : args.find(' ', nameEnd + 1);
+    if (sizeEnd == string_view::npos) {
+        rejectUpload(clientSocket, "无效的附件请求");
+        return;
+    }
+    string target(args.substr(0, nameEnd));
+    string_view sizeText = args.substr(nameEnd + 1, sizeEnd - nameEnd - 1);
+    string_view fileName = args.substr(sizeEnd + 1);
+    uint64_t size = 0;
+    auto parsed = from_chars(sizeText.data(), sizeText.data() + sizeText.size(), size);
+    if (parsed.ec != errc() || parsed.ptr != sizeText.data() + sizeText.size() || !isValidFileName(fileName)) {
+        rejectUpload(clientSocket, "无效的附件请求");
+        return;
+    }
+    if (size == 0 || size > attachMaxBytes) {
+        rejectUpload(clientSocket, "附件大小需在 1 到 " + to_string(attachMaxBytes) + " 字节之间");
+        return;
+    }
+    if (target == userName) {
+        rejectUpload(clientSocket, "不能给自己发送附件");
+        return;
+    }
+    SessionId targetSession = lookupName(target);
+    if (targetSession == INVALID_SESSION) {
+        rejectUpload(clientSocket, "用户 " + target + " 不在线或不存在");
+        return;
+    }
+    if (isRemoteSession(targetSession)) {
+        rejectUpload(clientSocket, "附件不能发送给其他节点上的用户 " + target);
+        return;
+    }
+    string reason = reserveSpool(target, size);
+    if (!reason.empty()) {
+        rejectUpload(clientSocket, reason);
+        return;
+    }
+
+    string path = spoolDir + "/chat-spool-XXXXXX";
+    int fd = mkostemp(&path[0], O_CLOEXEC);
+    if (fd == -1) {
+        cout << "创建附件暂存文件失败: " << strerror(errno) << endl;
+        releaseSpool(target, size);
+        rejectUpload(clientSocket, "服务器无法暂存附件");
+        return;
+    }
+    unlink(path.c_str());
+    conn->upload = new Upload{fd, size, 0, string(fileName), target};
+    cout << "[" << cachedTimeStamp() << "]  用户 " << userName << " 开始上传附件 " << fileName << " (" << size << " 字节) 给 " << target << endl;
+}
+
+void deliverAttachment(Reactor* r, Attachment* file);
+
+// 上传完成: 按名字重新查找接收方 (期间可能重新登录过), 附件交给它所在的分片
+void finishUpload(Connection* conn) {
+    Upload* upload = conn->upload;
+    conn->upload = nullptr;
+    SessionId target = lookupName(upload->target);
+    if (target == INVALID_SESSION || isRemoteSession(target)) {
+        close(upload->fd);
+        releaseSpool(upload->target, upload->size);
+        sendToClient(conn->fd, "附件 " + upload->name + " 发送失败: 用户 " + upload->target + " 已离线");
+        delete upload;
+        return;
+    }
+
+    Attachment* file = new Attachment();
+    file->refs.store(1, memory_order_relaxed);
+    file->fd = upload->fd;
+    file->id = nextAttachmentId++;
+    file->size = upload->size;
+    file->name = upload->name;
+    file->sender = conn->userName;
+    file->receiver = upload->target;
+    file->senderSession = conn->sessionId;
+    file->target = target;
+    countStat(STAT_ATTACHMENTS);
+    sendToClient(conn->fd, MessageFormatter().add("附件 ").add(file->name).add(" 已上传 (").add(file->size)
+                           .add(" 字节), 正在发送给 ").add(upload->target).buffer());
+    delete upload;
+    cout << "[" << cachedTimeStamp() << "]  用户 " << file->sender << " 的附件 " << file->name << " 上传完成" << endl;
+
+    int shard = sessionShard(target);
+    if (shard == conn->owner->id) {
+        deliverAttachment(conn->owner, file);
+        return;
+    }
+    MailItem* item = new MailItem();
+    item->kind = MAIL_ATTACH;
+    item->target = target;
+    item->file = file;
+    postMail(reactors[shard], item);
+}
+
+// 附件数据帧追加到暂存文件; 没有进行中的上传 (已被拒绝或中止) 时直接丢弃
+void receiveUpload(int clientSocket, string_view message) {
+    Connection* conn = connectionFor(clientSocket);
+    string_view prefix(CONTROL_DATA);
+    if (conn == nullptr || conn->upload == nullptr || message.substr(0, prefix.size()) != prefix) return;
+    Upload* upload = conn->upload;
+    string_view data = message.substr(prefix.size());
+    if (data.size() > upload->size - upload->received) {
+        abortUpload(conn);
+        rejectUpload(clientSocket, "附件数据超出声明的大小, 已取消");
+        return;
+    }
+    if (!writeAll(upload->fd, data.data(), data.size())) {
+        cout << "写入附件暂存文件失败: " << strerror(errno) << endl;
+        abortUpload(conn);
+        rejectUpload(clientSocket, "服务器无法暂存附件, 已取消");
+        return;
+    }
+    upload->received += data.size();
+    if (upload->received == upload->size) finishUpload(conn);
+}
+
+// 在接收方所在的分片上开始下发: 先发 CONTROL_FILE, 数据块由 flushConnection 在消息之间穿插发送
+void deliverAttachment(Reactor* r, Attachment* file) {
+    Connection* conn = findSession(r, file->target);
+    if (conn == nullptr || conn->closing || conn->detached) {
+        deliverTo(file->senderSession, makeBuffer("附件 " + file->name + " 发送失败: 对方已离线"));
+        releaseAttachment(file);
+        return;
+    }
+    if (conn->protocol != PROTO_FRAMED) {
+        deliverTo(file->senderSession, makeBuffer("附件 " + file->name + " 发送失败: 对方的客户端不支持附件"));
+        releaseAttachment(file);
+        return;
+    }
+    sendControl(conn, CONTROL_FILE + to_string(file->id) + " " + to_string(file->size) + " " + file->sender + " " + file->name);
+    FileStream stream = {};
+    stream.file = file;
+    if (conn->files.empty()) {
+        socklen_t len = sizeof(conn->savedNotsentLowat);
+        getsockopt(conn->fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &conn->savedNotsentLowat, &len);
+        int lowat = ATTACH_NOTSENT_LOWAT;
+        setsockopt(conn->fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat));
+    }
+    conn->files.push_back(stream);
+    if (!flushConnection(conn)) scheduleClose(conn);
+}
+
+// 附件都发完或丢弃后恢复原来的设置, 之后的聊天消息照常缓冲
+void restoreNotsentLowat(Connection* conn) {
+    setsockopt(conn->fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &conn->savedNotsentLowat, sizeof(conn->savedNotsentLowat));
+}
+
+void markStreaming(Connection* conn) {
+    if (conn->streaming) return;
+    conn->streaming = true;
+    conn->owner->streamingList.push_back(conn);
+}
+
+// 发送队首附件的当前块, 不在块中间时先开始新的一块. 返回 false 表示连接出错, 套接字写满时 blocked 为 true.
+// 一块发完后该附件排到队尾, 多个附件轮流
+bool sendFileChunk(Connection* conn, bool& blocked) {
+    FileStream& stream = conn->files.front();
+    Attachment* file = stream.file;
+    if (stream.headerLen == 0) {
+        stream.chunkLeft = min((uint64_t)ATTACH_CHUNK_SIZE, file->size - stream.offset);
+        encodeFrameHeader(stream.header, 2 + 8 + stream.chunkLeft);
+        memcpy(stream.header + FRAME_HEADER_SIZE, CONTROL_CHUNK, 2);
+        encodeU64(stream.header + FRAME_HEADER_SIZE + 2, file->id);
+        stream.headerLen = sizeof(stream.header);
+        stream.headerSent = 0;
+    }
+    while (stream.headerSent < stream.headerLen) {
+        struct iovec iov;
+        iov.iov_base = stream.header + stream.headerSent;
+        iov.iov_len = stream.headerLen - stream.headerSent;
+        ssize_t n = conn->tlsUserSend ? sendTls(conn, &iov, 1)
+                                      : send(conn->fd, iov.iov_base, iov.iov_len, MSG_NOSIGNAL | MSG_DONTWAIT | MSG_MORE);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            blocked = errno == EAGAIN || errno == EWOULDBLOCK;
+            return blocked;
+        }
+        stream.headerSent += n;
+        if (!conn->tlsUserSend) countStat(STAT_BYTES_OUT, n);
+    }
+    while (stream.chunkLeft > 0) {
+        ssize_t n;
+        if (conn->tlsUserSend) {
+            // 内核不加密时只能读出来在用户态加密, 每次一个记录
+            char record[TLS_RECORD_SIZE];
+            n = -1;
+            if (flushTlsOut(conn)) {
+                n = pread(file->fd, record, min((uint64_t)sizeof(record), stream.chunkLeft), stream.offset);
+                if (n > 0) {
+                    struct iovec iov;
+                    iov.iov_base = record;
+                    iov.iov_len = n;
+                    n = sendTls(conn, &iov, 1);
+                }
+            }
+        } else {
+            off_t offset = stream.offset;
+            n = sendfile(conn->fd, file->fd, &offset, stream.chunkLeft);
+            if (n > 0) countStat(STAT_BYTES_OUT, n);
+        }
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            blocked = errno == EAGAIN || errno == EWOULDBLOCK;
+            return blocked;
+        }
+        // 暂存文件比声明的短, 这一块发不完, 只能断开
+        if (n == 0) return false;
+        stream.offset += n;
+        stream.chunkLeft -= n;
+        countStat(STAT_ATTACH_BYTES, n);
+    }
+
+    FileStream done = stream;
+    done.headerLen = 0;
+    conn->files.pop_front();
+    if (done.offset < file->size) {
+        conn->files.push_back(done);
+        return true;
+    }
+    deliverTo(file->senderSession, makeBuffer(conn->userName + " 已收到附件 " + file->name));
+    releaseAttachment(file);
+    if (conn->files.empty()) restoreNotsentLowat(conn);
+    return true;
+}
+
+// 上一轮用完配额的连接继续发送附件, 与其他连接的事件轮流进行
+void continueStreams(Reactor* r) {
+    vector<Connection*> pending;
+    pending.swap(r->streamingList);
+    for (size_t i = 0; i < pending.size(); i++) {
+        Connection* conn = pending[i];
+        conn->streaming = false;
+        if (conn->closing) continue;
+        if (!flushConnection(conn)) scheduleClose(conn);
+    }
+}
+
+// 连接断开或会话被接回时丢弃附件: 套接字上发到一半的块随旧连接作废, 通知各附件的发送者
+void dropAttachments(Connection* conn) {
+    abortUpload(conn);
+    if (!conn->files.empty()) restoreNotsentLowat(conn);
+    for (size_t i = 0; i < conn->files.size(); i++) {
+        Attachment* file = conn->files[i].file;
+        deliverTo(file->senderSession, makeBuffer("附件 " + file->name + " 未能发送完: " + conn->userName + " 的连接中断"));
+        releaseAttachment(file);
+    }
+    conn->files.clear();
+    if (conn->streaming) {
+        vector<Connection*>& list = conn->owner->streamingList;
+        list.erase(find(list.begin(), list.end(), conn));
+        conn->streaming = false;
+    }
+}
+
+// 热重启不交接附件: 发到一半的块从暂存文件读出剩余部分, 放到发送队列最前面, 保证后面的帧不错位;
+// 其余附件通知接收方中止、通知发送者未能发完. 返回取消的传输数
+int stopAttachmentsForHandoff(Connection* conn) {
+    int stopped = 0;
+    if (conn->upload != nullptr) {
+        abortUpload(conn);
+        rejectUpload(conn->fd, "服务器正在重启, 附件上传已取消");
+        stopped++;
+    }
+    if (conn->files.empty()) return stopped;
+    stopped += conn->files.size();
+    FileStream& stream = conn->files.front();
+    if (stream.headerLen != 0) {
+        string rest(stream.header + stream.headerSent, stream.headerLen - stream.headerSent);
+        size_t head = rest.size();
+        rest.resize(head + stream.chunkLeft);
+        if (pread(stream.file->fd, &rest[head], stream.chunkLeft, stream.offset) != (ssize_t)stream.chunkLeft) {
+            // 补不完这一块, 只能断开, 客户端会重新登录
+            conn->resumable = false;
+            scheduleClose(conn);
+            return stopped;
+        }
+        BufferRef chunk = makeRawBuffer(rest.data(), rest.size());
+        conn->outQueuedBytes += chunk.wireSize(conn->protocol);
+        conn->outQueue.push_front(chunk);
+    }
+    for (size_t i = 0; i < conn->files.size(); i++) {
+        Attachment* file = conn->files[i].file;
+        sendControl(conn, CONTROL_ABORT + to_string(file->id));
+        deliverTo(file->senderSession, makeBuffer("附件 " + file->name + " 未能发送完: 服务器正在重启"));
+        releaseAttachment(file);
+    }
+    restoreNotsentLowat(conn);
+    conn->files.clear();
+    conn->streaming = false;
+    return stopped;
+}
+
+// ==================== epoll reactor ====================
+
+bool setNonBlocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    return flags != -1 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) != -1;
+}
+
+// 把发送队列尽量写进套接字, 每次 writev 合并多条消息; 返回 false 表示连接出错.
+// 附件块穿插在消息之间: 发到一半的块先发完, 然后清空消息队列, 再开始下一块
+bool flushConnection(Connection* conn) {
+    if (!conn->tlsOut.empty() && !flushTlsOut(conn)) return errno == EAGAIN || errno == EWOULDBLOCK;
+    int chunks = 0;
+    while (true) {
+        bool inChunk = !conn->files.empty() && conn->files.front().headerLen != 0;
+        if (inChunk || (conn->outQueue.empty() && !conn->files.empty())) {
+            if (!inChunk && chunks == ATTACH_CHUNKS_PER_FLUSH) {
+                markStreaming(conn);
+                return true;
+            }
+            bool blocked = false;
+            if (!sendFileChunk(conn, blocked)) return false;
+            if (blocked) return true;
+            chunks++;
+            continue;
+        }
+        if (conn->outQueue.empty()) return true;
+
+        struct iovec iov[MAX_IOV];
+        int iovcnt = 0;
+        size_t total = 0;
+        for (size_t i = 0; i < conn->outQueue.size() && iovcnt < MAX_IOV; i++) {
+            size_t offset = (i == 0) ? conn->outHeadOffset : 0;
+            iov[iovcnt].iov_base = (void*)(conn->outQueue[i].wireData(conn->protocol) + offset);
+            iov[iovcnt].iov_len = conn->outQueue[i].wireSize(conn->protocol) - offset;
+            total += iov[iovcnt].iov_len;
+            iovcnt++;
+        }
+
+        ssize_t n = sendIov(conn, iov, iovcnt, &conn->outQueue[0], iovcnt, total);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+
+        size_t written = n;
+        while (written > 0) {
+            size_t size = conn->outQueue.front().wireSize(conn->protocol);
+            size_t remain = size - conn->outHeadOffset;
+            if (written < remain) {
+                conn->outHeadOffset += written;
+                break;
+            }
+            written -= remain;
+            conn->outQueuedBytes -= size;
+            conn->outQueue.pop_front();
+            conn->outHeadOffset = 0;
+        }
+    }
+}
+
+// 读取错误队列中的 MSG_ZEROCOPY 完成通知, 释放内核已经用完的缓冲区
+void drainZeroCopyCompletions(Connection* conn) {
+    while (true) {
+        char control[128];
+        struct msghdr msg = {};
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(conn->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) return;
+
+        for (struct cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm != nullptr; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR)
+                  || (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))) continue;
+            struct sock_extended_err* err = (struct sock_extended_err*)CMSG_DATA(cm);
+            if (err->ee_origin != SO_EE_ORIGIN_ZEROCOPY) continue;
+
+            // [ee_info, ee_data] 是已完成的调用编号区间, 编号可能回绕
+            uint32_t lo = err->ee_info;
+            uint32_t hi = err->ee_data;
+            if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) conn->zcCopied += hi - lo + 1;
+            while (!conn->zcPending.empty() && (int32_t)(conn->zcPending.front().id - lo) >= 0
+                   && (int32_t)(hi - conn->zcPending.front().id) >= 0) {
+                conn->zcPending.pop_front();
+            }
+        }
+    }
+}
+
+// EPOLLERR 可能只是错误队列里有零拷贝通知, 以 SO_ERROR 判断套接字本身是否出错
+bool handleSocketError(Connection* conn) {
+    if (conn->zeroCopy) drainZeroCopyCompletions(conn);
+    int error = 0;
+    socklen_t len = sizeof(error);
+    getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &error, &len);
+    return error == 0 && conn->zeroCopy;
+}
+
+void removeThrottled(Reactor* r, Connection* conn) {
+    auto it = find(r->throttledList.begin(), r->throttledList.end(), conn);
+    if (it != r->throttledList.end()) {
+        *it = r->throttledList.back();
+        r->throttledList.pop_back();
+    }
+    conn->bucket.delayUntil = 0;
+}
+
+void closeConnection(Connection* conn) {
+    cancelTimer(conn->owner->timers, conn->idleTimer);
+    // 先从用户表中移除, 之后其他线程不会再通过 fd 找到该连接
+    if (conn->loggedIn) {
+        unregisterUser(conn->fd, conn->sessionId, conn->userName);
+        detachSession(conn->owner, conn);
+        if (conn->protocol == PROTO_BINARY) binaryClients--;
+    }
+    if (conn->bucket.delayUntil != 0) removeThrottled(conn->owner, conn);
+    dropAttachments(conn);
+    if (conn->resumeToken != 0) releaseResumeToken(conn->resumeToken);
+    connTable[conn->fd] = nullptr;
+    if (conn->uring != nullptr) {
+        // 关闭前的最后几条消息 (如断开原因) 还在队列里, 没有发送请求在途时直接发一次
+        if (!conn->uring->sending) flushConnection(conn);
+        shutdown(conn->fd, SHUT_RDWR);
+        uringRetire(conn, false);
+        return;
+    }
+    epoll_ctl(conn->owner->epollFd, EPOLL_CTL_DEL, conn->fd, nullptr);
+    if (conn->tls != nullptr) {
+        // 尽量发出 close_notify, 发不出去也不等
+        if (!conn->tlsHandshaking) {
+            SSL_shutdown(conn->tls);
+            if (conn->tlsUserSend) tlsDrain(conn->tls, conn->tlsOut);
+            flushTlsOut(conn);
+        }
+        SSL_free(conn->tls);
+    }
+    close(conn->fd);
+    delete conn;
+}
+
+// 续传会话断线后先保留: 名字、房间和序号都不变, 期间发给它的消息只记入 resendLog.
+// fd 保持打开 (已 shutdown) 直到会话被接回或过期, 这样 connTable 中的映射始终有效
+void detachConnection(Connection* conn) {
+    if (conn->uring != nullptr) {
+        uringCancelAll(conn);
+    } else {
+        epoll_ctl(conn->owner->epollFd, EPOLL_CTL_DEL, conn->fd, nullptr);
+    }
+    shutdown(conn->fd, SHUT_RDWR);
+    resetOutput(conn);
+    dropAttachments(conn);
+    cancelTimer(conn->owner->timers, conn->idleTimer);
+    if (conn->bucket.delayUntil != 0) removeThrottled(conn->owner, conn);
+    conn->detached = true;
+    conn->closing = false;
+    conn->detachedAt = monotonicNs() / 1000000;
+    conn->owner->detachedList.push_back(conn);
+    cout << "[" << cachedTimeStamp() << "]  用户 " << conn->userName << " 连接中断, 会话保留 " << resumeGraceSec << " 秒等待续传" << endl;
+}
+
+void removeDetached(Reactor* r, Connection* conn) {
+    auto it = find(r->detachedList.begin(), r->detachedList.end(), conn);
+    if (it != r->detachedList.end()) {
+        *it = r->detachedList.back();
+        r->detachedList.pop_back();
+    }
+}
+
+void expireDetached(Reactor* r) {
+    uint64_t now = monotonicNs() / 1000000;
+    for (size_t i = 0; i < r->detachedList.size();) {
+        Connection* conn = r->detachedList[i];
+        if (now - conn->detachedAt < (uint64_t)resumeGraceSec * 1000) {
+            i++;
+            continue;
+        }
+        r->detachedList[i] = r->detachedList.back();
+        r->detachedList.pop_back();
+        cout << "[" << cachedTimeStamp() << "]  用户 " << conn->userName << " 的会话已过期" << endl;
+        closeConnection(conn);
+    }
+}
+
+void sendPing(Connection* conn) {
+    static const BufferRef framedPing = makeBuffer(CONTROL_PING);
+    static const BufferRef binaryPing = [] {
+        string frame;
+        appendBinaryFrame(frame, OP_PING, string_view());
+        return makeRawBuffer(frame.data(), frame.size());
+    }();
+    queueOutput(conn, conn->protocol == PROTO_BINARY ? binaryPing : framedPing);
+    countStat(STAT_PINGS);
+}
+
+// 定时器到期时检查连接静默了多久: 超过上限就断开 (续传会话转为等待续传), 能应答心跳的连接静默
+// 满 heartbeatSec 时发一次 PING, 否则按最近一次收到数据的时刻把定时器挂到下一个要检查的时刻
+void checkIdle(Reactor* r, Connection* conn) {
+    uint64_t now = r->timers.now;
+    uint64_t quiet = now - min(now, conn->lastActive);
+    bool ping = conn->loggedIn && conn->heartbeats && heartbeatSec > 0;
+    uint64_t limit = !conn->loggedIn ? secondsToTicks(LOGIN_TIMEOUT_SEC)
+                   : ping ? 2 * secondsToTicks(heartbeatSec) : secondsToTicks(idleTimeoutSec);
+    // 时间按整 tick 记录, 多等一个 tick 保证静默时间不少于期限
+    if (limit != 0 && quiet > limit) {
+        countStat(STAT_IDLE_CLOSES);
+        if (conn->loggedIn) {
+            cout << "[" << cachedTimeStamp() << "]  用户 " << conn->userName << (ping ? " 心跳超时" : " 空闲超时") << ", 断开连接" << endl;
+        }
+        scheduleClose(conn);
+        return;
+    }
+    uint64_t next = limit != 0 ? conn->lastActive + limit + 1 : UINT64_MAX;
+    if (ping) {
+        uint64_t pingAt = conn->lastActive + secondsToTicks(heartbeatSec);
+        if (now >= pingAt) sendPing(conn);
+        else next = pingAt;
+    }
+    if (next != UINT64_MAX) armTimer(r->timers, conn->idleTimer, next);
+}
+
+// 连接刚建立或换了新的 fd, 从现在开始计算静默时间
+void resetIdleTimer(Connection* conn) {
+    conn->lastActive = conn->owner->timers.now;
+    checkIdle(conn->owner, conn);
+}
+
+// 推进本分片的定时轮, 逐个检查到期的连接
+void expireTimers(Reactor* r) {
+    TimerNode expired;
+    initTimerList(expired);
+    advanceTimers(r->timers, currentTick(), expired);
+    while (expired.next != &expired) {
+        TimerNode* node = expired.next;
+        unlinkTimer(*node);
+        if (!node->conn->closing) checkIdle(r, node->conn);
+    }
+}
+
+// 请求续传的新连接: 从本分片摘下 fd 但不关闭, 连同登录块之后已收到的数据交给会话所在的分片
+void transferForResume(Connection* conn) {
+    connTable[conn->fd] = nullptr;
+    cancelTimer(conn->owner->timers, conn->idleTimer);
+    if (conn->uring != nullptr) {
+        // 取消 recv 之前收到的数据仍会追加到解析器, 请求全部结束时再移交
+        uringRetire(conn, true);
+        return;
+    }
+    epoll_ctl(conn->owner->epollFd, EPOLL_CTL_DEL, conn->fd, nullptr);
+    postResumeMail(conn);
+    delete conn;
+}
+
+void processCloseList(Reactor* r) {
+    for (size_t i = 0; i < r->closeList.size(); i++) {
+        Connection* conn = r->closeList[i];
+        if (conn->resumeTarget != INVALID_SESSION) {
+            transferForResume(conn);
+        } else if (conn->resumable && conn->loggedIn && !conn->detached) {
+            detachConnection(conn);
+        } else {
+            closeConnection(conn);
+        }
+    }
+    r->closeList.clear();
+}
+
+// 打印本分片每个客户端的发送队列深度
+void reportQueues(Reactor* r) {
+    string report = "[分片 " + to_string(r->id) + "] 在线 " + to_string(r->clients.size()) + " 人\n";
+    for (size_t i = 0; i < r->clients.size(); i++) {
+        Connection* conn = r->clients[i];
+        report += "  " + conn->userName + ": 排队 " + to_string(conn->outQueue.size()) + " 条/"
+                + to_string(conn->outQueuedBytes) + " 字节, 峰值 " + to_string(conn->outPeakBytes)
+                + " 字节, 丢弃 " + to_string(conn->outDropped) + " 条, 等待零拷贝完成 "
+                + to_string(conn->zcPending.size()) + " 次, 超过限速 " + to_string(conn->bucket.limited) + " 次\n";
+    }
+    if (zeroCopyThreshold > 0) {
+        uint64_t sends = 0, copied = 0;
+        for (size_t i = 0; i < r->clients.size(); i++) {
+            sends += r->clients[i]->zcSends;
+            copied += r->clients[i]->zcCopied;
+        }
+        report += "  MSG_ZEROCOPY 发送 " + to_string(sends) + " 次, 其中内核回退拷贝 " + to_string(copied) + " 次\n";
+    }
+    cout << report << flush;
+}
+
+// 统计查询中发送队列的部分: 各分片填入自己积压最深的客户端, 最后一个完成的分片唤醒查询方.
+// 查询方等待超时后会先行返回, 因此用引用计数决定由谁释放
+const size_t STATS_DEEPEST_CLIENTS = 10;
+
+struct StatsQuery {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    atomic<int> refs;
+    int pending;                            // 尚未回复的分片数
+    size_t queuedClients;
+    size_t queuedBytes;
+    vector<pair<size_t, string>> deepest;   // (积压字节数, 描述)
+};
+
+void releaseStatsQuery(StatsQuery* query) {
+    if (query->refs.fetch_sub(1, memory_order_acq_rel) == 1) {
+        pthread_mutex_destroy(&query->mutex);
+        pthread_cond_destroy(&query->cond);
+        delete query;
+    }
+}
+
+void answerStatsQuery(Reactor* r, StatsQuery* query) {
+    size_t queuedClients = 0, queuedBytes = 0;
+    vector<pair<size_t, string>> deepest;
+    for (size_t i = 0; i < r->clients.size(); i++) {
+        Connection* conn = r->clients[i];
+        if (conn->outQueuedBytes == 0) continue;
+        queuedClients++;
+        queuedBytes += conn->outQueuedBytes;
+        deepest.emplace_back(conn->outQueuedBytes, conn->userName + ": " + to_string(conn->outQueue.size()) + " 条 / "
+                             + to_string(conn->outQueuedBytes) + " 字节 (分片 " + to_string(r->id) + ")");
+    }
+    sort(deepest.rbegin(), deepest.rend());
+    if (deepest.size() > STATS_DEEPEST_CLIENTS) deepest.resize(STATS_DEEPEST_CLIENTS);
+
+    pthread_mutex_lock(&query->mutex);
+    query->queuedClients += queuedClients;
+    query->queuedBytes += queuedBytes;
+    query->deepest.insert(query->deepest.end(), deepest.begin(), deepest.end());
+    if (--query->pending == 0) pthread_cond_signal(&query->cond);
+    pthread_mutex_unlock(&query->mutex);
+    releaseStatsQuery(query);
+}
+
+// 每秒把所有计数槽加总一次, 速率按最近两次采样计算
+pthread_mutex_t statsMutex = PTHREAD_MUTEX_INITIALIZER;
+StatTotals statsPrevious, statsLatest;
+uint64_t serverStartNs;
+
+void* statsSampler(void*) {
+    while (serverRunning) {
+        sleep(1);
+        StatTotals totals;
+        sumStats(totals);
+        pthread_mutex_lock(&statsMutex);
+        statsPrevious = statsLatest;
+        statsLatest = totals;
+        pthread_mutex_unlock(&statsMutex);
+    }
+    return nullptr;
+}
+
+string buildStatsReport() {
+    StatTotals total, previous, latest;
+    sumStats(total);
+    pthread_mutex_lock(&statsMutex);
+    previous = statsPrevious;
+    latest = statsLatest;
+    pthread_mutex_unlock(&statsMutex);
+
+    uint64_t interval = latest.takenAt - previous.takenAt;
+    auto perSecond = [&](StatCounter c) -> uint64_t {
+        return interval == 0 ? 0 : (latest.values[c] - previous.values[c]) * 1000000000ULL / interval;
+    };
+    auto averageUs = [](uint64_t ns, uint64_t count) -> string {
+        char text[32];
+        snprintf(text, sizeof(text), "%.1f", count == 0 ? 0.0 : ns / 1000.0 / count);
+        return text;
+    };
+
+    MessageFormatter report;
+    report.add("[运行统计]  已运行 ").add((total.takenAt - serverStartNs) / 1000000000ULL).add(" 秒\n");
+    report.add("  在线会话 ").add(total.values[STAT_LOGINS] - total.values[STAT_LOGOUTS])
+          .add(", 累计登录 ").add(total.values[STAT_LOGINS]).add("\n");
+    report.add("  接受连接 ").add(perSecond(STAT_ACCEPTS)).add(" 个/秒, 累计 ").add(total.values[STAT_ACCEPTS]).add("\n");
+    report.add("  收到消息 ").add(perSecond(STAT_MSGS_IN)).add(" 条/秒, 发出 ").add(perSecond(STAT_MSGS_OUT))
+          .add(" 条/秒, 累计 ").add(total.values[STAT_MSGS_IN]).add(" / ").add(total.values[STAT_MSGS_OUT]).add(" 条\n");
+    report.add("  接收 ").add(perSecond(STAT_BYTES_IN)).add(" 字节/秒, 发送 ").add(perSecond(STAT_BYTES_OUT))
+          .add(" 字节/秒, 累计 ").add(total.values[STAT_BYTES_IN]).add(" / ").add(total.values[STAT_BYTES_OUT]).add(" 字节\n");
+    report.add("  扇出 ").add(perSecond(STAT_FANOUTS)).add(" 次/秒, 最近 1 秒平均 ")
+          .add(averageUs(latest.values[STAT_FANOUT_NS] - previous.values[STAT_FANOUT_NS],
+                         latest.values[STAT_FANOUTS] - previous.values[STAT_FANOUTS]))
+          .add(" us, 累计平均 ").add(averageUs(total.values[STAT_FANOUT_NS], total.values[STAT_FANOUTS])).add(" us\n");
+    report.add("  慢速客户端丢弃 ").add(total.values[STAT_DROPPED]).add(" 条\n");
+    report.add("  房间 ").add(roomCount.load(memory_order_relaxed)).add(" 个 (上限 ").add(MAX_ROOMS).add("), 历史占用 ")
+          .add(historyAllocated.load(memory_order_relaxed) >> 10).add(" / ").add(historyTotalBytes >> 10).add(" KiB\n");
+    if (useIoUring) {
+        report.add("  io_uring: io_uring_enter ").add(perSecond(STAT_URING_ENTERS)).add(" 次/秒, 提交请求 ")
+              .add(perSecond(STAT_URING_SQES)).add(" 个/秒, 累计 ").add(total.values[STAT_URING_ENTERS]).add(" / ")
+              .add(total.values[STAT_URING_SQES]).add("\n");
+    }
+    if (serverMode == MODE_POOL) {
+        report.add("  线程池: ").add(workerQueues.size()).add(" 个工作线程, 处理就绪事件 ").add(perSecond(STAT_POOL_TASKS))
+              .add(" 次/秒, 累计 ").add(total.values[STAT_POOL_TASKS]).add(" 次, 其中窃取 ").add(total.values[STAT_POOL_STEALS]).add(" 次\n");
+    }
+    if (relayPort != 0) {
+        report.add("  联邦: 节点 ").add((uint64_t)nodeId).add(", 已连接对端 ").add(connectedPeers()).add(" / ").add(peerLinks.size())
+              .add(", 转发 ").add(total.values[STAT_RELAY_FRAMES]).add(" 帧 / ").add(total.values[STAT_RELAY_BATCHES])
+              .add(" 次写出, 收到 ").add(total.values[STAT_RELAY_RECEIVED]).add(" 帧\n");
+    }
+    if (total.values[STAT_PINGS] > 0 || total.values[STAT_IDLE_CLOSES] > 0) {
+        report.add("  心跳: 发出 ").add(total.values[STAT_PINGS]).add(" 次, 超时断开 ").add(total.values[STAT_IDLE_CLOSES]).add(" 个连接\n");
+    }
+    if (tlsContext != nullptr) {
+        report.add("  TLS: 累计握手 ").add(total.values[STAT_TLS_HANDSHAKES]).add(" 次, 内核加密发送 ").add(total.values[STAT_KTLS_TX])
+              .add(" 个, 内核解密接收 ").add(total.values[STAT_KTLS_RX]).add(" 个\n");
+    }
+    if (total.values[STAT_ATTACHMENTS] > 0) {
+        report.add("  附件: 累计上传 ").add(total.values[STAT_ATTACHMENTS]).add(" 个, 下发 ").add(perSecond(STAT_ATTACH_BYTES))
+              .add(" 字节/秒, 累计 ").add(total.values[STAT_ATTACH_BYTES]).add(" 字节\n");
+    }
+    if (searchBytes > 0) {
+        uint64_t docs;
+        size_t bytes, segments;
+        searchIndexUsage(docs, bytes, segments);
+        report.add("  检索: 索引 ").add(docs).add(" 条消息, 约 ").add(bytes >> 10).add(" KiB, 封存 ").add(segments)
+              .add(" 段, 淘汰 ").add(searchIndex.evictedDocs.load(memory_order_relaxed)).add(" 条; 查询 ")
+              .add(total.values[STAT_SEARCHES]).add(" 次, 平均 ").add(averageUs(total.values[STAT_SEARCH_NS], total.values[STAT_SEARCHES]))
+              .add(" us\n");
+    }
+    if (mailboxBytes > 0) {
+        size_t boxes, knownUsers, memoryBytes;
+        uint64_t spillBytes;
+        mailboxUsage(boxes, knownUsers, memoryBytes, spillBytes);
+        report.add("  离线私聊: ").add(boxes).add(" 个信箱 (上限 ").add(MAILBOX_MAX_BOXES).add("), 登录过的用户 ").add(knownUsers)
+              .add(" 个, 内存 ").add(memoryBytes >> 10).add(" / ").add(mailboxBytes >> 10)
+              .add(" KiB, 落盘 ").add(spillBytes >> 10).add(" KiB; 累计存入 ").add(total.values[STAT_OFFLINE_STORED])
+              .add(" 条, 投递 ").add(total.values[STAT_OFFLINE_DELIVERED]).add(" 条\n");
+    }
+    if (rateMsgs > 0 || rateBytes > 0) {
+        report.add("  限速: 丢弃 ").add(total.values[STAT_RATE_REJECTED]).add(" 条, 暂停读取 ")
+              .add(total.values[STAT_RATE_DELAYED]).add(" 次, 断开 ").add(total.values[STAT_RATE_DISCONNECTS]).add(" 个\n");
+    }
+
+    if (serverMode != MODE_EPOLL || reactors.empty()) return string(report.view());
+
+    StatsQuery* query = new StatsQuery();
+    pthread_mutex_init(&query->mutex, nullptr);
+    pthread_cond_init(&query->cond, nullptr);
+    query->refs.store(reactors.size() + 1);
+    query->pending = reactors.size();
+    query->queuedClients = 0;
+    query->queuedBytes = 0;
+    for (size_t i = 0; i < reactors.size(); i++) {
+        MailItem* item = new MailItem();
+        item->kind = MAIL_STATS;
+        item->target = INVALID_SESSION;
+        item->query = query;
+        postMail(reactors[i], item);
+    }
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += 1;
+    pthread_mutex_lock(&query->mutex);
+    while (query->pending > 0) {
+        if (pthread_cond_timedwait(&query->cond, &query->mutex, &deadline) == ETIMEDOUT) break;
+    }
+    report.add("  发送队列: ").add(query->queuedClients).add(" 个客户端有积压, 共 ").add(query->queuedBytes).add(" 字节");
+    if (query->pending > 0) report.add(" (").add((uint64_t)query->pending).add(" 个分片未及时回复)");
+    report.add("\n");
+    sort(query->deepest.rbegin(), query->deepest.rend());
+    for (size_t i = 0; i < query->deepest.size() && i < STATS_DEEPEST_CLIENTS; i++) {
+        report.add("    ").add(query->deepest[i].second).add("\n");
+    }
+    pthread_mutex_unlock(&query->mutex);
+    releaseStatsQuery(query);
+    return string(report.view());
+}
+
+// Unix 域套接字上的统计端点: 每个连接写回一份统计后关闭, 可用 nc -U 或 socat 读取
+void* statsSocketLoop(void* arg) {
+    int listenFd = (int)(intptr_t)arg;
+    while (serverRunning) {
+        int fd = accept4(listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            break;
+        }
+        string report = buildStatsReport();
+        sendAllBlocking(fd, report.data(), report.size());
+        close(fd);
+    }
+    return nullptr;
+}
+
+// 启动每秒采样线程和 (可选的) Unix 域套接字端点
+void startStatsService() {
+    serverStartNs = monotonicNs();
+    sumStats(statsLatest);
+    statsPrevious = statsLatest;
+    pthread_t tid;
+    pthread_create(&tid, nullptr, statsSampler, nullptr);
+    pthread_detach(tid);
+
+    if (statsSocketPath.empty()) return;
+    struct sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (statsSocketPath.size() >= sizeof(addr.sun_path)) {
+        cout << "统计套接字路径过长: " << statsSocketPath << endl;
+        return;
+    }
+    strcpy(addr.sun_path, statsSocketPath.c_str());
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    unlink(statsSocketPath.c_str());
+    if (fd == -1 || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1 || listen(fd, BACKLOG) == -1) {
+        cout << "无法创建统计套接字 " << statsSocketPath << endl;
+        if (fd != -1) close(fd);
+        return;
+    }
+    pthread_create(&tid, nullptr, statsSocketLoop, (void*)(intptr_t)fd);
+    pthread_detach(tid);
+}
+
+// 登录块收齐后完成登录, 返回 false 表示连接需要关闭
+bool handleLogin(Connection* conn) {
+    string_view loginBlock;
+    if (!conn->parser.take(LOGIN_BLOCK_SIZE, loginBlock)) return true;
+
+    string userName;
+    int protocol = PROTO_TEXT;
+    if (!parseLoginBlock(loginBlock.data(), loginBlock.size(), userName, protocol) || protocol > PROTO_BINARY) {
+        return false;
+    }
+    if (protocol == PROTO_BINARY) {
+        conn->compress = (loginBlock[LOGIN_FLAGS_OFFSET] & LOGIN_FLAG_COMPRESS) != 0;
+        conn->heartbeats = true;
+    } else if (protocol == PROTO_RESUMABLE) {
+        protocol = PROTO_FRAMED;
+        conn->heartbeats = true;
+        ResumeTicket ticket = readResumeTicket(loginBlock.data());
+        if (resumeGraceSec > 0 && ticket.token != 0) {
+            SessionId target = lookupResumeToken(ticket.token, userName);
+            if (target != INVALID_SESSION) {
+                // 关闭阶段不关闭 fd, 而是移交给会话所在的分片
+                conn->resumeTarget = target;
+                conn->resumeSeq = ticket.lastSeq;
+                return false;
+            }
+        }
+        // 令牌已过期则按新登录处理, 客户端收到新令牌后从头计数
+        conn->resumeToken = resumeGraceSec > 0 ? newResumeToken() : 0;
+        conn->resumable = conn->resumeToken != 0;
+    }
+    conn->protocol = protocol;
+    if (conn->resumable) {
+        char token[32];
+        snprintf(token, sizeof(token), "%016llx", (unsigned long long)conn->resumeToken);
+        sendControl(conn, CONTROL_TOKEN + string(token));
+    }
+    SessionId sessionId = attachSession(conn->owner, conn);
+    if (!registerUser(conn->fd, sessionId, userName)) {
+        detachSession(conn->owner, conn);
+        string errorMsg = "用户名已存在，请重试。";
+        sendToClient(conn->fd, errorMsg);
+        if (conn->uring == nullptr) flushConnection(conn);
+        return false;
+    }
+    conn->userName = userName;
+    conn->loggedIn = true;
+    conn->userId = nextUserId++;
+    if (conn->protocol == PROTO_BINARY) binaryClients++;
+    if (conn->resumable) registerResumeToken(conn->resumeToken, sessionId, userName);
+    if (!conn->heartbeats) enableKeepalive(conn->fd);
+    // 登录期限换成心跳或空闲期限
+    checkIdle(conn->owner, conn);
+    return true;
+}
+
+// 处理解析器中已经收到的数据, 返回 false 表示连接需要关闭
+bool processBuffered(Connection* conn) {
+    if (!conn->loggedIn) {
+        if (!handleLogin(conn)) return false;
+        if (!conn->loggedIn) return true;
+    }
+    if (conn->bucket.delayUntil != 0) return true;
+    if (!dispatchMessages(conn->fd, conn->sessionId, conn->userName, conn->protocol, conn->parser, conn->bucket)) return false;
+    if (conn->bucket.delayUntil != 0) {
+        conn->owner->throttledList.push_back(conn);
+        // io_uring 的 recv 不停地收, 暂停期间要取消它, 否则数据会堆在解析器里而不是 TCP 窗口里
+        if (conn->uring != nullptr && conn->uring->recvArmed) uringCancel(conn, URING_RECV);
+    }
+    return true;
+}
+
+// 边缘触发: 必须一直读到 EAGAIN; 被限速暂停的连接先不读, 恢复时再补读.
+// 上传附件的连接每轮只读 UPLOAD_READ_BUDGET 字节, 之后借用限速的暂停列表让出, 下一轮接着读
+bool handleReadable(Connection* conn) {
+    if (conn->tlsHandshaking) {
+        int rc = tlsHandshake(conn->tls, conn->tlsUserSend, conn->tlsUserRecv);
+        if (rc <= 0) return rc == 0;
+        conn->tlsHandshaking = false;
+    }
+    size_t budget = UPLOAD_READ_BUDGET;
+    while (!conn->closing && conn->bucket.delayUntil == 0) {
+        if (conn->upload != nullptr && budget == 0) {
+            conn->bucket.delayUntil = monotonicNs();
+            conn->owner->throttledList.push_back(conn);
+            return true;
+        }
+        size_t reserve = conn->loggedIn ? recvReserve(conn->parser, conn->protocol) : (size_t)LOGIN_BLOCK_SIZE;
+        char* space = conn->parser.prepare(reserve);
+        ssize_t n = conn->tlsUserRecv ? tlsRead(conn->tls, space, conn->parser.writable(), conn->tlsOut)
+                                      : recv(conn->fd, space, conn->parser.writable(), 0);
+        if (n == 0) {
+            if (conn->loggedIn) cout << "客户端断开连接: " << conn->userName << endl;
+            return false;
+        }
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return conn->tlsOut.empty() || flushConnection(conn);
+            if (conn->loggedIn) cout << "客户端断开连接: " << conn->userName << endl;
+            return false;
+        }
+
+        conn->parser.commit(n);
+        conn->lastActive = conn->owner->timers.now;
+        countStat(STAT_BYTES_IN, n);
+        budget -= min(budget, (size_t)n);
+        if (!processBuffered(conn)) return false;
+    }
+    return true;
+}
+
+// 补发客户端缺少的帧: 序号在 lastSeq 之后的消息重新入队, 多帧批量数据只收到一部分时跳过已收到的帧.
+// 返回补发的帧数, lost 为已被淘汰出 resendLog 而无法补发的帧数
+uint64_t replayResendLog(Connection* conn, uint64_t lastSeq, uint64_t& lost) {
+    lastSeq = min(lastSeq, conn->nextSeq - 1);
+    uint64_t oldest = conn->resendLog.empty() ? conn->nextSeq : conn->resendLog.front().firstSeq;
+    lost = oldest > lastSeq + 1 ? oldest - lastSeq - 1 : 0;
+    for (size_t i = 0; i < conn->resendLog.size(); i++) {
+        const ResendEntry& entry = conn->resendLog[i];
+        if (entry.firstSeq + entry.frames - 1 <= lastSeq) continue;
+        if (entry.firstSeq > lastSeq) {
+            queueOutput(conn, entry.message);
+            continue;
+        }
+        const char* data = entry.message.payload();
+        size_t offset = 0;
+        for (uint64_t skip = lastSeq - entry.firstSeq + 1; skip > 0; skip--) {
+            offset += FRAME_HEADER_SIZE + decodeFrameHeader(data + offset);
+        }
+        queueOutput(conn, makeRawBuffer(data + offset, entry.message.payloadSize() - offset));
+    }
+    return conn->nextSeq - 1 - max(lastSeq, oldest - 1);
+}
+
+// 在会话所在的分片上把新连接接到原来的会话: 旧 fd 关闭, 未发完的数据作废, 改为按客户端的序号补发
+void resumeSession(Reactor* r, MailItem* item) {
+    Connection* conn = findSession(r, item->target);
+    if (conn == nullptr || !conn->resumable) {
+        // 查到令牌之后会话恰好过期或退出; 客户端没收到令牌就断开, 会改为重新登录
+        if (item->tls != nullptr) SSL_free(item->tls);
+        close(item->fd);
+        return;
+    }
+    if (conn->detached) {
+        removeDetached(r, conn);
+    } else {
+        // 服务器还没发现旧连接已经断开
+        if (conn->uring != nullptr) {
+            uringCancelAll(conn);
+        } else {
+            epoll_ctl(r->epollFd, EPOLL_CTL_DEL, conn->fd, nullptr);
+        }
+        if (conn->closing) r->closeList.erase(find(r->closeList.begin(), r->closeList.end(), conn));
+    }
+    // 旧套接字关闭之前丢弃附件, 恢复设置时 fd 还没有被复用
+    dropAttachments(conn);
+    connTable[conn->fd] = nullptr;
+    close(conn->fd);
+    resetOutput(conn);
+
+    conn->fd = item->fd;
+    if (item->tls != nullptr) {
+        conn->tls = item->tls;
+        conn->tlsUserSend = BIO_method_type(SSL_get_wbio(conn->tls)) == BIO_TYPE_MEM;
+        conn->tlsUserRecv = !BIO_get_ktls_recv(SSL_get_rbio(conn->tls));
+    }
+    conn->detached = false;
+    conn->closing = false;
+    conn->parser = FrameParser();
+    if (item->payload.payloadSize() > 0) {
+        memcpy(conn->parser.prepare(item->payload.payloadSize()), item->payload.payload(), item->payload.payloadSize());
+        conn->parser.commit(item->payload.payloadSize());
+    }
+    if (zeroCopyThreshold > 0 && !conn->tlsUserSend) {
+        int one = 1;
+        conn->zeroCopy = setsockopt(conn->fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0;
+    }
+    connTable[conn->fd] = conn;
+    resetIdleTimer(conn);
+    if (conn->uring != nullptr) {
+        // 旧 fd 上的请求此后完成时代数对不上, 直接丢弃
+        conn->uring->generation++;
+        uringArmRecv(conn);
+    } else {
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = conn;
+        if (epoll_ctl(r->epollFd, EPOLL_CTL_ADD, conn->fd, &ev) == -1) {
+            scheduleClose(conn);
+            return;
+        }
+    }
+
+    char token[32];
+    snprintf(token, sizeof(token), "%016llx", (unsigned long long)conn->resumeToken);
+    sendControl(conn, CONTROL_TOKEN + string(token));
+    uint64_t lost;
+    uint64_t replayed = replayResendLog(conn, item->seq, lost);
+    MessageFormatter notice;
+    notice.add("[系统消息]  已恢复连接, 补发 ").add(replayed).add(" 条消息");
+    if (lost > 0) notice.add(", 另有 ").add(lost).add(" 条消息已超出缓存无法补发");
+    sendToClient(conn->fd, notice.buffer());
+    cout << "[" << cachedTimeStamp() << "]  用户 " << conn->userName << " 续传会话, 补发 " << replayed << " 条, 丢失 " << lost << " 条" << endl;
+    if (!processBuffered(conn)) scheduleClose(conn);
+}
+
+// 为新的客户端 fd 建立连接状态并加入 epoll, 失败时关闭 fd 并返回 nullptr
+Connection* createConnection(Reactor* r, int clientSocket) {
+    Connection* conn = new Connection();
+    conn->fd = clientSocket;
+    conn->owner = r;
+    conn->loggedIn = false;
+    conn->protocol = PROTO_TEXT;
+    conn->sessionId = INVALID_SESSION;
+    conn->outHeadOffset = 0;
+    conn->outQueuedBytes = 0;
+    conn->outPeakBytes = 0;
+    conn->outDropped = 0;
+    conn->closing = false;
+    conn->zeroCopy = false;
+    conn->zcNextId = 0;
+    conn->zcSends = 0;
+    conn->zcCopied = 0;
+    conn->room = nullptr;
+    conn->roomIndex = 0;
+    conn->roomSeqFloor = 0;
+    conn->resumable = false;
+    conn->detached = false;
+    conn->resumeToken = 0;
+    conn->nextSeq = 1;
+    conn->resendBytes = 0;
+    conn->detachedAt = 0;
+    conn->resumeTarget = INVALID_SESSION;
+    conn->resumeSeq = 0;
+    conn->userId = 0;
+    conn->compress = false;
+    initTokenBucket(conn->bucket);
+    conn->uring = nullptr;
+    conn->upload = nullptr;
+    conn->streaming = false;
+    conn->idleTimer.next = nullptr;
+    conn->idleTimer.conn = conn;
+    conn->heartbeats = false;
+    conn->tls = nullptr;
+    conn->tlsHandshaking = false;
+    conn->tlsUserSend = false;
+    conn->tlsUserRecv = false;
+    if (tlsContext != nullptr) {
+        conn->tls = SSL_new(tlsContext);
+        SSL_set_fd(conn->tls, clientSocket);
+        SSL_set_accept_state(conn->tls);
+        conn->tlsHandshaking = true;
+    }
+    // TLS 连接的 SO_ZEROCOPY 要等握手后才知道内核是否接管加密, 暂不开启
+    if (zeroCopyThreshold > 0 && conn->tls == nullptr) {
+        int one = 1;
+        conn->zeroCopy = setsockopt(clientSocket, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0;
+    }
+    connTable[clientSocket] = conn;
+    resetIdleTimer(conn);
+
+    if (useIoUring) {
+        conn->uring = new UringState();
+        uringArmRecv(conn);
+        return conn;
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = conn;
+    if (epoll_ctl(r->epollFd, EPOLL_CTL_ADD, clientSocket, &ev) == -1) {
+        closeConnection(conn);
+        return nullptr;
+    }
+    return conn;
+}
+
+void acceptConnections(Reactor* r) {
+    while (true) {
+        struct sockaddr_in clientAddr;
+        socklen_t clientAddrLen = sizeof(clientAddr);
+        int clientSocket = accept4(r->listenFd, (struct sockaddr*)&clientAddr, &clientAddrLen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (clientSocket == -1) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK && serverRunning) {
+                cout << "接受客户端连接失败" << endl;
+            }
+            return;
+        }
+        if ((size_t)clientSocket >= connTable.size()) {
+            close(clientSocket);
+            continue;
+        }
+        countStat(STAT_ACCEPTS);
+        createConnection(r, clientSocket);
+    }
+}
+
+// 名字被其他节点抢先占用的会话: 通知后关闭, 不保留续传
+void kickLocal(Reactor* r, MailItem* item) {
+    Connection* conn = findSession(r, item->target);
+    if (conn == nullptr) return;
+    conn->resumable = false;
+    if (conn->detached) {
+        removeDetached(r, conn);
+        closeConnection(conn);
+    } else if (!conn->closing) {
+        sendToClient(conn->fd, item->payload);
+        scheduleClose(conn);
+    }
+}
+
+// 取走邮箱中的全部消息, 反转成投递顺序后逐条处理
+void drainMailbox(Reactor* r) {
+    uint64_t value;
+    read(r->mailEventFd, &value, sizeof(value));
+    r->mailSignaled.store(false, memory_order_release);
+
+    MailItem* list = r->mailHead.exchange(nullptr, memory_order_acquire);
+    MailItem* ordered = nullptr;
+    while (list != nullptr) {
+        MailItem* next = list->next;
+        list->next = ordered;
+        ordered = list;
+        list = next;
+    }
+
+    while (ordered != nullptr) {
+        MailItem* item = ordered;
+        ordered = item->next;
+        if (item->kind == MAIL_BROADCAST) {
+            broadcastLocal(r, item->payload, -1);
+        } else if (item->kind == MAIL_DELIVER) {
+            Connection* conn = findSession(r, item->target);
+            if (conn != nullptr) {
+                sendToClient(conn->fd, item->payload);
+            }
+        } else if (item->kind == MAIL_ROOM) {
+            publishLocal(r, item->room, item->payload, -1, item->seq);
+        } else if (item->kind == MAIL_QUEUE_REPORT) {
+            reportQueues(r);
+        } else if (item->kind == MAIL_STATS) {
+            answerStatsQuery(r, item->query);
+        } else if (item->kind == MAIL_RESUME) {
+            resumeSession(r, item);
+        } else if (item->kind == MAIL_KICK) {
+            kickLocal(r, item);
+        } else if (item->kind == MAIL_ATTACH) {
+            deliverAttachment(r, item->file);
+        }
+        delete item;
+    }
+}
+
+// 每个 reactor 自己创建 SO_REUSEPORT 监听套接字, 内核按连接哈希分配到各个分片
+int openReusePortListener() {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) return -1;
+    int optval = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval));
+    if (bind(fd, (struct sockaddr*)&serverAddr, sizeof(serverAddr)) == -1 || listen(fd, BACKLOG) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// 令牌已补足的连接恢复读取: 先处理留在解析器里的消息, 再把套接字读到 EAGAIN
+void releaseThrottled(Reactor* r) {
+    uint64_t now = monotonicNs();
+    for (size_t i = 0; i < r->throttledList.size();) {
+        Connection* conn = r->throttledList[i];
+        if (conn->bucket.delayUntil > now) {
+            i++;
+            continue;
+        }
+        r->throttledList[i] = r->throttledList.back();
+        r->throttledList.pop_back();
+        conn->bucket.delayUntil = 0;
+        if (conn->closing) continue;
+        if (conn->uring != nullptr) {
+            // 被取消的 recv 结束之前不能重新挂上, 由它的最后一个完成事件负责
+            if (!processBuffered(conn)) scheduleClose(conn);
+            else if (conn->bucket.delayUntil == 0 && !conn->uring->recvArmed) uringArmRecv(conn);
+            continue;
+        }
+        if (!processBuffered(conn) || !handleReadable(conn)) scheduleClose(conn);
+    }
+}
+
+// 有等待续传的会话时每秒醒来检查是否过期, 定时轮上有定时器时在下一个 tick 醒来,
+// 有被限速的连接时在最早的恢复时刻醒来, 有附件待续发时不等待
+int reactorTimeout(Reactor* r) {
+    if (!r->streamingList.empty()) return 0;
+    int timeout = r->detachedList.empty() ? -1 : 1000;
+    if (r->timers.armed > 0) {
+        uint64_t nowMs = monotonicNs() / 1000000;
+        uint64_t tickMs = (r->timers.now + 1) * TIMER_TICK_MS;
+        int ms = tickMs <= nowMs ? 0 : (int)(tickMs - nowMs);
+        if (timeout < 0 || ms < timeout) timeout = ms;
+    }
+    if (!r->throttledList.empty()) {
+        uint64_t now = monotonicNs();
+        uint64_t earliest = UINT64_MAX;
+        for (size_t i = 0; i < r->throttledList.size(); i++) {
+            earliest = min(earliest, r->throttledList[i]->bucket.delayUntil);
+        }
+        int ms = earliest <= now ? 0 : (int)((earliest - now + 999999) / 1000000);
+        if (timeout < 0 || ms < timeout) timeout = ms;
+    }
+    return timeout;
+}
+
+// io_uring 后端: recv 的完成事件. 数据拷进解析器后缓冲区立即归还; 多次触发的 recv 结束
+// (缓冲区用完、被取消或出错) 时, 连接仍然正常且没有被限速就重新挂上
+void uringRecvDone(Reactor* r, Connection* conn, bool stale, const struct io_uring_cqe* cqe) {
+    UringState* u = conn->uring;
+    if (cqe->res > 0 && (cqe->flags & IORING_CQE_F_BUFFER)) {
+        uint16_t bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        // 请求续传的连接在移交前收到的数据也要带走
+        bool wanted = !stale && !conn->detached
+                      && ((!conn->closing && !u->retired) || conn->resumeTarget != INVALID_SESSION);
+        if (wanted) {
+            memcpy(conn->parser.prepare(cqe->res), r->ring->bufBase + (size_t)bid * URING_BUFFER_SIZE, cqe->res);
+            conn->parser.commit(cqe->res);
+            conn->lastActive = r->timers.now;
+            countStat(STAT_BYTES_IN, cqe->res);
+        }
+        provideBuffer(r->ring, bid);
+        if (wanted && !conn->closing && !u->retired && !processBuffered(conn)) scheduleClose(conn);
+    }
+    if (cqe->flags & IORING_CQE_F_MORE) return;
+
+    u->ops--;
+    if (!stale) u->recvArmed = false;
+    if (u->retired) {
+        if (u->ops == 0) uringRelease(conn);
+        return;
+    }
+    if (stale || conn->closing || conn->detached) return;
+    if (cqe->res == 0 || (cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -ECANCELED)) {
+        if (conn->loggedIn) cout << "客户端断开连接: " << conn->userName << endl;
+        scheduleClose(conn);
+        return;
+    }
+    if (conn->bucket.delayUntil == 0) uringArmRecv(conn);
+}
+
+// 发送的完成事件: 没发完的消息放回队首, 下一轮接着发
+void uringSendDone(Connection* conn, bool stale, const struct io_uring_cqe* cqe) {
+    UringState* u = conn->uring;
+    u->ops--;
+    u->sending = false;
+    if (cqe->res > 0) countStat(STAT_BYTES_OUT, cqe->res);
+    if (!stale && !u->retired && cqe->res >= 0) {
+        size_t sent = cqe->res;
+        size_t offset = u->inFlightOffset;
+        size_t i = 0;
+        while (i < u->inFlight.size()) {
+            size_t remain = u->inFlight[i].wireSize(conn->protocol) - offset;
+            if (sent < remain) break;
+            sent -= remain;
+            offset = 0;
+            i++;
+        }
+        if (i < u->inFlight.size()) {
+            for (size_t j = u->inFlight.size(); j-- > i;) {
+                conn->outQueuedBytes += u->inFlight[j].wireSize(conn->protocol);
+                conn->outQueue.push_front(move(u->inFlight[j]));
+            }
+            conn->outHeadOffset = offset + sent;
+        }
+    }
+    u->inFlight.clear();
+    u->inFlightOffset = 0;
+    if (u->retired) {
+        if (u->ops == 0) uringRelease(conn);
+        return;
+    }
+    if (cqe->res < 0 && !stale && cqe->res != -ECANCELED && !conn->closing && !conn->detached) {
+        if (conn->loggedIn) cout << "客户端断开连接: " << conn->userName << endl;
+        scheduleClose(conn);
+        return;
+    }
+    if (!conn->outQueue.empty()) markFlush(conn);
+}
+
+void uringAccepted(Reactor* r, int clientSocket) {
+    if ((size_t)clientSocket >= connTable.size()) {
+        close(clientSocket);
+        return;
     }
-    pthread_mutex_unlock(&clientsMutex);
+    countStat(STAT_ACCEPTS);
+    createConnection(r, clientSocket);
 }
 
-string getTimeStamp() {
-    time_t now = time(0);
-    tm* localTime = localtime(&now);
-    char buffer[80];
-    strftime(buffer, 80, "%Y-%m-%d %H:%M:%S", localTime);
-    return string(buffer);
+void uringComplete(Reactor* r, const struct io_uring_cqe* cqe) {
+    uint64_t tag = cqe->user_data;
+    Connection* conn = (Connection*)(uintptr_t)(tag & URING_PTR_MASK);
+    UringOp op = (UringOp)(tag & URING_OP_MASK);
+    bool more = cqe->flags & IORING_CQE_F_MORE;
+    if (conn != nullptr) {
+        bool stale = (uint16_t)(tag >> 48) != conn->uring->generation;
+        if (op == URING_RECV) uringRecvDone(r, conn, stale, cqe);
+        else uringSendDone(conn, stale, cqe);
+    } else if (op == URING_ACCEPT) {
+        if (cqe->res >= 0) uringAccepted(r, cqe->res);
+        else if (serverRunning && cqe->res != -EAGAIN && cqe->res != -EINTR) cout << "接受客户端连接失败" << endl;
+        if (!more && serverRunning) uringArmAccept(r->ring, r->listenFd);
+    } else if (op == URING_MAIL) {
+        drainMailbox(r);
+        if (!more) uringArmPoll(r->ring, r->mailEventFd, URING_MAIL);
+    }
 }
 
-void sendPrivateMessage(int clientSocket, const char* targetUser, const char* privateMessage, const char* sender) {
-    pthread_mutex_lock(&clientsMutex);
+// io_uring 后端的事件循环: 每轮先为待发的连接准备发送请求, 再在同一次 io_uring_enter 中提交并等待
+void uringReactorLoop(Reactor* r) {
+    r->ring = createIoRing();
+    if (r->ring == nullptr) {
+        cout << "分片 " << r->id << " 创建 io_uring 失败: " << strerror(errno) << endl;
+        exit(-1);
+    }
+    IoRing* ring = r->ring;
+    uringArmAccept(ring, r->listenFd);
+    uringArmPoll(ring, r->mailEventFd, URING_MAIL);
+    uringArmPoll(ring, shutdownEventFd, URING_SHUTDOWN);
 
-    auto it = find(userNames.begin(), userNames.end(), string(targetUser));
-    if (it != userNames.end()) {
-        int targetSocket = clientSockets[it - userNames.begin()];
-        string privateMsg = "私聊 (" + string(sender) + "): " + privateMessage;
-        send(targetSocket, privateMsg.c_str(), privateMsg.size(), 0);
-        string confirmationMsg = "消息已发送给 " + string(targetUser);
-        send(clientSocket, confirmationMsg.c_str(), confirmationMsg.size(), 0); 
-    } else {
-        string errorMsg = "用户 " + string(targetUser) + " 不在线或不存在";
-        send(clientSocket, errorMsg.c_str(), errorMsg.size(), 0);
+    while (serverRunning) {
+        uringFlushPending(r);
+        submitRing(ring, 1, reactorTimeout(r));
+        syncTimerClock(r->timers);
+
+        unsigned head = *ring->cqHead;
+        unsigned tail = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            uringComplete(r, &ring->cqes[head & ring->cqMask]);
+        }
+        __atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+
+        if (!r->throttledList.empty()) releaseThrottled(r);
+        expireTimers(r);
+        processCloseList(r);
+        if (!r->detachedList.empty()) expireDetached(r);
     }
-    pthread_mutex_unlock(&clientsMutex);
 }
 
-void* handleClient(void* arg) {
-    int clientSocket = *(int*)arg;
-    char buffer[BUFFER_SIZE];
-    char userName[50];
-    recv(clientSocket, userName, sizeof(userName), 0);
-    pthread_mutex_lock(&clientsMutex);
-    
-    //防止重复用户名
-    if (find(userNames.begin(), userNames.end(), string(userName)) != userNames.end()) {
-        string errorMsg = "用户名已存在，请重试。";
-        send(clientSocket, errorMsg.c_str(), errorMsg.size(), 0);
-        close(clientSocket);
-        pthread_mutex_unlock(&clientsMutex);
-        return nullptr;  // 结束线程
+void* reactorLoop(void* arg) {
+    Reactor* r = (Reactor*)arg;
+    currentReactor = r;
+    if (useIoUring) {
+        uringReactorLoop(r);
+        return nullptr;
     }
-    pthread_mutex_unlock(&clientsMutex);
-
-    string joinMessage = "欢迎" + string(userName) + "加入了聊天";
-    broadcastMessage("[" + getTimeStamp() + "]  " + joinMessage, clientSocket);
 
-    pthread_mutex_lock(&clientsMutex);
-    clientSockets.push_back(clientSocket);
-    userNames.push_back(userName);
-    pthread_mutex_unlock(&clientsMutex);
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = nullptr;
+    epoll_ctl(r->epollFd, EPOLL_CTL_ADD, r->listenFd, &ev);
+    ev.data.ptr = &r->mailEventFd;
+    epoll_ctl(r->epollFd, EPOLL_CTL_ADD, r->mailEventFd, &ev);
+    ev.data.ptr = &shutdownEventFd;
+    epoll_ctl(r->epollFd, EPOLL_CTL_ADD, shutdownEventFd, &ev);
 
-    cout << "[" + getTimeStamp() + "]  " + "用户 " << userName << " 已经连接到服务器" << endl;
+    // 热重启接管的连接里可能已经有完整的消息, 不会再触发 EPOLLIN
+    for (size_t i = 0; i < r->resumeList.size(); i++) {
+        if (!r->resumeList[i]->closing && !processBuffered(r->resumeList[i])) {
+            scheduleClose(r->resumeList[i]);
+        }
+    }
+    r->resumeList.clear();
+    processCloseList(r);
 
-    while (true) {
-        memset(buffer, 0, BUFFER_SIZE);
-        int bytesReceived = recv(clientSocket, buffer, BUFFER_SIZE, 0);
-        if (bytesReceived <= 0) {
-            cout << "客户端断开连接: " << userName << endl;
+    struct epoll_event events[MAX_EVENTS];
+    while (serverRunning && !handoffPending) {
+        int n = epoll_wait(r->epollFd, events, MAX_EVENTS, reactorTimeout(r));
+        if (n < 0) {
+            if (errno == EINTR) continue;
             break;
         }
+        syncTimerClock(r->timers);
+        for (int i = 0; i < n; i++) {
+            void* ptr = events[i].data.ptr;
+            if (ptr == &shutdownEventFd) continue;
+            if (ptr == nullptr) {
+                acceptConnections(r);
+                continue;
+            }
+            if (ptr == &r->mailEventFd) {
+                drainMailbox(r);
+                continue;
+            }
 
-        if (strlen(buffer) > 0) {
-            if (buffer[0] == '@') {
-                string message(buffer);
-                size_t spacePos = message.find(' ');
-                if (spacePos != string::npos) {
-                    string targetUser = message.substr(1, spacePos - 1);  // 提取目标用户名
-                    string privateMessage = message.substr(spacePos + 1); // 提取私聊内容
-                    sendPrivateMessage(clientSocket, targetUser.c_str(), privateMessage.c_str(), userName);
-                } else {
-                    string errorMsg = "无效的私聊格式，使用 @用户名 消息";
-                    send(clientSocket, errorMsg.c_str(), errorMsg.size(), 0);
-                }
-            } 
-            else if (strcmp(buffer, "list") == 0) {
-                int userCount = userNames.size();
-                string onlineUsers = "在线用户人数: " + to_string(userCount) + "\n";
-                for (size_t i = 0; i < userNames.size(); ++i) {
-                    onlineUsers += to_string(i + 1) + ". " + userNames[i] + "\n";
-                }
-                send(clientSocket, onlineUsers.c_str(), onlineUsers.size(), 0);
-                cout << "[" + getTimeStamp() + "]  " + "用户 " << userName << " 请求用户列表" << endl;
-            }
-            else if(strcmp(buffer, "quit") == 0) {
-                pthread_mutex_lock(&clientsMutex);
-                clientSockets.erase(remove(clientSockets.begin(), clientSockets.end(), clientSocket), clientSockets.end());
-                userNames.erase(remove(userNames.begin(), userNames.end(), string(userName)), userNames.end());
-                pthread_mutex_unlock(&clientsMutex);
-                string leaveMessage = string(userName) + " 离开了聊天";
-                broadcastMessage( "[" + getTimeStamp() + "]  " + leaveMessage, -1);
-                cout << "[" + getTimeStamp() + "]  " + "用户 " << userName << " 退出" << endl;
-                break;
+            Connection* conn = (Connection*)ptr;
+            if (conn->closing) continue;
+            bool alive = true;
+            if (events[i].events & EPOLLIN) {
+                alive = handleReadable(conn);
+            }
+            if (alive && (((events[i].events & EPOLLERR) && !handleSocketError(conn)) || (events[i].events & EPOLLHUP))) {
+                if (conn->loggedIn) cout << "客户端断开连接: " << conn->userName << endl;
+                alive = false;
+            }
+            if (alive && !conn->closing && (events[i].events & EPOLLOUT)) {
+                alive = conn->tlsHandshaking ? handleReadable(conn) : flushConnection(conn);
             }
-            else {
-                cout << "[" + getTimeStamp() + "]  " + "(" << userName << "): " << buffer << endl;
-                broadcastMessage(string(userName) + ": " + buffer, clientSocket);
+            if (!alive) {
+                scheduleClose(conn);
             }
         }
+        if (!r->throttledList.empty()) releaseThrottled(r);
+        if (!r->streamingList.empty()) continueStreams(r);
+        expireTimers(r);
+        processCloseList(r);
+        if (!r->detachedList.empty()) expireDetached(r);
     }
 
-    close(clientSocket);
-
     return nullptr;
 }
 
@@ -147,30 +6110,629 @@ void sendDummyConnection() {
 
     struct sockaddr_in dummyAddr;
     dummyAddr.sin_family = AF_INET;
-    dummyAddr.sin_port = htons(SERVER_PORT);
+    dummyAddr.sin_port = htons(serverPort);
     dummyAddr.sin_addr.s_addr = inet_addr("127.0.0.1");
 
     connect(dummySocket, (struct sockaddr*)&dummyAddr, sizeof(dummyAddr));
     close(dummySocket);  // 立即关闭连接
 }
 
+// ==================== 热重启 ====================
+
+// 控制台输入 upgrade 后, 旧进程 fork+exec 新程序, 通过 Unix 域套接字用 SCM_RIGHTS 把监听套接字和
+// 全部客户端连接交给新进程, 连同未处理的输入、未发完的输出、用户名、所在房间和房间历史.
+// 监听套接字始终打开, 交接期间到达的连接留在 accept 队列里; 客户端不需要重连.
+// 交接任何一步失败, 旧进程杀掉新进程并恢复 reactor, 继续服务
+
+enum HandoffType { HANDOFF_LISTENERS = 1, HANDOFF_ROOMS, HANDOFF_CONNS, HANDOFF_DONE, HANDOFF_MAILBOXES };
+
+const int HANDOFF_BATCH = 200;          // 每条消息携带的 fd 上限, 内核限制 SCM_RIGHTS 最多 253 个
+const int HANDOFF_READY_MS = 5000;      // 等待新进程就绪
+const int HANDOFF_ACK_MS = 10000;       // 等待新进程确认接管
+
+struct HandoffHeader {
+    uint32_t type;
+    uint32_t count;     // 随本消息传递的 fd 数
+    uint32_t blobLen;   // 紧跟在头部之后的数据长度
+};
+
+pid_t handoffChild = -1;
+int handoffSocket = -1;
+bool handedOff = false;     // 已交接成功, 旧进程退出时不再清理新进程仍在使用的资源
+
+void putU8(string& out, uint8_t value) {
+    out.push_back((char)value);
+}
+
+void putU32(string& out, uint32_t value) {
+    out.append((const char*)&value, sizeof(value));
+}
+
+void putU64(string& out, uint64_t value) {
+    out.append((const char*)&value, sizeof(value));
+}
+
+void putBytes8(string& out, string_view data) {
+    putU8(out, data.size());
+    out.append(data.data(), data.size());
+}
+
+void putBytes32(string& out, string_view data) {
+    putU32(out, data.size());
+    out.append(data.data(), data.size());
+}
+
+// 顺序读取交接数据, 越界后 ok 置为 false, 之后的读取都返回空值
+struct BlobReader {
+    const string& data;
+    size_t pos;
+    bool ok;
+
+    explicit BlobReader(const string& blob) : data(blob), pos(0), ok(true) {}
+
+    string_view bytes(size_t len) {
+        if (!ok || data.size() - pos < len) {
+            ok = false;
+            return string_view();
+        }
+        string_view out(data.data() + pos, len);
+        pos += len;
+        return out;
+    }
+    uint8_t u8() {
+        string_view b = bytes(1);
+        return ok ? (uint8_t)b[0] : 0;
+    }
+    uint32_t u32() {
+        uint32_t value = 0;
+        string_view b = bytes(sizeof(value));
+        if (ok) memcpy(&value, b.data(), sizeof(value));
+        return value;
+    }
+    uint64_t u64() {
+        uint64_t value = 0;
+        string_view b = bytes(sizeof(value));
+        if (ok) memcpy(&value, b.data(), sizeof(value));
+        return value;
+    }
+    string_view bytes8() { return bytes(u8()); }
+    string_view bytes32() { return bytes(u32()); }
+};
+
+bool readAll(int fd, char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = read(fd, data, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+// 头部和 fd 一起用 sendmsg 发出, 数据部分随后写出
+bool sendHandoff(int sock, uint32_t type, const vector<int>& fds, const string& blob) {
+    HandoffHeader header = {type, (uint32_t)fds.size(), (uint32_t)blob.size()};
+    struct iovec iov = {&header, sizeof(header)};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    vector<char> control(CMSG_SPACE(sizeof(int) * fds.size()));
+    if (!fds.empty()) {
+        msg.msg_control = control.data();
+        msg.msg_controllen = control.size();
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+        memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * fds.size());
+    }
+    if (sendmsg(sock, &msg, MSG_NOSIGNAL) != (ssize_t)sizeof(header)) return false;
+    return writeAll(sock, blob.data(), blob.size());
+}
+
+// 收到的 fd 无论成功与否都放进 fds, 失败时由调用者关闭
+bool recvHandoff(int sock, HandoffHeader& header, vector<int>& fds, string& blob) {
+    struct iovec iov = {&header, sizeof(header)};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    vector<char> control(CMSG_SPACE(sizeof(int) * HANDOFF_BATCH));
+    msg.msg_control = control.data();
+    msg.msg_controllen = control.size();
+
+    ssize_t n;
+    do {
+        n = recvmsg(sock, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+    } while (n < 0 && errno == EINTR);
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); n > 0 && cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+        size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        const char* data = (const char*)CMSG_DATA(cmsg);
+        for (size_t i = 0; i < count; i++) {
+            int fd;
+            memcpy(&fd, data + i * sizeof(int), sizeof(int));
+            fds.push_back(fd);
+        }
+    }
+    if (n != (ssize_t)sizeof(header) || (msg.msg_flags & MSG_CTRUNC) || fds.size() != header.count) return false;
+    blob.resize(header.blobLen);
+    return readAll(sock, &blob[0], blob.size());
+}
+
+// 等待对端发来一个约定的字节
+bool waitHandoffByte(int sock, char expected, int timeoutMs) {
+    struct pollfd pfd = {sock, POLLIN, 0};
+    if (poll(&pfd, 1, timeoutMs) != 1) return false;
+    char byte;
+    return read(sock, &byte, 1) == 1 && byte == expected;
+}
+
+// 启动新进程, 参数与当前进程相同, 另加 --takeover-fd 指明交接用的套接字
+pid_t spawnSuccessor(const string& path, int& sock) {
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) == -1) return -1;
+
+    // fork 之后只调用异步信号安全的函数, 参数提前准备好
+    vector<string> args;
+    args.push_back(path);
+    args.insert(args.end(), serverArgs.begin(), serverArgs.end());
+    args.push_back("--takeover-fd");
+    args.push_back(to_string(pair[1]));
+    vector<char*> argv;
+    for (size_t i = 0; i < args.size(); i++) argv.push_back(&args[i][0]);
+    argv.push_back(nullptr);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        fcntl(pair[1], F_SETFD, 0);
+        execv(path.c_str(), argv.data());
+        _exit(127);
+    }
+    close(pair[1]);
+    if (pid == -1) {
+        close(pair[0]);
+        return -1;
+    }
+    sock = pair[0];
+    return pid;
+}
+
+void abortSuccessor(pid_t pid, int sock) {
+    kill(pid, SIGKILL);
+    waitpid(pid, nullptr, 0);
+    close(sock);
+}
+
+// 控制台线程调用: 新进程就绪后暂停 reactor, 由 runReactors 完成交接; 失败时恢复后才返回
+void upgradeServer(const string& path) {
+    if (serverMode != MODE_EPOLL) {
+        cout << "只有 epoll 模式支持热重启" << endl;
+        return;
+    }
+    // 中继端口和对端链路不在交接范围内
+    if (relayPort != 0) {
+        cout << "联邦节点不支持热重启" << endl;
+        return;
+    }
+    if (useIoUring) {
+        cout << "io_uring 后端不支持热重启" << endl;
+        return;
+    }
+    // 会话密钥在 OpenSSL 和内核里, 无法随 fd 交给新进程
+    if (tlsContext != nullptr) {
+        cout << "TLS 会话不支持热重启" << endl;
+        return;
+    }
+    int sock;
+    pid_t pid = spawnSuccessor(path, sock);
+    if (pid == -1) {
+        cout << "启动新进程失败: " << strerror(errno) << endl;
+        return;
+    }
+    if (!waitHandoffByte(sock, 'R', HANDOFF_READY_MS)) {
+        cout << "新进程 " << path << " 未能就绪, 放弃热重启" << endl;
+        abortSuccessor(pid, sock);
+        return;
+    }
+    cout << "新进程 " << pid << " 已就绪, 开始交接" << endl;
+    handoffChild = pid;
+    handoffSocket = sock;
+    handoffPending = true;
+    uint64_t one = 1;
+    write(shutdownEventFd, &one, sizeof(one));
+    // 交接成功后本进程直接退出; 期间不再读取控制台, 输入留给新进程
+    while (handoffPending) usleep(10000);
+}
+
+string encodeRooms() {
+    string blob;
+    for (int i = 0; i < DIRECTORY_STRIPES; i++) {
+        pthread_mutex_lock(&roomDirectory[i].mutex);
+        for (auto& entry : roomDirectory[i].rooms) {
+            RoomEntry* room = entry.second;
+            RoomHistory& h = room->history;
+            pthread_mutex_lock(&h.mutex);
+            putBytes8(blob, room->name);
+            putU64(blob, h.nextSeq);
+            putU32(blob, h.records.size());
+            for (size_t j = 0; j < h.records.size(); j++) {
+                char header[FRAME_HEADER_SIZE];
+                ringRead(h, h.records[j], header, FRAME_HEADER_SIZE);
+                string payload(decodeFrameHeader(header), '\0');
+                ringRead(h, (h.records[j] + FRAME_HEADER_SIZE) % h.ring.size(), &payload[0], payload.size());
+                putBytes32(blob, payload);
+            }
+            pthread_mutex_unlock(&h.mutex);
+        }
+        pthread_mutex_unlock(&roomDirectory[i].mutex);
+    }
+    return blob;
+}
+
+// [登录过的用户数][用户名...], 再逐个信箱 [收件人][条数][每条消息的负载][发送者数][发送者][字节数]...,
+// 落盘的消息也读出来一起交给新进程; 交接失败时旧进程照常使用信箱
+string encodeMailboxes() {
+    string blob;
+    pthread_mutex_lock(&mailboxStore.mutex);
+    if (mailboxStore.knownUsers.empty()) {
+        pthread_mutex_unlock(&mailboxStore.mutex);
+        return blob;
+    }
+    putU32(blob, mailboxStore.knownOrder.size());
+    for (const string& name : mailboxStore.knownOrder) putBytes8(blob, name);
+    for (auto& entry : mailboxStore.boxes) {
+        const Mailbox& box = entry.second;
+        string records(box.memoryBytes + box.spillBytes, '\0');
+        records.resize(mailboxCopy(box, &records[0]));
+        uint32_t count = 0;
+        for (size_t pos = 0; pos + FRAME_HEADER_SIZE <= records.size(); pos += FRAME_HEADER_SIZE + decodeFrameHeader(records.data() + pos)) {
+            count++;
+        }
+        putBytes8(blob, entry.first);
+        putU32(blob, count);
+        for (size_t pos = 0; pos + FRAME_HEADER_SIZE <= records.size();) {
+            size_t len = decodeFrameHeader(records.data() + pos);
+            putBytes32(blob, string_view(records.data() + pos + FRAME_HEADER_SIZE, len));
+            pos += FRAME_HEADER_SIZE + len;
+        }
+        putU32(blob, box.senders.size());
+        for (auto& sent : box.senders) {
+            putBytes8(blob, sent.first);
+            putU32(blob, sent.second);
+        }
+    }
+    pthread_mutex_unlock(&mailboxStore.mutex);
+    return blob;
+}
+
+void encodeConnection(string& blob, Connection* conn) {
+    putU8(blob, conn->owner->id);
+    putU8(blob, conn->loggedIn);
+    putU8(blob, conn->protocol);
+    putBytes8(blob, conn->loggedIn ? conn->userName : string());
+    putBytes8(blob, conn->room != nullptr ? conn->room->name : string());
+    putBytes32(blob, conn->parser.peekAll());
+    size_t outLen = conn->outQueuedBytes - conn->outHeadOffset;
+    putU32(blob, outLen);
+    for (size_t i = 0; i < conn->outQueue.size(); i++) {
+        size_t offset = i == 0 ? conn->outHeadOffset : 0;
+        blob.append(conn->outQueue[i].wireData(conn->protocol) + offset, conn->outQueue[i].wireSize(conn->protocol) - offset);
+    }
+    putU32(blob, conn->userId);
+    putU8(blob, conn->compress);
+    // 续传会话的序号和 resendLog, 等待续传的会话也一起交接
+    putU8(blob, conn->resumable);
+    putU8(blob, conn->detached);
+    putU64(blob, conn->resumeToken);
+    putU64(blob, conn->nextSeq);
+    putU32(blob, conn->resendLog.size());
+    for (size_t i = 0; i < conn->resendLog.size(); i++) {
+        const ResendEntry& entry = conn->resendLog[i];
+        putU64(blob, entry.firstSeq);
+        putBytes32(blob, string_view(entry.message.wireData(PROTO_FRAMED), entry.message.wireSize(PROTO_FRAMED)));
+    }
+}
+
+// 投递邮箱里剩下的消息, 让它们随发送队列一起交接; 关闭连接时的通知可能又产生新的邮件
+void drainForHandoff() {
+    bool pendingMail = true;
+    while (pendingMail) {
+        pendingMail = false;
+        for (size_t i = 0; i < reactors.size(); i++) {
+            if (reactors[i]->mailHead.load(memory_order_acquire) == nullptr && reactors[i]->closeList.empty()) continue;
+            pendingMail = true;
+            currentReactor = reactors[i];
+            drainMailbox(reactors[i]);
+            processCloseList(reactors[i]);
+        }
+    }
+    currentReactor = nullptr;
+}
+
+// 主线程在 reactor 全部退出后调用, 此时所有连接状态都可以直接读取
+bool handOffState() {
+    // 邮箱里可能还有待下发的附件, 先投递完再停附件; 停附件时给发送者的通知再投递一轮
+    drainForHandoff();
+    int stoppedTransfers = 0;
+    for (size_t fd = 0; fd < connTable.size(); fd++) {
+        Connection* conn = connTable[fd];
+        if (conn != nullptr && !conn->closing) stoppedTransfers += stopAttachmentsForHandoff(conn);
+    }
+    drainForHandoff();
+    flushChatLog();
+
+    int sock = handoffSocket;
+    vector<int> fds;
+    for (size_t i = 0; i < reactors.size(); i++) fds.push_back(reactors[i]->listenFd);
+    bool ok = sendHandoff(sock, HANDOFF_LISTENERS, fds, string())
+              && sendHandoff(sock, HANDOFF_ROOMS, vector<int>(), encodeRooms());
+
+    size_t handed = 0;
+    string blob;
+    fds.clear();
+    for (size_t fd = 0; fd < connTable.size() && ok; fd++) {
+        Connection* conn = connTable[fd];
+        if (conn == nullptr || conn->closing) continue;
+        fds.push_back(conn->fd);
+        encodeConnection(blob, conn);
+        if (fds.size() == (size_t)HANDOFF_BATCH) {
+            ok = sendHandoff(sock, HANDOFF_CONNS, fds, blob);
+            handed += fds.size();
+            fds.clear();
+            blob.clear();
+        }
+    }
+    if (ok && !fds.empty()) {
+        ok = sendHandoff(sock, HANDOFF_CONNS, fds, blob);
+        handed += fds.size();
+    }
+    string mailboxes = ok ? encodeMailboxes() : string();
+    ok = ok && (mailboxes.empty() || sendHandoff(sock, HANDOFF_MAILBOXES, vector<int>(), mailboxes));
+    ok = ok && sendHandoff(sock, HANDOFF_DONE, vector<int>(), string()) && waitHandoffByte(sock, 'A', HANDOFF_ACK_MS);
+
+    if (!ok) {
+        abortSuccessor(handoffChild, sock);
+        if (stoppedTransfers > 0) cout << "热重启失败, 交接前取消的 " << stoppedTransfers << " 个附件传输不会恢复, 需要重新发送" << endl;
+        return false;
+    }
+    close(sock);
+    cout << "已把 " << handed << " 个连接交给新进程 " << handoffChild << ", 旧进程退出" << endl;
+    return true;
+}
+
+void restoreRooms(const string& blob) {
+    BlobReader in(blob);
+    while (in.ok && in.pos < blob.size()) {
+        string name(in.bytes8());
+        uint64_t nextSeq = in.u64();
+        uint32_t count = in.u32();
+        if (!in.ok) break;
+        RoomEntry* room = findOrCreateRoom(name, reactors.size());
+        if (room == nullptr) {
+            for (uint32_t i = 0; i < count && in.ok; i++) in.bytes32();
+            continue;
+        }
+        pthread_mutex_lock(&room->history.mutex);
+        for (uint32_t i = 0; i < count && in.ok; i++) {
+            string_view payload = in.bytes32();
+            if (in.ok) recordHistory(room->history, makeBuffer(payload.data(), payload.size()));
+        }
+        room->history.nextSeq = nextSeq;
+        pthread_mutex_unlock(&room->history.mutex);
+    }
+}
+
+// 新进程的信箱预算可能比旧进程小, 放不下的消息丢弃; 发送者的额度按旧进程的记账恢复, 信箱取走后一并扣除
+void restoreMailboxes(const string& blob) {
+    BlobReader in(blob);
+    size_t dropped = 0;
+    pthread_mutex_lock(&mailboxStore.mutex);
+    uint32_t known = in.u32();
+    for (uint32_t i = 0; i < known && in.ok; i++) {
+        string name(in.bytes8());
+        if (in.ok && mailboxBytes > 0) rememberMailboxUser(name);
+    }
+    while (in.ok && in.pos < blob.size()) {
+        string recipient(in.bytes8());
+        uint32_t count = in.u32();
+        for (uint32_t i = 0; i < count && in.ok; i++) {
+            string_view payload = in.bytes32();
+            if (!in.ok) break;
+            BufferRef record = makeBuffer(payload.data(), payload.size());
+            if (mailboxBytes == 0 || !mailboxStoreRecord(recipient, string(), record.wireData(PROTO_FRAMED), record.wireSize(PROTO_FRAMED))) {
+                dropped++;
+            }
+        }
+        uint32_t senders = in.u32();
+        auto box = mailboxStore.boxes.find(recipient);
+        for (uint32_t i = 0; i < senders && in.ok; i++) {
+            string sender(in.bytes8());
+            uint32_t bytes = in.u32();
+            if (!in.ok || box == mailboxStore.boxes.end()) continue;
+            box->second.senders[sender] += bytes;
+            mailboxStore.senderBytes[sender] += bytes;
+        }
+    }
+    pthread_mutex_unlock(&mailboxStore.mutex);
+    if (dropped > 0) cout << "信箱空间不足, 丢弃了 " << dropped << " 条交接来的离线私聊" << endl;
+}
+
+// 接管旧进程的一个连接: 恢复收发缓冲区, 已登录的重新占用用户名并回到原来的房间
+bool adoptConnection(int fd, BlobReader& in) {
+    uint8_t shard = in.u8();
+    bool loggedIn = in.u8() != 0;
+    int protocol = in.u8();
+    string userName(in.bytes8());
+    string roomName(in.bytes8());
+    string_view input = in.bytes32();
+    string_view output = in.bytes32();
+    uint32_t userId = in.u32();
+    bool compress = in.u8() != 0;
+    bool resumable = in.u8() != 0;
+    bool detached = in.u8() != 0;
+    uint64_t resumeToken = in.u64();
+    uint64_t nextSeq = in.u64();
+    deque<ResendEntry> resendLog;
+    for (uint32_t count = in.u32(); count > 0 && in.ok; count--) {
+        uint64_t firstSeq = in.u64();
+        string_view wire = in.bytes32();
+        if (!in.ok) break;
+        // 按分帧格式原样保存, 帧数重新计算
+        BufferRef message = makeRawBuffer(wire.data(), wire.size());
+        resendLog.push_back(ResendEntry{firstSeq, countFrames(message), message});
+    }
+    if (!in.ok) {
+        close(fd);
+        return false;
+    }
+
+    Connection* conn = createConnection(reactors[shard % reactors.size()], fd);
+    if (conn == nullptr) return true;
+    conn->protocol = protocol;
+    conn->compress = compress;
+    if (!input.empty()) {
+        memcpy(conn->parser.prepare(input.size()), input.data(), input.size());
+        conn->parser.commit(input.size());
+    }
+    if (!output.empty()) {
+        conn->outQueue.push_back(makeRawBuffer(output.data(), output.size()));
+        conn->outQueuedBytes = output.size();
+        conn->outPeakBytes = output.size();
+    }
+    if (loggedIn) {
+        conn->userName = userName;
+        conn->loggedIn = true;
+        attachSession(conn->owner, conn);
+        if (!claimName(userName, conn->sessionId)) {
+            closeConnection(conn);
+            return true;
+        }
+        countStat(STAT_LOGINS);
+        // 编号保持不变, 其他客户端已经按编号认识这个用户; 新连接上重新介绍一遍即可
+        conn->userId = userId;
+        if (userId >= nextUserId) nextUserId = userId + 1;
+        if (protocol == PROTO_BINARY) binaryClients++;
+        conn->heartbeats = resumable || protocol == PROTO_BINARY;
+        if (resumable) {
+            conn->resumable = true;
+            conn->resumeToken = resumeToken;
+            conn->nextSeq = nextSeq;
+            conn->resendLog.swap(resendLog);
+            for (size_t i = 0; i < conn->resendLog.size(); i++) {
+                conn->resendBytes += conn->resendLog[i].message.wireSize(PROTO_FRAMED);
+            }
+            registerResumeToken(resumeToken, conn->sessionId, userName);
+        }
+        if (!roomName.empty()) {
+            RoomEntry* room = findOrCreateRoom(roomName, reactors.size());
+            if (room == nullptr) room = findOrCreateRoom(LOBBY_ROOM, reactors.size());
+            pthread_mutex_lock(&room->history.mutex);
+            subscribeLocal(conn, room);
+            conn->roomSeqFloor = room->history.nextSeq - 1;
+            pthread_mutex_unlock(&room->history.mutex);
+        }
+        checkIdle(conn->owner, conn);
+    }
+    if (loggedIn && resumable && detached) {
+        detachConnection(conn);
+        return true;
+    }
+    conn->owner->resumeList.push_back(conn);
+    return true;
+}
+
+// 新进程启动时调用, 需在 reactor 创建之后、reactor 线程启动之前
+bool takeOverState() {
+    if (write(takeoverFd, "R", 1) != 1) return false;
+
+    size_t adopted = 0;
+    HandoffHeader header;
+    vector<int> fds;
+    string blob;
+    while (true) {
+        fds.clear();
+        if (!recvHandoff(takeoverFd, header, fds, blob)) {
+            for (size_t i = 0; i < fds.size(); i++) close(fds[i]);
+            cout << "从旧进程接收状态失败" << endl;
+            return false;
+        }
+        if (header.type == HANDOFF_LISTENERS) {
+            for (size_t i = 0; i < fds.size(); i++) {
+                if (i < reactors.size()) reactors[i]->listenFd = fds[i];
+                else close(fds[i]);
+            }
+        } else if (header.type == HANDOFF_ROOMS) {
+            restoreRooms(blob);
+        } else if (header.type == HANDOFF_CONNS) {
+            BlobReader in(blob);
+            for (size_t i = 0; i < fds.size(); i++) {
+                if (adoptConnection(fds[i], in)) adopted++;
+            }
+        } else if (header.type == HANDOFF_MAILBOXES) {
+            restoreMailboxes(blob);
+        } else {
+            break;
+        }
+    }
+    // 新进程的分片数可能比旧进程多
+    for (size_t i = 0; i < reactors.size(); i++) {
+        if (reactors[i]->listenFd == -1) reactors[i]->listenFd = openReusePortListener();
+        if (reactors[i]->listenFd == -1) return false;
+    }
+    // 旧进程已把日志刷盘, 新进程从下一个段号开始写, 房间历史已随交接恢复
+    if (!startChatLog(false)) return false;
+    if (write(takeoverFd, "A", 1) != 1) return false;
+    close(takeoverFd);
+    takeoverFd = -1;
+    cout << "已从旧进程接管 " << adopted << " 个连接" << endl;
+    return true;
+}
+
 void* monitorServerInput(void* arg) {
     string input;
     while (true) {
-        getline(cin, input); 
+        if (!getline(cin, input)) break;
         if (input == "exit") {
             serverRunning = false;
-            close(serverSocket); 
-            sendDummyConnection(); 
+            if (serverMode != MODE_THREAD) {
+                uint64_t one = 1;
+                write(shutdownEventFd, &one, sizeof(one));
+            } else {
+                close(serverSocket);
+                sendDummyConnection();
+            }
             cout << "服务器关闭" << endl;
             break;
+        } else if (input == "stats") {
+            cout << buildStatsReport() << flush;
+        } else if (input.compare(0, 7, "search ") == 0) {
+            cout << runSearch(string_view(input).substr(7)) << endl;
+        } else if (input == "upgrade" || input.compare(0, 8, "upgrade ") == 0) {
+            upgradeServer(input.size() > 8 ? input.substr(8) : serverBinaryPath);
+        } else if (input == "queues" && serverMode == MODE_EPOLL) {
+            for (size_t i = 0; i < reactors.size(); i++) {
+                MailItem* item = new MailItem();
+                item->kind = MAIL_QUEUE_REPORT;
+                item->target = INVALID_SESSION;
+                postMail(reactors[i], item);
+            }
         } else{
-            broadcastMessage( "[" + getTimeStamp() + "]  " + "[系统消息]  " + input, -1);
+            broadcastMessage(MessageFormatter().timestamp().add("[系统消息]  ").add(input).buffer(), -1);
         }
     }
     return nullptr;
 }
 
+// 创建监听服务器输入的线程, 需在监听套接字和 reactor 就绪之后
+void startInputThread() {
+    pthread_t inputThread;
+    pthread_create(&inputThread, nullptr, monitorServerInput, nullptr);
+    pthread_detach(inputThread);
+}
+
 bool createServerSocket() {
     serverSocket = socket(AF_INET, SOCK_STREAM, 0);
     if (serverSocket == -1) {
@@ -184,11 +6746,22 @@ void bindAddress() {
     int optval = 1;
     setsockopt(serverSocket, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
     serverAddr.sin_family = AF_INET;
-    serverAddr.sin_port = htons(SERVER_PORT);
+    serverAddr.sin_port = htons(serverPort);
     serverAddr.sin_addr.s_addr = INADDR_ANY;
 }
 
-void startServer() {
+size_t maxOpenFiles() {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY) {
+        return rl.rlim_cur;
+    }
+    return 65536;
+}
+
+void runThreadPerClient() {
+    fdProtocol.assign(maxOpenFiles(), PROTO_TEXT);
+    blockingOutputs = vector<atomic<BlockingOutput*>>(fdProtocol.size());
+
     if (bind(serverSocket, (struct sockaddr*)&serverAddr, sizeof(serverAddr)) == -1) {
         cout << "绑定地址失败" << endl;
         close(serverSocket);
@@ -201,12 +6774,14 @@ void startServer() {
         exit(-1);
     }
 
+    if (!startChatLog(true)) {
+        close(serverSocket);
+        exit(-1);
+    }
     cout << "服务器启动，等待客户端连接..." << endl;
-
-    // 创建监听服务器输入的线程
-    pthread_t inputThread;
-    pthread_create(&inputThread, nullptr, monitorServerInput, nullptr);
-    pthread_detach(inputThread);
+    startStatsService();
+    if (!startFederation()) exit(-1);
+    startInputThread();
 
     while (serverRunning) {  // 检查 serverRunning 状态
         struct sockaddr_in clientAddr;
@@ -219,23 +6794,377 @@ void startServer() {
             cout << "接受客户端连接失败" << endl;
             continue;
         }
+        if ((size_t)clientSocket >= fdProtocol.size()) {
+            close(clientSocket);
+            continue;
+        }
+        countStat(STAT_ACCEPTS);
 
+        // fd 按值传入, 避免下一次 accept 覆盖
         pthread_t tid;
-        pthread_create(&tid, nullptr, handleClient, &clientSocket);
+        pthread_create(&tid, nullptr, handleClient, (void*)(intptr_t)clientSocket);
         pthread_detach(tid);
     }
 }
 
-int main() {
+void runWorkerPool() {
+    fdProtocol.assign(maxOpenFiles(), PROTO_TEXT);
+    blockingOutputs = vector<atomic<BlockingOutput*>>(fdProtocol.size());
+    int workers = reactorCount;
+    if (workers <= 0) {
+        workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+        if (workers <= 0) workers = 1;
+    }
+
+    if (bind(serverSocket, (struct sockaddr*)&serverAddr, sizeof(serverAddr)) == -1 || listen(serverSocket, BACKLOG) == -1
+        || fcntl(serverSocket, F_SETFL, fcntl(serverSocket, F_GETFL) | O_NONBLOCK) == -1) {
+        cout << "绑定地址失败" << endl;
+        close(serverSocket);
+        exit(-1);
+    }
+    shutdownEventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    poolWakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    poolEpollFd = epoll_create1(EPOLL_CLOEXEC);
+    poolWriteEpollFd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = nullptr;
+    epoll_ctl(poolEpollFd, EPOLL_CTL_ADD, serverSocket, &ev);
+    ev.data.ptr = &poolWakeFd;
+    epoll_ctl(poolEpollFd, EPOLL_CTL_ADD, poolWakeFd, &ev);
+    ev.data.ptr = &poolWriteEpollFd;
+    epoll_ctl(poolEpollFd, EPOLL_CTL_ADD, poolWriteEpollFd, &ev);
+    ev.data.ptr = &shutdownEventFd;
+    epoll_ctl(poolEpollFd, EPOLL_CTL_ADD, shutdownEventFd, &ev);
+
+    if (!startChatLog(true)) {
+        close(serverSocket);
+        exit(-1);
+    }
+    cout << "服务器启动，等待客户端连接..." << endl;
+    cout << "线程池模式, 工作线程数: " << workers << endl;
+    startStatsService();
+    if (!startFederation()) exit(-1);
+    startInputThread();
+
+    sem_init(&poolReady, 0, 0);
+    vector<pthread_t> tids(workers);
+    for (int i = 0; i < workers; i++) {
+        WorkerQueue* queue = new WorkerQueue();
+        pthread_mutex_init(&queue->mutex, nullptr);
+        workerQueues.push_back(queue);
+    }
+    for (int i = 0; i < workers; i++) {
+        pthread_create(&tids[i], nullptr, poolWorkerLoop, (void*)(intptr_t)i);
+    }
+
+    // 主线程负责 accept 和等待就绪, 自己不处理消息
+    struct epoll_event events[MAX_EVENTS];
+    int timeout = -1;
+    while (serverRunning) {
+        int n = epoll_wait(poolEpollFd, events, MAX_EVENTS, timeout);
+        if (n < 0 && errno != EINTR) break;
+        for (int i = 0; i < n; i++) {
+            void* ptr = events[i].data.ptr;
+            if (ptr == nullptr) {
+                acceptPoolConnections();
+            } else if (ptr == &poolWakeFd) {
+                uint64_t value;
+                read(poolWakeFd, &value, sizeof(value));
+                armPoolFlushes();
+            } else if (ptr == &poolWriteEpollFd) {
+                servePoolFlushes();
+            } else if (ptr != &shutdownEventFd) {
+                dispatchPoolTask((PoolSession*)ptr);
+            }
+        }
+        timeout = releasePoolDelayed();
+    }
+
+    for (int i = 0; i < workers; i++) {
+        sem_post(&poolReady);
+    }
+    for (int i = 0; i < workers; i++) {
+        pthread_join(tids[i], nullptr);
+    }
+}
+
+void runReactors() {
+    connTable.assign(maxOpenFiles(), nullptr);
+    shutdownEventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    int threads = reactorCount;
+    if (threads <= 0) {
+        threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+        if (threads <= 0) threads = 1;
+    }
+    // 房间的 shardMask 每个分片占一位
+    threads = min(threads, MAX_REACTORS);
+    if (useIoUring) {
+        // 先试建一个, 内核太旧或禁用了 io_uring 时退回 epoll
+        IoRing* probe = createIoRing();
+        if (probe == nullptr) {
+            cout << "io_uring 不可用 (" << strerror(errno) << "), 改用 epoll" << endl;
+            useIoUring = false;
+        } else {
+            destroyIoRing(probe);
+        }
+    }
+    if (useIoUring && zeroCopyThreshold > 0) {
+        cout << "io_uring 后端不支持 MSG_ZEROCOPY, 已关闭" << endl;
+        zeroCopyThreshold = 0;
+    }
+
+    // epoll 模式不使用公共的 serverSocket, 每个分片各自监听同一端口
+    close(serverSocket);
+    serverSocket = -1;
+    for (int i = 0; i < threads; i++) {
+        Reactor* r = new Reactor();
+        r->id = i;
+        r->epollFd = epoll_create1(EPOLL_CLOEXEC);
+        r->listenFd = takeoverFd == -1 ? openReusePortListener() : -1;
+        r->mailEventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        r->mailHead.store(nullptr);
+        r->mailSignaled.store(false);
+        initTimerWheel(r->timers);
+        if (r->epollFd == -1 || (r->listenFd == -1 && takeoverFd == -1) || r->mailEventFd == -1) {
+            cout << "绑定地址失败" << endl;
+            exit(-1);
+        }
+        reactors.push_back(r);
+    }
+    // 房间按分片数建立订阅表, 日志恢复和热重启接管都必须在 reactor 创建之后
+    if (takeoverFd != -1) {
+        if (!takeOverState()) exit(-1);
+    } else if (!startChatLog(true)) {
+        exit(-1);
+    }
+    cout << "服务器启动，等待客户端连接..." << endl;
+    cout << "epoll 模式, reactor 分片数: " << threads << (useIoUring ? ", 收发使用 io_uring" : "") << endl;
+    startStatsService();
+    if (!startFederation()) exit(-1);
+    startInputThread();
+
+    while (true) {
+        for (int i = 0; i < threads; i++) {
+            pthread_create(&reactors[i]->tid, nullptr, reactorLoop, reactors[i]);
+        }
+        for (int i = 0; i < threads; i++) {
+            pthread_join(reactors[i]->tid, nullptr);
+        }
+        if (!handoffPending) break;
+        if (handOffState()) {
+            handedOff = true;
+            return;
+        }
+        uint64_t value;
+        read(shutdownEventFd, &value, sizeof(value));
+        cout << "热重启失败, 继续服务" << endl;
+        handoffPending = false;
+    }
+    for (int i = 0; i < threads; i++) {
+        close(reactors[i]->listenFd);
+    }
+    close(shutdownEventFd);
+}
+
+void startServer() {
+    if (serverMode == MODE_EPOLL) {
+        runReactors();
+    } else if (serverMode == MODE_POOL) {
+        runWorkerPool();
+    } else {
+        runThreadPerClient();
+    }
+}
+
+void printUsage(const char* prog) {
+    cout << "用法: " << prog << " [--mode thread|epoll|pool] [--threads N] [--slow-policy drop-oldest|disconnect|coalesce]"
+         << " [--outq-bytes N] [--outq-msgs N] [--zerocopy N] [--history-bytes N] [--history-total-bytes N] [--history-replay N]"
+         << " [--log-dir DIR] [--log-segment-bytes N] [--search-bytes N] [--mailbox-bytes N] [--stats-sock PATH] [--resume-grace SEC] [--resume-bytes N]"
+         << " [--rate-msgs N] [--rate-bytes N] [--rate-burst SEC] [--rate-policy reject|delay|disconnect]"
+         << " [--attach-max-bytes N] [--spool-dir DIR] [--tls-cert FILE --tls-key FILE] [--heartbeat SEC] [--idle-timeout SEC]"
+         << " [--io epoll|uring] [--port N] [--node-id N] [--relay-port N] [--peer HOST:PORT]... [--takeover-fd N]" << endl;
+    cout << "  --mode     thread: 每个客户端一个线程 (原模型); epoll: 边缘触发 reactor (默认);"
+         << " pool: 固定数量的工作线程, 就绪的连接分派到各线程的队列, 空闲线程互相窃取任务" << endl;
+    cout << "  --threads  epoll 模式下的 reactor 分片数, 每个分片一个线程和一个 SO_REUSEPORT 监听套接字, 默认等于 CPU 核数, 最多 " << MAX_REACTORS << endl;
+    cout << "             pool 模式下的工作线程数, 默认等于 CPU 核数" << endl;
+    cout << "  --io       epoll 模式下的收发方式: epoll (默认) 或 io_uring (多次触发的 accept/recv、缓冲区环,"
+         << " 一轮的全部发送合并成一次系统调用; 需要 Linux 6.0 以上, 不支持热重启和 MSG_ZEROCOPY)" << endl;
+    cout << "  --slow-policy  发送队列超限时: 丢弃最早消息 (默认) / 断开 / 合并为跳过提示" << endl;
+    cout << "  --outq-bytes   每个客户端发送队列的字节上限, 默认 1 MiB" << endl;
+    cout << "  --outq-msgs    每个客户端发送队列的消息条数上限, 默认 1024" << endl;
+    cout << "  --zerocopy     单次发送不少于 N 字节时使用 MSG_ZEROCOPY, 默认关闭" << endl;
+    cout << "  --history-bytes    每个房间的历史消息环形缓冲区字节数上限, 按需增长, 默认 64 KiB, 0 表示关闭" << endl;
+    cout << "  --history-total-bytes  所有房间的历史合计的上限, 用完时先回收没有成员的房间的历史, 默认 64 MiB" << endl;
+    cout << "  --history-replay   进入房间时回放的最近消息条数, 默认 20" << endl;
+    cout << "  --log-dir          把公开消息和私聊写入该目录下的追加日志, 启动时从中恢复房间历史; 默认不写" << endl;
+    cout << "  --log-segment-bytes    单个日志段的大小上限, 默认 64 MiB" << endl;
+    cout << "  --search-bytes     /search 全文检索索引的内存预算, 超出后淘汰最旧的消息, 默认 64 MiB, 0 表示关闭;"
+         << " 开启日志时启动后从日志重建" << endl;
+    cout << "  --mailbox-bytes    发给不在线用户的私聊存进信箱, 登录时一次送达; 所有信箱共用的内存, 默认 16 MiB,"
+         << " 用完后落盘到暂存目录 (最多 " << MAILBOX_SPILL_RATIO << " 倍), 每个信箱最多 " << (MAILBOX_USER_BYTES >> 10) << " KiB; 0 表示关闭."
+         << " 只给在本节点登录过的用户存信, 信箱最多 " << MAILBOX_MAX_BOXES << " 个, 每个发送者最多存 " << (MAILBOX_SENDER_BYTES >> 10) << " KiB" << endl;
+    cout << "  --stats-sock       在该路径上开启 Unix 域套接字, 每个连接返回一份运行统计" << endl;
+    cout << "  --resume-grace     续传协议的客户端断线后会话保留的秒数, 期间重连只补发缺失的消息; 默认 30, 0 表示关闭" << endl;
+    cout << "  --resume-bytes     每个续传会话为补发保留的最近消息字节数, 默认 256 KiB" << endl;
+    cout << "  --rate-msgs        每个会话每秒最多发送的消息条数, 默认不限" << endl;
+    cout << "  --rate-bytes       每个会话每秒最多发送的消息字节数, 默认不限" << endl;
+    cout << "  --rate-burst       限速允许的突发量, 按几秒的配额计, 默认 2" << endl;
+    cout << "  --rate-policy      超过限速时: 丢弃消息并提示 (默认) / 暂停读取直到配额恢复 / 断开" << endl;
+    cout << "  --attach-max-bytes 用 /send 发送的单个附件的大小上限, 默认 256 MiB, 0 表示不接收附件 (只支持 epoll 后端);"
+         << " 暂存中的附件合计不超过它的 " << ATTACH_SPOOL_RATIO << " 倍, 每个接收方最多 " << ATTACH_PER_RECEIVER << " 个" << endl;
+    cout << "  --spool-dir        上传中的附件和落盘的离线私聊的暂存目录, 默认 /tmp" << endl;
+    cout << "  --tls-cert         客户端端口改用 TLS, 指定 PEM 格式的证书链; 内核支持时加密交给 kTLS,"
+         << " 否则在用户态加解密 (只支持 epoll 后端, 不支持热重启; 中继链路仍是明文)" << endl;
+    cout << "  --tls-key          证书对应的 PEM 格式私钥" << endl;
+    cout << "  --heartbeat        续传协议和二进制协议的连接静默该秒数后发送心跳, 再过同样久仍无数据则断开 (epoll 模式);"
+         << " 其他连接改用 TCP keepalive 按同样的间隔探测, 对端消失后断开; 默认 30, 0 表示关闭" << endl;
+    cout << "  --idle-timeout     不能应答心跳的连接 (文本和分帧协议) 静默超过该秒数后断开, 默认不限 (epoll 模式)" << endl;
+    cout << "  --port             客户端连接的端口, 默认 " << SERVER_PORT << endl;
+    cout << "  --node-id          联邦中本节点的编号, 各节点不能相同; 同一用户名被两个节点同时接受时编号小的一方保留" << endl;
+    cout << "  --relay-port       加入联邦, 在该端口接收其他节点的中继连接; 在线用户、广播、房间消息和私聊在节点间共享" << endl;
+    cout << "  --peer             其他节点的中继地址, 可以重复指定" << endl;
+    cout << "  --takeover-fd      热重启时由旧进程传入, 从该套接字接管监听套接字和全部连接, 不需要手动指定" << endl;
+    cout << "服务器控制台命令: exit 关闭服务器; stats 查看运行统计; queues 查看各客户端发送队列;"
+         << " search 查询 全文检索; upgrade [程序路径] 热重启 (epoll 模式, 默认重新执行当前程序); 其他输入作为系统消息广播" << endl;
+}
+
+bool parseArgs(int argc, char* argv[]) {
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--mode" && i + 1 < argc) {
+            string mode = argv[++i];
+            if (mode == "thread") serverMode = MODE_THREAD;
+            else if (mode == "epoll") serverMode = MODE_EPOLL;
+            else if (mode == "pool") serverMode = MODE_POOL;
+            else return false;
+        } else if (arg == "--threads" && i + 1 < argc) {
+            reactorCount = atoi(argv[++i]);
+        } else if (arg == "--slow-policy" && i + 1 < argc) {
+            string policy = argv[++i];
+            if (policy == "drop-oldest") slowPolicy = SLOW_DROP_OLDEST;
+            else if (policy == "disconnect") slowPolicy = SLOW_DISCONNECT;
+            else if (policy == "coalesce") slowPolicy = SLOW_COALESCE;
+            else return false;
+        } else if (arg == "--outq-bytes" && i + 1 < argc) {
+            outQueueMaxBytes = strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--outq-msgs" && i + 1 < argc) {
+            outQueueMaxMsgs = strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--zerocopy" && i + 1 < argc) {
+            zeroCopyThreshold = strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--history-bytes" && i + 1 < argc) {
+            historyBytes = strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--history-total-bytes" && i + 1 < argc) {
+            historyTotalBytes = strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--history-replay" && i + 1 < argc) {
+            historyReplay = strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--log-dir" && i + 1 < argc) {
+            logDir = argv[++i];
+        } else if (arg == "--log-segment-bytes" && i + 1 < argc) {
+            logSegmentBytes = strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--search-bytes" && i + 1 < argc) {
+            searchBytes = strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--mailbox-bytes" && i + 1 < argc) {
+            mailboxBytes = strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--stats-sock" && i + 1 < argc) {
+            statsSocketPath = argv[++i];
+        } else if (arg == "--resume-grace" && i + 1 < argc) {
+            resumeGraceSec = atoi(argv[++i]);
+        } else if (arg == "--resume-bytes" && i + 1 < argc) {
+            resumeBytes = strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--rate-msgs" && i + 1 < argc) {
+            rateMsgs = atof(argv[++i]);
+        } else if (arg == "--rate-bytes" && i + 1 < argc) {
+            rateBytes = atof(argv[++i]);
+        } else if (arg == "--rate-burst" && i + 1 < argc) {
+            rateBurstSec = atof(argv[++i]);
+        } else if (arg == "--rate-policy" && i + 1 < argc) {
+            string policy = argv[++i];
+            if (policy == "reject") ratePolicy = RATE_REJECT;
+            else if (policy == "delay") ratePolicy = RATE_DELAY;
+            else if (policy == "disconnect") ratePolicy = RATE_DISCONNECT;
+            else return false;
+        } else if (arg == "--attach-max-bytes" && i + 1 < argc) {
+            attachMaxBytes = strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--spool-dir" && i + 1 < argc) {
+            spoolDir = argv[++i];
+        } else if (arg == "--tls-cert" && i + 1 < argc) {
+            tlsCertPath = argv[++i];
+        } else if (arg == "--tls-key" && i + 1 < argc) {
+            tlsKeyPath = argv[++i];
+        } else if (arg == "--heartbeat" && i + 1 < argc) {
+            heartbeatSec = atoi(argv[++i]);
+        } else if (arg == "--idle-timeout" && i + 1 < argc) {
+            idleTimeoutSec = atoi(argv[++i]);
+        } else if (arg == "--io" && i + 1 < argc) {
+            string io = argv[++i];
+            if (io == "epoll") useIoUring = false;
+            else if (io == "uring") useIoUring = true;
+            else return false;
+        } else if (arg == "--port" && i + 1 < argc) {
+            serverPort = atoi(argv[++i]);
+        } else if (arg == "--node-id" && i + 1 < argc) {
+            nodeId = atoi(argv[++i]);
+            if (nodeId <= 0) return false;
+        } else if (arg == "--relay-port" && i + 1 < argc) {
+            relayPort = atoi(argv[++i]);
+        } else if (arg == "--peer" && i + 1 < argc) {
+            peerAddrs.push_back(argv[++i]);
+        } else if (arg == "--takeover-fd" && i + 1 < argc) {
+            takeoverFd = atoi(argv[++i]);
+            continue;
+        } else {
+            return false;
+        }
+        // 所有选项都带一个参数, 热重启时原样传给新进程
+        serverArgs.push_back(arg);
+        serverArgs.push_back(argv[i]);
+    }
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    if (!parseArgs(argc, argv)) {
+        printUsage(argv[0]);
+        return -1;
+    }
+    if (!tlsCertPath.empty() || !tlsKeyPath.empty()) {
+        if (tlsCertPath.empty() || tlsKeyPath.empty() || serverMode != MODE_EPOLL || useIoUring) {
+            cout << "TLS 需要同时指定 --tls-cert 和 --tls-key, 且只支持 epoll 模式的 epoll 后端" << endl;
+            return -1;
+        }
+        if (!initTls()) return -1;
+    }
+
+    char exePath[PATH_MAX];
+    ssize_t exeLen = readlink("/proc/self/exe", exePath, sizeof(exePath) - 1);
+    if (exeLen > 0) {
+        serverBinaryPath.assign(exePath, exeLen);
+        // 程序文件被新版本覆盖后链接末尾会带上 " (deleted)"
+        const string deleted = " (deleted)";
+        if (serverBinaryPath.size() > deleted.size()
+            && serverBinaryPath.compare(serverBinaryPath.size() - deleted.size(), deleted.size(), deleted) == 0) {
+            serverBinaryPath.resize(serverBinaryPath.size() - deleted.size());
+        }
+    }
+
     pthread_mutex_init(&clientsMutex, nullptr);
+    initNameDirectory();
+    initRoomDirectory();
+    initSearchIndex();
+    initMailboxes();
     if (!createServerSocket()) {
         return -1;
     }
 
     bindAddress();
     startServer();
+    stopChatLog();
+    // 热重启后统计套接字已由新进程重新创建
+    if (!statsSocketPath.empty() && !handedOff) unlink(statsSocketPath.c_str());
 
-    close(serverSocket);  // 服务器退出时关闭 socket
+    if (serverSocket != -1) close(serverSocket);  // 服务器退出时关闭 socket
     pthread_mutex_destroy(&clientsMutex);
     return 0;
 }
@@ -0,0 +1,269 @@
+#include <iostream>
+#include <arpa/inet.h>
+#include <cstring>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <string>
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <cstdio>
+#include <ctime>
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/x509.h>
+
+using namespace std;
+
+// 回环地址上的 TLS 吞吐对比: 明文、用户态 TLS (SSL_write 加密后写套接字, 与服务器内核不支持 kTLS 时的路径相同)
+// 和 kTLS (握手后密钥装进内核, 发送端直接 send/sendfile, 与服务器的广播和附件路径相同).
+// 每种方式测两项: 按 --size 大小连续写 (--size 256 左右接近聊天消息), 以及从文件发送 (明文和 kTLS 用 sendfile,
+// 用户态 TLS 只能 pread 之后 SSL_write). 接收端都用 SSL_read / recv 读完丢弃.
+// 证书和私钥在启动时临时生成, 不需要任何文件. 编译: g++ -O2 -std=c++17 -pthread tls_bench.cpp -o tls_bench -lssl -lcrypto
+
+enum BenchMode { BENCH_PLAIN, BENCH_USER_TLS, BENCH_KTLS };
+
+size_t totalBytes = 256 << 20;  // 每一项发送的字节数
+size_t writeSize = 16384;       // 连续写时每次 send / SSL_write 的字节数
+int fileFd = -1;                // 文件发送用的临时文件, 大小为 totalBytes
+
+EVP_PKEY* benchKey = nullptr;
+X509* benchCert = nullptr;
+
+uint64_t nowNs(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// 临时生成 P-256 私钥和自签名证书
+bool makeCertificate() {
+    benchKey = EVP_EC_gen("P-256");
+    benchCert = X509_new();
+    if (benchKey == nullptr || benchCert == nullptr) return false;
+    X509_set_version(benchCert, 2);
+    ASN1_INTEGER_set(X509_get_serialNumber(benchCert), 1);
+    X509_gmtime_adj(X509_getm_notBefore(benchCert), 0);
+    X509_gmtime_adj(X509_getm_notAfter(benchCert), 3600);
+    X509_NAME* name = X509_get_subject_name(benchCert);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char*)"tls_bench", -1, -1, 0);
+    X509_set_issuer_name(benchCert, name);
+    X509_set_pubkey(benchCert, benchKey);
+    return X509_sign(benchCert, benchKey, EVP_sha256()) > 0;
+}
+
+SSL_CTX* makeContext(bool server, bool ktls) {
+    SSL_CTX* ctx = SSL_CTX_new(server ? TLS_server_method() : TLS_client_method());
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    if (ktls) SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+    if (server) {
+        SSL_CTX_set_num_tickets(ctx, 0);
+        SSL_CTX_use_certificate(ctx, benchCert);
+        SSL_CTX_use_PrivateKey(ctx, benchKey);
+    }
+    return ctx;
+}
+
+// 建一对回环 TCP 连接, sender 为服务器一侧
+bool makeSocketPair(int& sender, int& receiver) {
+    int listenFd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    if (listenFd == -1 || ::bind(listenFd, (struct sockaddr*)&addr, sizeof(addr)) == -1 || listen(listenFd, 1) == -1
+        || getsockname(listenFd, (struct sockaddr*)&addr, &len) == -1) {
+        if (listenFd != -1) close(listenFd);
+        return false;
+    }
+    receiver = socket(AF_INET, SOCK_STREAM, 0);
+    bool ok = connect(receiver, (struct sockaddr*)&addr, sizeof(addr)) == 0;
+    sender = ok ? accept(listenFd, nullptr, nullptr) : -1;
+    close(listenFd);
+    if (sender == -1) {
+        close(receiver);
+        return false;
+    }
+    return true;
+}
+
+struct BenchRun {
+    BenchMode mode;
+    bool fromFile;
+    int fd;
+    SSL_CTX* ctx;
+    atomic<uint64_t> startNs;   // 握手完成、开始发送的时刻
+    uint64_t cpuNs;             // 发送线程消耗的 CPU 时间
+    bool kernelSend;            // kTLS 模式下内核是否接管了发送方向
+    atomic<bool> failed;
+};
+
+bool sendPlain(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n <= 0) return false;
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+void* senderThread(void* arg) {
+    BenchRun* run = (BenchRun*)arg;
+    SSL* ssl = nullptr;
+    if (run->mode != BENCH_PLAIN) {
+        ssl = SSL_new(run->ctx);
+        SSL_set_fd(ssl, run->fd);
+        run->kernelSend = SSL_accept(ssl) == 1 && BIO_get_ktls_send(SSL_get_wbio(ssl));
+        if (!run->kernelSend && run->mode == BENCH_KTLS) {
+            // 握手失败或内核不支持, 关掉连接让接收端退出
+            run->failed = true;
+            SSL_free(ssl);
+            shutdown(run->fd, SHUT_RDWR);
+            return nullptr;
+        }
+    }
+    // 用户态 TLS 用 SSL_write, 明文和 kTLS 直接写套接字
+    bool viaSsl = run->mode == BENCH_USER_TLS;
+    char* buffer = new char[max(writeSize, (size_t)65536)];
+    memset(buffer, 'x', max(writeSize, (size_t)65536));
+    uint64_t cpuStart = nowNs(CLOCK_THREAD_CPUTIME_ID);
+    run->startNs = nowNs(CLOCK_MONOTONIC);
+    size_t sent = 0;
+    while (sent < totalBytes && !run->failed) {
+        ssize_t n;
+        if (run->fromFile && !viaSsl) {
+            off_t offset = sent;
+            n = sendfile(run->fd, fileFd, &offset, totalBytes - sent);
+        } else {
+            size_t len = min(totalBytes - sent, run->fromFile ? (size_t)16384 : writeSize);
+            if (run->fromFile) {
+                n = pread(fileFd, buffer, len, sent);
+                if (n <= 0) break;
+                len = n;
+            }
+            n = viaSsl ? SSL_write(ssl, buffer, len) : (sendPlain(run->fd, buffer, len) ? (ssize_t)len : -1);
+        }
+        if (n <= 0) run->failed = true;
+        else sent += n;
+    }
+    run->cpuNs = nowNs(CLOCK_THREAD_CPUTIME_ID) - cpuStart;
+    delete[] buffer;
+    if (ssl != nullptr) SSL_free(ssl);
+    return nullptr;
+}
+
+void runBench(BenchMode mode, bool fromFile) {
+    static const char* modeNames[] = { "明文      ", "用户态 TLS", "kTLS      " };
+    int sender, receiver;
+    if (!makeSocketPair(sender, receiver)) {
+        cout << "建立回环连接失败: " << strerror(errno) << endl;
+        return;
+    }
+    BenchRun run;
+    run.mode = mode;
+    run.fromFile = fromFile;
+    run.fd = sender;
+    run.ctx = mode == BENCH_PLAIN ? nullptr : makeContext(true, mode == BENCH_KTLS);
+    run.startNs = 0;
+    run.cpuNs = 0;
+    run.kernelSend = false;
+    run.failed = false;
+    pthread_t tid;
+    pthread_create(&tid, nullptr, senderThread, &run);
+
+    SSL_CTX* clientCtx = nullptr;
+    SSL* ssl = nullptr;
+    if (mode != BENCH_PLAIN) {
+        clientCtx = makeContext(false, mode == BENCH_KTLS);
+        ssl = SSL_new(clientCtx);
+        SSL_set_fd(ssl, receiver);
+        if (SSL_connect(ssl) != 1) {
+            run.failed = true;
+            shutdown(receiver, SHUT_RDWR);
+        }
+    }
+    char* buffer = new char[1 << 16];
+    size_t received = 0;
+    while (received < totalBytes && !run.failed) {
+        int n = ssl != nullptr ? SSL_read(ssl, buffer, 1 << 16) : recv(receiver, buffer, 1 << 16, 0);
+        if (n <= 0) break;
+        received += n;
+    }
+    uint64_t endNs = nowNs(CLOCK_MONOTONIC);
+    pthread_join(tid, nullptr);
+
+    const char* what = fromFile ? "文件发送" : "连续写  ";
+    if (mode == BENCH_KTLS && run.failed && !run.kernelSend) {
+        cout << modeNames[mode] << "  " << what << "  内核不支持 kTLS (TCP_ULP \"tls\" 不可用), 跳过" << endl;
+    } else if (received < totalBytes) {
+        cout << modeNames[mode] << "  " << what << "  失败, 只收到 " << received << " 字节" << endl;
+    } else {
+        double seconds = (endNs - run.startNs) / 1e9;
+        printf("%s  %s  %9.1f MB/s  发送线程 CPU %.2f 秒\n", modeNames[mode], what,
+               totalBytes / seconds / (1 << 20), run.cpuNs / 1e9);
+    }
+    delete[] buffer;
+    if (ssl != nullptr) SSL_free(ssl);
+    if (clientCtx != nullptr) SSL_CTX_free(clientCtx);
+    if (run.ctx != nullptr) SSL_CTX_free(run.ctx);
+    close(sender);
+    close(receiver);
+}
+
+void printUsage(const char* prog) {
+    cout << "用法: " << prog << " [--bytes N] [--size N]" << endl;
+    cout << "  --bytes    每一项发送的字节数, 默认 256 MiB" << endl;
+    cout << "  --size     连续写时每次写入的字节数, 默认 16384" << endl;
+}
+
+bool parseArgs(int argc, char* argv[]) {
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (i + 1 >= argc) return false;
+        if (arg == "--bytes") totalBytes = strtoull(argv[++i], nullptr, 10);
+        else if (arg == "--size") writeSize = strtoull(argv[++i], nullptr, 10);
+        else return false;
+    }
+    return totalBytes > 0 && writeSize > 0;
+}
+
+int main(int argc, char* argv[]) {
+    if (!parseArgs(argc, argv)) {
+        printUsage(argv[0]);
+        return -1;
+    }
+    if (!makeCertificate()) {
+        cout << "生成临时证书失败" << endl;
+        return -1;
+    }
+    char path[] = "/tmp/tls_bench_XXXXXX";
+    fileFd = mkstemp(path);
+    if (fileFd == -1) {
+        cout << "创建临时文件失败: " << strerror(errno) << endl;
+        return -1;
+    }
+    unlink(path);
+    char block[1 << 16];
+    memset(block, 'y', sizeof(block));
+    for (size_t written = 0; written < totalBytes; written += sizeof(block)) {
+        if (write(fileFd, block, min(sizeof(block), totalBytes - written)) <= 0) {
+            cout << "写临时文件失败: " << strerror(errno) << endl;
+            return -1;
+        }
+    }
+
+    cout << "每项 " << totalBytes << " 字节, 连续写每次 " << writeSize << " 字节" << endl;
+    for (int fromFile = 0; fromFile <= 1; fromFile++) {
+        runBench(BENCH_PLAIN, fromFile);
+        runBench(BENCH_USER_TLS, fromFile);
+        runBench(BENCH_KTLS, fromFile);
+    }
+    close(fileFd);
+    return 0;
+}